@@ -0,0 +1,616 @@
+#define _GNU_SOURCE // for wait4()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/*
+ * Author: Mitchell Lord
+ *
+ * Allocator microbenchmarks. The harness only uses the standard malloc() API, so the same code
+ * measures any allocator: bench is linked with the C library's allocator, bench_mallocate with
+ * libmallocate.so, and other allocators can be measured by preloading them into bench:
+ *
+ *   ./bench_mallocate -t 8
+ *   LD_PRELOAD=libjemalloc.so.2 ./bench -a jemalloc -t 8
+ *
+ * Usage: bench [-t max_threads] [-n ops_per_thread] [-a label] [workload...]
+ *
+ * Every workload runs at 1, 2, 4, ... threads up to max_threads, each run in its own process
+ * so its peak RSS is not inflated by earlier runs. For every run it reports:
+ *   ns/op        - wall time divided by the number of operations of one thread,
+ *                  so it stays flat if the allocator scales perfectly.
+ *   p50/p99/p999 - latency of single operations in ns, sampled every SAMPLE_INTERVAL operations.
+ *                  The samples include the cost of reading the clock.
+ *   peak RSS     - maximum resident set size of the run's process.
+ *
+ * The harness keeps its own memory (samples, slot arrays, rings) in mmap()ed pages,
+ * so every call to malloc() is part of a workload.
+ */
+
+// Every SAMPLE_INTERVAL-th operation of each thread is timed on its own.
+#define SAMPLE_INTERVAL 64
+
+#define MAX_THREADS 256
+#define DEFAULT_OPS 1000000
+
+// Live objects per thread in the churn and larson workloads.
+#define CHURN_SLOTS 4096
+#define LARSON_SLOTS 1024
+
+// The larson workload hands each thread's objects to another thread this many times.
+#define LARSON_ROUNDS 16
+
+// Capacity of the queue between a producer and a consumer. A power of two.
+#define RING_SIZE 1024
+
+// The realloc workload grows a buffer from 16 bytes to REALLOC_MAX_SIZE, then starts over.
+#define REALLOC_MAX_SIZE ((size_t)1024 * 1024)
+
+/*
+ * Single-producer single-consumer queue of pointers between a thread that allocates
+ * objects and a thread that frees them.
+ */
+typedef struct Ring
+{
+    _Alignas(64) _Atomic(size_t) head; // next slot the consumer takes
+    _Alignas(64) _Atomic(size_t) tail; // next slot the producer fills
+    void *slots[RING_SIZE];
+} Ring;
+
+/*
+ * State of one benchmark thread.
+ *
+ * Fields:
+ *   id      - position of the thread in the run, from 0.
+ *   seed    - state of the thread's random number generator.
+ *   samples - latencies in ns of the sampled operations.
+ *   count   - number of samples taken.
+ *   start   - time the thread started its operations, in ns.
+ *   end     - time the thread finished them, in ns.
+ */
+typedef struct Worker
+{
+    int id;
+    uint64_t seed;
+    uint32_t *samples;
+    size_t count;
+    uint64_t start;
+    uint64_t end;
+    pthread_t thread;
+} Worker;
+
+typedef struct Workload
+{
+    const char *name;
+    const char *description;
+    void (*run)(Worker *worker);
+} Workload;
+
+/*
+ * Results of one run, written by the run's process into shared memory.
+ */
+typedef struct Result
+{
+    double ns_per_op;
+    uint32_t p50;
+    uint32_t p99;
+    uint32_t p999;
+} Result;
+
+static void pingpong(Worker *worker);
+static void churn(Worker *worker);
+static void xthread(Worker *worker);
+static void larson(Worker *worker);
+static void grow_realloc(Worker *worker);
+
+static const Workload workloads[] = {
+    {"pingpong", "allocate and free one 64-byte object", pingpong},
+    {"churn", "replace random objects of 16 B to 64 KiB", churn},
+    {"xthread", "objects allocated by producers and freed by consumers", xthread},
+    {"larson", "server simulation: objects are freed by other threads", larson},
+    {"realloc", "grow a buffer with realloc() from 16 B to 1 MiB", grow_realloc},
+};
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+// Parameters and shared state of the current run.
+static size_t ops_per_thread = DEFAULT_OPS;
+static const Workload *current = NULL;
+static int run_threads = 1;
+static pthread_barrier_t barrier;
+static Ring *rings = NULL;
+static void **larson_slots = NULL;
+
+static int run_workload(const Workload *workload, int threads, Result *result, long *peak_rss);
+static void *worker_main(void *arg);
+static void sample(Worker *worker, uint64_t start);
+static uint64_t now_ns(void);
+static uint64_t next_random(uint64_t *seed);
+static size_t random_size(uint64_t *seed);
+static void touch(void *ptr, size_t size);
+static void *map_memory(size_t size);
+static int compare_samples(const void *a, const void *b);
+
+int main(int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : (int)cpus;
+#ifdef BENCH_ALLOCATOR
+    const char *label = BENCH_ALLOCATOR;
+#else
+    const char *label = "system";
+#endif
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:a:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'n':
+            ops_per_thread = strtoull(optarg, NULL, 10);
+            break;
+        case 'a':
+            label = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t max_threads] [-n ops_per_thread] [-a label] [workload...]\n", argv[0]);
+            for (size_t i = 0; i < NUM_WORKLOADS; i++)
+            {
+                fprintf(stderr, "  %-9s %s\n", workloads[i].name, workloads[i].description);
+            }
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (max_threads < 1 || max_threads > MAX_THREADS || ops_per_thread < SAMPLE_INTERVAL)
+    {
+        fprintf(stderr, "%s: invalid thread or operation count\n", argv[0]);
+        return 1;
+    }
+
+    // Run the workloads named on the command line, or all of them.
+    int selected[NUM_WORKLOADS] = {0};
+    int any_selected = 0;
+    for (int i = optind; i < argc; i++)
+    {
+        size_t w = 0;
+        while (w < NUM_WORKLOADS && strcmp(argv[i], workloads[w].name) != 0)
+        {
+            w++;
+        }
+        if (w == NUM_WORKLOADS)
+        {
+            fprintf(stderr, "%s: unknown workload '%s'\n", argv[0], argv[i]);
+            return 1;
+        }
+        selected[w] = 1;
+        any_selected = 1;
+    }
+
+    Result *result = map_memory(sizeof(Result));
+    if (result == NULL)
+    {
+        return 1;
+    }
+
+    printf("allocator: %s, %zu operations per thread\n", label, ops_per_thread);
+    printf("%-9s %7s %9s %8s %8s %8s %11s\n", "workload", "threads", "ns/op", "p50", "p99", "p999", "peak RSS");
+    fflush(stdout);
+
+    int failed = 0;
+    for (size_t w = 0; w < NUM_WORKLOADS; w++)
+    {
+        if (any_selected && !selected[w])
+        {
+            continue;
+        }
+
+        // 1, 2, 4, ... threads, and max_threads itself if it is not a power of two.
+        for (int threads = 1;; threads *= 2)
+        {
+            int count = threads < max_threads ? threads : max_threads;
+            long peak_rss;
+            if (!run_workload(&workloads[w], count, result, &peak_rss))
+            {
+                printf("%-9s %7d    failed\n", workloads[w].name, count);
+                failed = 1;
+            }
+            else
+            {
+                printf("%-9s %7d %9.1f %8u %8u %8u %8ld KB\n", workloads[w].name, count,
+                       result->ns_per_op, result->p50, result->p99, result->p999, peak_rss);
+            }
+            fflush(stdout);
+            if (count == max_threads)
+            {
+                break;
+            }
+        }
+    }
+    return failed;
+}
+
+/*
+ * Runs a workload with 'threads' threads in a child process.
+ * Stores the results of the run in 'result' and the child's peak RSS in KB in 'peak_rss'.
+ *
+ * Returns 1 on success, or 0 if the run failed.
+ */
+static int run_workload(const Workload *workload, int threads, Result *result, long *peak_rss)
+{
+    memset(result, 0, sizeof(*result));
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        return 0;
+    }
+    if (pid == 0)
+    {
+        current = workload;
+        run_threads = threads;
+
+        size_t capacity = ops_per_thread / SAMPLE_INTERVAL + 1;
+        Worker *workers = map_memory(threads * sizeof(Worker));
+        uint32_t *samples = map_memory(threads * capacity * sizeof(uint32_t));
+        rings = map_memory(threads * sizeof(Ring));
+        larson_slots = map_memory(threads * LARSON_SLOTS * sizeof(void *));
+        if (workers == NULL || samples == NULL || rings == NULL || larson_slots == NULL)
+        {
+            _exit(1);
+        }
+        pthread_barrier_init(&barrier, NULL, threads);
+
+        for (int i = 0; i < threads; i++)
+        {
+            workers[i].id = i;
+            workers[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+            workers[i].samples = samples + i * capacity;
+            if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+            {
+                _exit(1);
+            }
+        }
+
+        uint64_t start = UINT64_MAX;
+        uint64_t end = 0;
+        size_t count = 0;
+        for (int i = 0; i < threads; i++)
+        {
+            pthread_join(workers[i].thread, NULL);
+            start = workers[i].start < start ? workers[i].start : start;
+            end = workers[i].end > end ? workers[i].end : end;
+
+            // Gather the samples of every thread at the front of the array.
+            memmove(samples + count, workers[i].samples, workers[i].count * sizeof(uint32_t));
+            count += workers[i].count;
+        }
+
+        qsort(samples, count, sizeof(uint32_t), compare_samples);
+        result->ns_per_op = (double)(end - start) / (double)ops_per_thread;
+        result->p50 = count ? samples[count / 2] : 0;
+        result->p99 = count ? samples[count * 99 / 100] : 0;
+        result->p999 = count ? samples[count * 999 / 1000] : 0;
+        _exit(0);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        return 0;
+    }
+    *peak_rss = usage.ru_maxrss;
+    return 1;
+}
+
+/*
+ * Thread function of a run: waits for every thread to be ready, then runs the workload.
+ */
+static void *worker_main(void *arg)
+{
+    Worker *worker = arg;
+    pthread_barrier_wait(&barrier);
+    worker->start = now_ns();
+    current->run(worker);
+    worker->end = now_ns();
+    return NULL;
+}
+
+/*
+ * Allocates and frees a 64-byte object over and over: the fast path of the allocator.
+ * One operation is one malloc() and free() pair.
+ */
+static void pingpong(Worker *worker)
+{
+    for (size_t i = 0; i < ops_per_thread; i++)
+    {
+        uint64_t start = i % SAMPLE_INTERVAL == 0 ? now_ns() : 0;
+        void *ptr = malloc(64);
+        touch(ptr, 64);
+        free(ptr);
+        if (start != 0)
+        {
+            sample(worker, start);
+        }
+    }
+}
+
+/*
+ * Keeps CHURN_SLOTS objects of random sizes alive and replaces a random one per operation.
+ * One operation is one free() and one malloc().
+ */
+static void churn(Worker *worker)
+{
+    void **slots = map_memory(CHURN_SLOTS * sizeof(void *));
+    if (slots == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < ops_per_thread; i++)
+    {
+        size_t slot = next_random(&worker->seed) % CHURN_SLOTS;
+        size_t size = random_size(&worker->seed);
+
+        uint64_t start = i % SAMPLE_INTERVAL == 0 ? now_ns() : 0;
+        free(slots[slot]);
+        slots[slot] = malloc(size);
+        if (start != 0)
+        {
+            sample(worker, start);
+        }
+        touch(slots[slot], size);
+    }
+
+    for (size_t slot = 0; slot < CHURN_SLOTS; slot++)
+    {
+        free(slots[slot]);
+    }
+    munmap(slots, CHURN_SLOTS * sizeof(void *));
+}
+
+/*
+ * Pairs threads into producers, which allocate objects and pass them on through a ring,
+ * and consumers, which free them. A thread without a partner consumes its own ring,
+ * RING_SIZE / 2 objects at a time. One operation is one malloc() or one free().
+ */
+static void xthread(Worker *worker)
+{
+    int consumer = worker->id % 2 == 1;
+    int alone = !consumer && worker->id + 1 == run_threads;
+    Ring *ring = &rings[worker->id / 2];
+
+    size_t i = 0;
+    while (i < ops_per_thread)
+    {
+        if (consumer)
+        {
+            size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            if (head == atomic_load_explicit(&ring->tail, memory_order_acquire))
+            {
+                sched_yield();
+                continue;
+            }
+            uint64_t start = i % SAMPLE_INTERVAL == 0 ? now_ns() : 0;
+            free(ring->slots[head % RING_SIZE]);
+            if (start != 0)
+            {
+                sample(worker, start);
+            }
+            atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+            i++;
+            continue;
+        }
+
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail - head == RING_SIZE || (alone && tail - head == RING_SIZE / 2))
+        {
+            if (!alone)
+            {
+                sched_yield();
+                continue;
+            }
+            for (; head != tail; head++)
+            {
+                free(ring->slots[head % RING_SIZE]);
+            }
+            atomic_store_explicit(&ring->head, head, memory_order_relaxed);
+        }
+
+        size_t size = random_size(&worker->seed) % 1024 + 16;
+        uint64_t start = i % SAMPLE_INTERVAL == 0 ? now_ns() : 0;
+        void *ptr = malloc(size);
+        if (start != 0)
+        {
+            sample(worker, start);
+        }
+        touch(ptr, size);
+        ring->slots[tail % RING_SIZE] = ptr;
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        i++;
+    }
+
+    // A thread without a partner frees what is left in its ring.
+    if (alone)
+    {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        for (; head != tail; head++)
+        {
+            free(ring->slots[head % RING_SIZE]);
+        }
+    }
+}
+
+/*
+ * Server simulation after Larson and Krishnan: every thread replaces random objects of 16 to
+ * 1024 bytes in a set of LARSON_SLOTS. After each of LARSON_ROUNDS rounds the sets move on to
+ * the next thread, so most objects are freed by a thread other than the one that allocated them.
+ * One operation is one free() and one malloc().
+ */
+static void larson(Worker *worker)
+{
+    void **slots = larson_slots + worker->id * LARSON_SLOTS;
+    for (size_t slot = 0; slot < LARSON_SLOTS; slot++)
+    {
+        size_t size = next_random(&worker->seed) % 1009 + 16;
+        slots[slot] = malloc(size);
+        touch(slots[slot], size);
+    }
+
+    size_t per_round = ops_per_thread / LARSON_ROUNDS;
+    size_t i = 0;
+    for (int round = 0; round < LARSON_ROUNDS; round++)
+    {
+        pthread_barrier_wait(&barrier);
+        slots = larson_slots + ((worker->id + round) % run_threads) * LARSON_SLOTS;
+
+        size_t ops = round + 1 == LARSON_ROUNDS ? ops_per_thread - i : per_round;
+        for (size_t n = 0; n < ops; n++, i++)
+        {
+            size_t slot = next_random(&worker->seed) % LARSON_SLOTS;
+            size_t size = next_random(&worker->seed) % 1009 + 16;
+
+            uint64_t start = i % SAMPLE_INTERVAL == 0 ? now_ns() : 0;
+            free(slots[slot]);
+            slots[slot] = malloc(size);
+            if (start != 0)
+            {
+                sample(worker, start);
+            }
+            touch(slots[slot], size);
+        }
+    }
+
+    pthread_barrier_wait(&barrier);
+    for (size_t slot = 0; slot < LARSON_SLOTS; slot++)
+    {
+        free(slots[slot]);
+    }
+}
+
+/*
+ * Grows a buffer by about 1/16th of its size with every realloc(), like a growing string or
+ * vector with a small growth factor, from 16 bytes up to REALLOC_MAX_SIZE. Then frees it and
+ * starts over. One operation is one realloc().
+ */
+static void grow_realloc(Worker *worker)
+{
+    char *buffer = NULL;
+    size_t size = 16;
+    for (size_t i = 0; i < ops_per_thread; i++)
+    {
+        if (size > REALLOC_MAX_SIZE)
+        {
+            free(buffer);
+            buffer = NULL;
+            size = 16;
+        }
+
+        uint64_t start = i % SAMPLE_INTERVAL == 0 ? now_ns() : 0;
+        char *resized = realloc(buffer, size);
+        if (start != 0)
+        {
+            sample(worker, start);
+        }
+        if (resized == NULL)
+        {
+            break;
+        }
+        buffer = resized;
+        touch(buffer, size);
+        size += size / 16 + 16;
+    }
+    free(buffer);
+}
+
+/*
+ * Records the latency of an operation that started at 'start'.
+ */
+static void sample(Worker *worker, uint64_t start)
+{
+    uint64_t elapsed = now_ns() - start;
+    worker->samples[worker->count++] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+}
+
+/*
+ * Returns the time of a monotonic clock in ns. Never returns 0.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec + 1;
+}
+
+/*
+ * xorshift64* generator.
+ */
+static uint64_t next_random(uint64_t *seed)
+{
+    *seed ^= *seed >> 12;
+    *seed ^= *seed << 25;
+    *seed ^= *seed >> 27;
+    return *seed * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Returns a random allocation size skewed towards small objects, roughly like real programs:
+ * 80% of 16 to 256 bytes, 15% up to 4 KiB and 5% up to 64 KiB.
+ */
+static size_t random_size(uint64_t *seed)
+{
+    uint64_t r = next_random(seed);
+    unsigned int kind = (unsigned int)(r % 100);
+    r >>= 8;
+    if (kind < 80)
+    {
+        return r % 241 + 16;
+    }
+    if (kind < 95)
+    {
+        return r % 3841 + 256;
+    }
+    return r % 61441 + 4096;
+}
+
+/*
+ * Writes the first and last byte of an object, as a program using it would.
+ */
+static void touch(void *ptr, size_t size)
+{
+    if (ptr != NULL)
+    {
+        ((volatile char *)ptr)[0] = 1;
+        ((volatile char *)ptr)[size - 1] = 1;
+    }
+}
+
+/*
+ * Maps zeroed memory for the harness itself, bypassing the allocator under test.
+ * Returns NULL on failure.
+ */
+static void *map_memory(size_t size)
+{
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return memory == MAP_FAILED ? NULL : memory;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
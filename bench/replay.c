@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/allocator.h"
+
+/*
+ * Author: Mitchell Lord
+ *
+ * Replays an allocation trace recorded with mallocate_trace_start() or MALLOCATE_TRACE,
+ * so a real workload can be rerun against any allocator:
+ *
+ *   MALLOCATE_TRACE=app.trace LD_PRELOAD=./libmallocate.so ./app
+ *   ./replay_mallocate app.trace
+ *   ./replay app.trace
+ *   LD_PRELOAD=libjemalloc.so.2 ./replay -a jemalloc app.trace
+ *
+ * Usage: replay [-a label] trace
+ *
+ * Like bench, the harness only uses the standard malloc() API: replay is linked with the C library's
+ * allocator and replay_mallocate with libmallocate.so.
+ *
+ * The calls of all threads are replayed on one thread, in the order of their timestamps,
+ * so every run is the same. Allocations are told apart by the pointers in the trace: each one
+ * maps to the allocation the replay made for it. Frees of memory allocated before the trace
+ * started are skipped, and so are calls that failed when they were recorded.
+ *
+ * Reports:
+ *   ns/op         - time of the replayed calls divided by their number.
+ *   peak RSS      - growth of the resident set size over the replay, at its peak.
+ *   peak live     - maximum number of bytes requested and not freed at the same time.
+ *   fragmentation - the part of the peak RSS growth that did not hold live bytes at their peak.
+ *
+ * The harness keeps the trace and its own tables in mmap()ed memory, touched before
+ * the replay starts, so the RSS growth is the allocator's.
+ */
+
+/*
+ * Slot of the table mapping pointers of the trace to the allocations made for them.
+ * A slot with 'id' 0 is empty. Freed allocations stay in the table with 'ptr' NULL.
+ */
+typedef struct Slot
+{
+    uint64_t id;
+    void *ptr;
+    size_t size;
+} Slot;
+
+static Slot *slots = NULL;
+static size_t slot_mask = 0;
+static size_t live_bytes = 0;
+static size_t peak_live = 0;
+
+static const MallocateTraceRecord *load_trace(const char *path, size_t *count);
+static void sort_records(MallocateTraceRecord *records, MallocateTraceRecord *scratch, size_t count);
+static void replay(const MallocateTraceRecord *record);
+static Slot *find_slot(uint64_t id);
+static void track(uint64_t id, void *ptr, size_t size);
+static void *untrack(uint64_t id);
+static void touch(void *ptr, size_t size);
+static uint64_t now_ns(void);
+static long status_kb(const char *field);
+static void *map_memory(size_t size);
+
+int main(int argc, char **argv)
+{
+#ifdef BENCH_ALLOCATOR
+    const char *label = BENCH_ALLOCATOR;
+#else
+    const char *label = "system";
+#endif
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            label = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-a label] trace\n", argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind + 1 != argc)
+    {
+        fprintf(stderr, "usage: %s [-a label] trace\n", argv[0]);
+        return 1;
+    }
+
+    size_t count;
+    const MallocateTraceRecord *trace = load_trace(argv[optind], &count);
+    if (trace == NULL)
+    {
+        return 1;
+    }
+
+    // Records are sorted within each thread only, so merge the threads by time.
+    MallocateTraceRecord *records = map_memory(2 * count * sizeof(MallocateTraceRecord) + 1);
+    if (records == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+    memcpy(records, trace, count * sizeof(MallocateTraceRecord));
+    sort_records(records, records + count, count);
+
+    // Every record adds at most one allocation, so a table with twice as many slots stays half empty.
+    size_t capacity = 16;
+    while (capacity < 2 * count)
+    {
+        capacity *= 2;
+    }
+    slots = map_memory(capacity * sizeof(Slot));
+    if (slots == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+    memset(slots, 0, capacity * sizeof(Slot));
+    slot_mask = capacity - 1;
+
+    // Reset the peak RSS of the process to its current RSS, so the peak measured is the replay's.
+    int clear = open("/proc/self/clear_refs", O_WRONLY);
+    if (clear >= 0)
+    {
+        if (write(clear, "5", 1) != 1)
+        {
+            fprintf(stderr, "%s: cannot reset the peak RSS, it may include the setup\n", argv[0]);
+        }
+        close(clear);
+    }
+    long rss_before = status_kb("VmRSS:");
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < count; i++)
+    {
+        replay(&records[i]);
+    }
+    uint64_t elapsed = now_ns() - start;
+    long rss_growth = status_kb("VmHWM:") - rss_before;
+
+    double fragmentation = 0;
+    if (rss_growth > 0 && (size_t)rss_growth * 1024 > peak_live)
+    {
+        fragmentation = 1 - (double)peak_live / ((double)rss_growth * 1024);
+    }
+
+    printf("allocator: %s, trace: %s, %zu calls\n", label, argv[optind], count);
+    printf("%11s %11s %11s %13s\n", "ns/op", "peak RSS", "peak live", "fragmentation");
+    printf("%11.1f %8ld KB %8zu KB %13.2f\n", count > 0 ? (double)elapsed / count : 0.0,
+           rss_growth, peak_live / 1024, fragmentation);
+    return 0;
+}
+
+/*
+ * Maps the trace file at 'path', checks its header and touches every record.
+ *
+ * Returns the records and stores their number in 'count', or prints an error and returns NULL.
+ */
+static const MallocateTraceRecord *load_trace(const char *path, size_t *count)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    size_t size = (size_t)st.st_size;
+    const MallocateTraceHeader *header = NULL;
+    if (size >= sizeof(MallocateTraceHeader))
+    {
+        header = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    }
+    close(fd);
+    if (header == NULL || header == MAP_FAILED ||
+        memcmp(header->magic, MALLOCATE_TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != MALLOCATE_TRACE_VERSION || header->record_size != sizeof(MallocateTraceRecord))
+    {
+        fprintf(stderr, "%s: not a trace file of this version\n", path);
+        return NULL;
+    }
+
+    // A trace cut short by a crash ends in a partial record, which is ignored.
+    *count = (size - sizeof(MallocateTraceHeader)) / sizeof(MallocateTraceRecord);
+    return (const MallocateTraceRecord *)(header + 1);
+}
+
+/*
+ * Sorts records by time with a bottom-up merge sort, which is stable, so records of one thread
+ * with the same time keep their order. 'scratch' has room for 'count' records.
+ * qsort() is not used since it may call malloc().
+ */
+static void sort_records(MallocateTraceRecord *records, MallocateTraceRecord *scratch, size_t count)
+{
+    MallocateTraceRecord *from = records;
+    MallocateTraceRecord *to = scratch;
+    for (size_t width = 1; width < count; width *= 2)
+    {
+        for (size_t left = 0; left < count; left += 2 * width)
+        {
+            size_t middle = left + width < count ? left + width : count;
+            size_t right = left + 2 * width < count ? left + 2 * width : count;
+            size_t i = left, j = middle, k = left;
+            while (i < middle && j < right)
+            {
+                to[k++] = from[j].time < from[i].time ? from[j++] : from[i++];
+            }
+            while (i < middle)
+            {
+                to[k++] = from[i++];
+            }
+            while (j < right)
+            {
+                to[k++] = from[j++];
+            }
+        }
+        MallocateTraceRecord *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != records)
+    {
+        memcpy(records, from, count * sizeof(MallocateTraceRecord));
+    }
+}
+
+/*
+ * Makes the call of one record with the allocator under test.
+ */
+static void replay(const MallocateTraceRecord *record)
+{
+    void *ptr;
+    switch (record->op)
+    {
+    case MALLOCATE_TRACE_ALLOC:
+    case MALLOCATE_TRACE_CALLOC:
+    case MALLOCATE_TRACE_ALIGNED:
+        if (record->ptr == 0)
+        {
+            return;
+        }
+        if (record->op == MALLOCATE_TRACE_ALLOC)
+        {
+            ptr = malloc(record->size);
+        }
+        else if (record->op == MALLOCATE_TRACE_CALLOC)
+        {
+            ptr = calloc(1, record->size);
+        }
+        else
+        {
+            ptr = aligned_alloc(record->arg, record->size);
+        }
+        touch(ptr, record->size);
+        track(record->ptr, ptr, record->size);
+        break;
+
+    case MALLOCATE_TRACE_REALLOC:
+        // A failed call left the allocation as it was, a call with size 0 freed it.
+        if (record->ptr == 0 && record->size != 0)
+        {
+            return;
+        }
+        ptr = record->arg != 0 ? untrack(record->arg) : NULL;
+        if (record->size == 0)
+        {
+            free(ptr);
+            return;
+        }
+        ptr = realloc(ptr, record->size);
+        touch(ptr, record->size);
+        track(record->ptr, ptr, record->size);
+        break;
+
+    case MALLOCATE_TRACE_FREE:
+        free(untrack(record->ptr));
+        break;
+    }
+}
+
+/*
+ * Returns the slot of the allocation with trace pointer 'id', or the empty slot where it goes.
+ */
+static Slot *find_slot(uint64_t id)
+{
+    size_t index = (size_t)((id >> 4) * 0x9E3779B97F4A7C15ULL) & slot_mask;
+    while (slots[index].id != 0 && slots[index].id != id)
+    {
+        index = (index + 1) & slot_mask;
+    }
+    return &slots[index];
+}
+
+/*
+ * Records that the allocation with trace pointer 'id' is 'ptr', of 'size' bytes.
+ * An allocation still live under the same id, whose free happened too close to this call
+ * for the timestamps to order them, is freed first.
+ */
+static void track(uint64_t id, void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    Slot *slot = find_slot(id);
+    if (slot->ptr != NULL)
+    {
+        free(slot->ptr);
+        live_bytes -= slot->size;
+    }
+    slot->id = id;
+    slot->ptr = ptr;
+    slot->size = size;
+
+    live_bytes += size;
+    if (live_bytes > peak_live)
+    {
+        peak_live = live_bytes;
+    }
+}
+
+/*
+ * Forgets the allocation with trace pointer 'id'.
+ *
+ * Returns the allocation, or NULL if it was made before the trace started.
+ */
+static void *untrack(uint64_t id)
+{
+    Slot *slot = find_slot(id);
+    void *ptr = slot->ptr;
+    if (ptr != NULL)
+    {
+        live_bytes -= slot->size;
+        slot->ptr = NULL;
+    }
+    return ptr;
+}
+
+/*
+ * Writes a byte in every page of an allocation, as the traced program probably used all of it,
+ * so its memory counts in the RSS.
+ */
+static void touch(void *ptr, size_t size)
+{
+    if (ptr == NULL || size == 0)
+    {
+        return;
+    }
+    for (size_t offset = 0; offset < size; offset += 4096)
+    {
+        ((volatile char *)ptr)[offset] = 1;
+    }
+    ((volatile char *)ptr)[size - 1] = 1;
+}
+
+/*
+ * Returns the time of a monotonic clock in ns.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Returns a field of /proc/self/status given in KB, like "VmRSS:", or 0 if it cannot be read.
+ * Reads the file without stdio, which would allocate.
+ */
+static long status_kb(const char *field)
+{
+    static char buffer[8192];
+    int fd = open("/proc/self/status", O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0)
+    {
+        return 0;
+    }
+    buffer[length] = '\0';
+
+    char *line = strstr(buffer, field);
+    return line != NULL ? strtol(line + strlen(field), NULL, 10) : 0;
+}
+
+/*
+ * Maps zeroed memory for the harness itself, bypassing the allocator under test.
+ * Returns NULL on failure.
+ */
+static void *map_memory(size_t size)
+{
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    return memory == MAP_FAILED ? NULL : memory;
+}
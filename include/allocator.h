@@ -2,10 +2,172 @@
 #define ALLOCATOR_H
 
 #include <stddef.h> // for size_t
+#include <stdint.h> // for the fixed-size fields of trace records
+
+// Options for mallocate_set_option().
+#define MALLOCATE_MMAP_THRESHOLD 1   // requests of at least this many bytes get their own mapping
+#define MALLOCATE_TRIM_THRESHOLD 2   // releasable bytes at the top of the heap before it is shrunk
+#define MALLOCATE_PURGE_THRESHOLD 3  // free block size from which freed pages are released
+#define MALLOCATE_HUGE_PAGES 4       // back heap chunks with huge pages, one of the values below
+#define MALLOCATE_PROFILE_INTERVAL 5 // mean bytes allocated between heap profile samples, 0 to stop
+#define MALLOCATE_DECAY_TIME 6       // ms over which a background thread releases free pages, 0 to release them in mfree()
+#define MALLOCATE_PURGE_RATE 7       // bytes per second the background thread releases at most, 0 for no limit
+#define MALLOCATE_ISOLATE_LINES 8    // 1 to give every new object whole cache lines of its own, against false sharing
+#define MALLOCATE_GUARD_INTERVAL 9   // mean allocations between ones placed between guard pages, 0 to stop
+#define MALLOCATE_LATENCY 10         // 1 to time every allocation and mfree() call into latency histograms
+
+// Values of MALLOCATE_HUGE_PAGES. Also read from the MALLOCATE_HUGE_PAGES environment variable.
+#define MALLOCATE_HUGE_OFF 0         // 4 KiB pages, arena 0 grows with sbrk()
+#define MALLOCATE_HUGE_TRANSPARENT 1 // 2 MiB-aligned chunks with madvise(MADV_HUGEPAGE)
+#define MALLOCATE_HUGE_EXPLICIT 2    // chunks from the reserved huge pages (MAP_HUGETLB) while they last
+
+// Size classes counted by mallocate_stats(): small objects of 16, 32, ..., 512 bytes,
+// then blocks allocated from an arena, then blocks with their own mapping.
+#define MALLOCATE_SMALL_CLASSES 32
+#define MALLOCATE_CLASS_BLOCK MALLOCATE_SMALL_CLASSES
+#define MALLOCATE_CLASS_MAPPED (MALLOCATE_SMALL_CLASSES + 1)
+#define MALLOCATE_NUM_CLASSES (MALLOCATE_SMALL_CLASSES + 2)
+
+/*
+ * Snapshot of the allocator's statistics, filled in by mallocate_stats().
+ * Sizes are usable sizes, which may be larger than what was requested.
+ */
+typedef struct MallocateStats
+{
+    size_t allocated;                     // bytes in use by the program
+    size_t mapped;                        // bytes obtained from the system with sbrk() and mmap()
+    size_t free;                          // bytes of free blocks and free small object slots
+    double fragmentation;                 // free / (allocated + free), or 0 if both are 0
+    size_t allocs[MALLOCATE_NUM_CLASSES]; // allocations per size class
+    size_t frees[MALLOCATE_NUM_CLASSES];  // frees per size class
+    size_t sbrk_calls;                    // calls moving the break
+    size_t mmap_calls;                    // calls to mmap(), munmap() and mremap()
+    size_t lock_contentions;              // lock acquisitions that had to wait for another thread
+    size_t huge_mapped;                   // bytes of chunks mapped to be backed by huge pages
+    size_t huge_backed;                   // bytes of those chunks backed by huge pages right now
+} MallocateStats;
+
+// Calls timed by mallocate_latency() once MALLOCATE_LATENCY is set.
+#define MALLOCATE_LATENCY_ALLOC 0 // mallocate(), mcalloc() and maligned_alloc()
+#define MALLOCATE_LATENCY_FREE 1  // mfree()
+
+// Buckets of a latency histogram. Latencies of up to 7 ns have a bucket each, and every power of
+// two above is split in 8 buckets, so a bucket is at most 12.5% wide. The last bucket also holds
+// everything slower than 2^36 ns. mallocate_latency_bound() gives the lowest latency of a bucket.
+#define MALLOCATE_LATENCY_BUCKETS 272
+
+/*
+ * Histogram of the latencies of one kind of call, filled in by mallocate_latency().
+ */
+typedef struct MallocateLatency
+{
+    size_t count;                              // calls timed
+    size_t buckets[MALLOCATE_LATENCY_BUCKETS]; // calls per latency bucket
+} MallocateLatency;
+
+// Operations of a trace record, see mallocate_trace_start().
+#define MALLOCATE_TRACE_ALLOC 1   // mallocate() or mallocate_batch() returned 'ptr' for 'size' bytes
+#define MALLOCATE_TRACE_CALLOC 2  // mcalloc() returned 'ptr' for 'size' zeroed bytes
+#define MALLOCATE_TRACE_ALIGNED 3 // maligned_alloc() returned 'ptr' for 'size' bytes aligned to 'arg'
+#define MALLOCATE_TRACE_REALLOC 4 // mrealloc() resized 'arg' to 'size' bytes at 'ptr'
+#define MALLOCATE_TRACE_FREE 5    // mfree() or mfree_batch() freed 'ptr'
+
+// A trace file is a MallocateTraceHeader followed by records, sorted by time within each thread only.
+#define MALLOCATE_TRACE_MAGIC "MALTRACE"
+#define MALLOCATE_TRACE_VERSION 1
+
+typedef struct MallocateTraceHeader
+{
+    char magic[8];        // MALLOCATE_TRACE_MAGIC, without its terminating zero
+    uint32_t version;     // MALLOCATE_TRACE_VERSION
+    uint32_t record_size; // sizeof(MallocateTraceRecord)
+} MallocateTraceHeader;
+
+/*
+ * One traced call. Pointers only identify allocations: the same value in two records is
+ * the same allocation, as long as it was not freed in between. A failed call has 'ptr' 0.
+ */
+typedef struct MallocateTraceRecord
+{
+    uint64_t time;   // ns since the trace started
+    uint64_t ptr;    // the allocation returned or freed
+    uint64_t arg;    // the alignment, or the allocation resized, depending on op
+    uint64_t size;   // bytes requested
+    uint32_t thread; // thread that made the call, numbered from 1 in order of its first traced call
+    uint32_t op;     // MALLOCATE_TRACE_ALLOC ... MALLOCATE_TRACE_FREE
+} MallocateTraceRecord;
+
+// Region of objects bump-allocated from chunks of the allocator and freed all at once.
+// Not thread-safe. See src/region.c.
+typedef struct Region Region;
+
+// Pool of objects of one size, packed in slabs taken from the allocator, with optional
+// per-thread magazines. Thread-safe. See src/pool.c.
+typedef struct Pool Pool;
+
+// Heap kept in a memory-mapped file, found intact by the next process that opens it.
+// Thread-safe. See src/pheap.c.
+typedef struct PHeap PHeap;
+
+// Handle of a movable object, whose address is only valid while it is pinned.
+// Thread-safe. See src/handle.c. 0 is never a valid handle.
+typedef uint64_t MHandle;
+
+// Values of pheap_status().
+#define PHEAP_CREATED 0   // the file was new or empty
+#define PHEAP_CLEAN 1     // the heap was closed with pheap_close()
+#define PHEAP_RECOVERED 2 // the heap was not closed, and passed the consistency check
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 void *mallocate(size_t size);
+void *maligned_alloc(size_t alignment, size_t size);
+void *mcalloc(size_t count, size_t size);
 void mfree(void *ptr);
+void *mrealloc(void *ptr, size_t size);
+size_t musable_size(void *ptr);
+void mflush_cache(void);
+size_t mallocate_batch(size_t size, size_t n, void **out);
+void mfree_batch(void **ptrs, size_t n);
+int mallocate_set_option(int option, size_t value);
+void mallocate_stats(MallocateStats *stats);
+int mallocate_trace_start(const char *path);
+void mallocate_trace_stop(void);
+int mallocate_profile_dump(const char *path);
+int mallocate_latency(int op, MallocateLatency *histogram);
+uint64_t mallocate_latency_bound(size_t bucket);
+uint64_t mallocate_latency_percentile(const MallocateLatency *histogram, double fraction);
+Region *region_create(size_t chunk_size);
+void *region_alloc(Region *region, size_t size);
+void region_reset(Region *region);
+void region_destroy(Region *region);
+Pool *mpool_create(size_t obj_size, size_t align);
+void *mpool_alloc(Pool *pool);
+void mpool_free(Pool *pool, void *ptr);
+int mpool_enable_magazines(Pool *pool, unsigned int capacity);
+void mpool_destroy(Pool *pool);
+PHeap *pheap_open(const char *path, size_t size);
+int pheap_close(PHeap *heap);
+int pheap_status(PHeap *heap);
+void *pheap_alloc(PHeap *heap, size_t size);
+void pheap_free(PHeap *heap, void *ptr);
+void *pheap_root(PHeap *heap);
+void pheap_set_root(PHeap *heap, void *ptr);
+uint64_t pheap_offset(PHeap *heap, void *ptr);
+void *pheap_pointer(PHeap *heap, uint64_t offset);
+MHandle mhandle_alloc(size_t size);
+void mhandle_free(MHandle handle);
+void *mhandle_pin(MHandle handle);
+void mhandle_unpin(MHandle handle);
+int mhandle_compact(uint64_t budget_ns);
 int is_aligned(void *ptr);
 void print_blocks(void);
+int check_blocks(void);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -0,0 +1,204 @@
+#ifndef ALLOCATOR_HPP
+#define ALLOCATOR_HPP
+
+#include <cstddef>         // for std::size_t
+#include <cstdint>         // for std::uintptr_t
+#include <limits>          // for std::numeric_limits
+#include <memory_resource> // for std::pmr::memory_resource
+#include <new>             // for std::bad_alloc, std::bad_array_new_length
+
+#include "allocator.h"
+
+/*
+ * Author: Mitchell Lord
+ *
+ * C++ adapters over the allocator, header-only, so C++ code can put chosen containers on it
+ * without replacing the global operator new or malloc():
+ *
+ *   mallocator::resource        - std::pmr::memory_resource over mallocate() and mfree()
+ *   mallocator::region_resource - monotonic std::pmr::memory_resource over a Region
+ *   mallocator::allocator<T>    - std::allocator-compatible allocator over mallocate()
+ *
+ *   std::pmr::vector<int> numbers(mallocator::default_resource());
+ *   std::map<int, Node, std::less<int>, mallocator::allocator<std::pair<const int, Node>>> nodes;
+ *
+ * Failures throw std::bad_alloc like operator new. Requires C++17.
+ */
+
+namespace mallocator
+{
+
+// Alignment of everything mallocate() returns. Larger alignments go through maligned_alloc().
+inline constexpr std::size_t natural_alignment = 16;
+
+namespace detail
+{
+
+/*
+ * Allocates 'bytes' bytes aligned to 'alignment', a power of two.
+ * Throws std::bad_alloc if the memory could not be allocated.
+ */
+inline void *allocate(std::size_t bytes, std::size_t alignment)
+{
+    void *ptr = alignment <= natural_alignment ? mallocate(bytes) : maligned_alloc(alignment, bytes);
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+} // namespace detail
+
+/*
+ * Memory resource allocating with mallocate(), or maligned_alloc() for alignments above
+ * natural_alignment. Objects of up to 512 bytes come from the calling thread's cache and slabs.
+ *
+ * The size and alignment passed to deallocate() are not needed: mfree() finds the
+ * block from the pointer. All instances are interchangeable, so any of them may free
+ * memory another one allocated.
+ */
+class resource : public std::pmr::memory_resource
+{
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        return detail::allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *ptr, std::size_t, std::size_t) override
+    {
+        mfree(ptr);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return dynamic_cast<const resource *>(&other) != nullptr;
+    }
+};
+
+/*
+ * Returns a resource shared by the whole program, to pass to pmr containers.
+ */
+inline resource *default_resource() noexcept
+{
+    static resource shared;
+    return &shared;
+}
+
+/*
+ * Monotonic memory resource over a Region: allocation is a pointer bump, deallocate() does
+ * nothing, and release() frees everything at once while keeping the region's chunks for reuse.
+ * The destructor gives the chunks back to the allocator.
+ *
+ * Like the Region, it is not thread-safe. Alignments above natural_alignment are reached by
+ * allocating extra bytes.
+ */
+class region_resource : public std::pmr::memory_resource
+{
+public:
+    // Takes chunks of 'chunk_size' bytes from the allocator, or the Region's default if 0.
+    explicit region_resource(std::size_t chunk_size = 0) : region_(region_create(chunk_size))
+    {
+        if (region_ == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+    }
+
+    region_resource(const region_resource &) = delete;
+    region_resource &operator=(const region_resource &) = delete;
+
+    ~region_resource() override
+    {
+        region_destroy(region_);
+    }
+
+    // Frees every object allocated from the resource, see region_reset().
+    void release() noexcept
+    {
+        region_reset(region_);
+    }
+
+    Region *region() const noexcept
+    {
+        return region_;
+    }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        std::size_t extra = alignment > natural_alignment ? alignment - natural_alignment : 0;
+        if (bytes > std::numeric_limits<std::size_t>::max() - extra)
+        {
+            throw std::bad_alloc();
+        }
+        void *ptr = region_alloc(region_, bytes + extra);
+        if (ptr == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        std::uintptr_t address = reinterpret_cast<std::uintptr_t>(ptr);
+        return reinterpret_cast<void *>((address + alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1));
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) override
+    {
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+
+private:
+    Region *region_;
+};
+
+/*
+ * Allocator for standard containers, allocating with mallocate(), or maligned_alloc() for types
+ * aligned above natural_alignment. It is stateless, so all instances compare equal.
+ */
+template <class T>
+class allocator
+{
+public:
+    using value_type = T;
+
+    allocator() noexcept = default;
+
+    template <class U>
+    allocator(const allocator<U> &) noexcept
+    {
+    }
+
+    T *allocate(std::size_t n)
+    {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+        {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T *>(detail::allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *ptr, std::size_t) noexcept
+    {
+        mfree(ptr);
+    }
+};
+
+template <class T, class U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept
+{
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept
+{
+    return false;
+}
+
+} // namespace mallocator
+
+#endif
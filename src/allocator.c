@@ -1,8 +1,22 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for mremap()
+#endif
 #include "../include/allocator.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 /*
  * Author: Mitchell Lord
@@ -10,11 +24,71 @@
  * My custom implementation of malloc and free from stdlib.h.
  * Allocates memory by calling sbrk() to grow the heap.
  *
- * Uses a singly linked list of Block structs to track allocated and free memory blocks.
- * Each block contains metadata (size, status, next pointer) followed by useable memory.
+ * Memory is tracked as runs of Block headers laid out back to back, so the next block is found
+ * from the size of the current one. Each block has a 16-byte header (previous block size, and its
+ * own size with the free and last-in-run flags packed into the low bits) followed by useable memory.
+ *
+ * Free blocks are additionally kept in segregated free lists (bins) grouped by size class,
+ * so finding a fit never has to look at allocated blocks.
  *
  * Free blocks are reused when possible, and contigous memory blocks are coalesced to
  * reduce fragmentation and manage memory more efficiently.
+ *
+ * The allocator is thread-safe. The heap is split into independent arenas, each with its own
+ * lock, bins, block list and memory. Arena 0 grows with sbrk(), the others map CHUNK_SIZE-aligned
+ * chunks with mmap(). Threads are bound to an arena round-robin on first use, and a block is
+ * always freed back to the arena owning its memory. A block freed by a thread of another arena
+ * is pushed onto the owner's lock-free remote free stack, which the owner drains in a batch the
+ * next time it allocates under its lock.
+ *
+ * The sbrk() heap grows in page-aligned steps that double from MIN_HEAP_GROWTH to MAX_HEAP_GROWTH,
+ * and the unused part of each step stays at the top of the heap as a free block.
+ *
+ * Freed memory is given back to the OS: when at least trim_threshold bytes can be released
+ * from the free block at the top of the sbrk() heap the heap is shrunk, and the whole pages of a freed block that
+ * ends up in a free block of at least purge_threshold bytes are released with madvise().
+ * With MALLOCATE_DECAY_TIME set, mfree() makes no such syscall. A background thread releases
+ * the free blocks that stayed unused for a while instead, the oldest first, so memory
+ * reused soon after it was freed is never released at all.
+ *
+ * Requests of at least mmap_threshold bytes bypass the arenas: each gets its own mapping,
+ * tracked in a hash table of large blocks and unmapped as soon as it is freed.
+ *
+ * Requests of up to SLAB_MAX_SIZE bytes do not use blocks at all. They are served from slabs:
+ * SLAB_SIZE pages holding objects of one size class with no per-object header, whose free slots
+ * are tracked in a bitmap. Slabs are carved out of chunks mapped for slabs only, so mfree() finds
+ * the slab of an object through chunk_map. The slab headers are kept apart from the objects,
+ * in a table at the start of each chunk indexed by page.
+ *
+ * In front of the slabs, every thread keeps a small cache of recently freed small objects
+ * (tcache), so the common mallocate()/mfree() pair takes no lock. The cache is refilled from
+ * and drained to the thread's arena in batches.
+ *
+ * With MALLOCATE_HUGE_PAGES set, arena 0 maps chunks like the other arenas instead of using sbrk(),
+ * and the chunks of every arena ask for huge pages. Freed memory in them is then only released in
+ * whole huge pages, so purging never splits one.
+ *
+ * On machines with several NUMA nodes, every arena belongs to a node and its memory is bound to that
+ * node with mbind(). Threads are bound to an arena of the node they first allocate on, and since
+ * blocks always go back to the arena owning them, memory freed on another node returns home.
+ *
+ * Every allocation call can be recorded to a trace file with mallocate_trace_start() or the
+ * MALLOCATE_TRACE environment variable, and replayed later with bench/replay.c. Each thread
+ * appends records to its own buffer without a lock, and full buffers are written out by
+ * a background thread.
+ *
+ * With MALLOCATE_GUARD_INTERVAL set, about one allocation in that many is placed at the end of a page
+ * of its own, followed by an inaccessible guard page, and the page is made inaccessible too once
+ * the object is freed. Overflows and uses after free of these objects fault, and are reported with
+ * the stacks that allocated and freed them, at a cost proportional to the sampling rate.
+ *
+ * Statistics are counted per thread in the tcache, without atomic read-modify-write operations,
+ * and summed over all threads only when mallocate_stats() is called. With MALLOCATE_LATENCY set,
+ * every allocation and free is also timed into per-thread latency histograms the same way.
+ *
+ * The slow paths (growing the heap, coalescing, refilling and flushing thread caches, waiting for
+ * a lock, releasing pages) carry static probes for bpftrace, perf and other USDT tools. A probe
+ * that is not attached is a single nop.
  */
 
 
@@ -22,37 +96,794 @@
  * Represents a memory block in the allocator.
  * Each allocated block contains metadata followed by usable memory.
  *
+ * The block following this one in memory starts right after its usable memory, unless the
+ * block is the last of its run. The owning arena is found from the address of the block.
+ *
  * Fields:
- *   size - number of bytes of usable memory in the block.
- *   free - 1 if the block is free, 0 if it is allocated.
- *   next - pointer to the next Block in the linked list.
+ *   prev_size - usable size of the block physically before this one (boundary tag),
+ *               or 0 if the block starts a run.
+ *   size      - number of bytes of usable memory in the block. Sizes are multiples of ALIGNMENT,
+ *               so the low bits hold BLOCK_FREE, BLOCK_LAST and BLOCK_REMOTE. Read it with BLOCK_SIZE().
  */
 typedef struct __attribute__((aligned(16))) Block
 {
+    size_t prev_size;
     size_t size;
-    int free;
-    struct Block *next;
 } Block;
 
 // Memory blocks must be aligned to 16-byte boundaries
 #define ALIGNMENT 16
 
+// Objects allocated while MALLOCATE_ISOLATE_LINES is set take whole lines of this size.
+#define CACHE_LINE_SIZE 64
+
+// Flags in the low bits of Block.size.
+#define BLOCK_FREE ((size_t)1) // the block is free
+#define BLOCK_LAST ((size_t)2) // no block follows this one in its run
+#define BLOCK_REMOTE ((size_t)4) // the block is on its arena's remote free stack, waiting to be freed
+#define BLOCK_FLAGS ((size_t)(ALIGNMENT - 1))
+
+#define BLOCK_SIZE(block) ((block)->size & ~BLOCK_FLAGS)
+#define IS_FREE(block) (((block)->size & BLOCK_FREE) != 0)
+
+/*
+ * Header of a run: a contiguous region of memory of an arena, filled with blocks.
+ * The first block of the run follows the header.
+ */
+typedef struct __attribute__((aligned(16))) Run
+{
+    struct Run *next;
+} Run;
+
+#define RUN_HEADER_SIZE sizeof(Run)
+#define RUN_FIRST_BLOCK(run) ((Block *)((char *)(run) + RUN_HEADER_SIZE))
+
 // Size of metadata for each memory block, rounded up to the nearest multiple of ALIGNMENT
 #define ALIGNED_METADATA_SIZE ((sizeof(Block) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
 
 // Minimum size of a memory block: metadata + at least one aligned data unit
 #define MIN_BLOCK_SIZE (ALIGNED_METADATA_SIZE + ALIGNMENT)
 
+/*
+ * Links of a free block inside its size-class bin.
+ * Stored in the usable memory of the block, so they only exist while the block is free.
+ * Every block has at least ALIGNMENT (16) bytes of usable memory, enough for both pointers.
+ */
+typedef struct FreeLinks
+{
+    struct Block *prev;
+    struct Block *next;
+} FreeLinks;
+
+#define FREE_LINKS(block) ((FreeLinks *)((char *)(block) + ALIGNED_METADATA_SIZE))
+
+// Sizes up to SMALL_BIN_LIMIT get one exact bin per ALIGNMENT step (16, 32, ..., 512).
+#define SMALL_BIN_LIMIT 512
+#define NUM_SMALL_BINS (SMALL_BIN_LIMIT / ALIGNMENT)
+
+/*
+ * Node of a free block in its arena's tree of large free blocks.
+ * Larger free blocks are kept in a red-black tree ordered by size, then address,
+ * instead of a bin. The node is stored in the usable memory of the block, like FreeLinks.
+ *
+ * Fields:
+ *   parent - parent node, or NULL for the root.
+ *   child  - left (smaller) and right (larger) children.
+ *   red    - 1 if the node is red, 0 if it is black.
+ *   dirty  - decay epoch at which the block was put in the tree, or 0 once its pages were
+ *            released. Only used while MALLOCATE_DECAY_TIME is set.
+ */
+typedef struct TreeNode
+{
+    struct Block *parent;
+    struct Block *child[2];
+    int red;
+    uint32_t dirty;
+} TreeNode;
+
+#define TREE_NODE(block) ((TreeNode *)((char *)(block) + ALIGNED_METADATA_SIZE))
+
+// Requests of up to SLAB_MAX_SIZE bytes are served from slabs, one size class per ALIGNMENT step.
+#define SLAB_MAX_SIZE 512
+#define NUM_SLAB_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+
+// Slabs are SLAB_SIZE bytes and SLAB_SIZE-aligned pages holding nothing but objects.
+// One bit per slot: the smallest class has SLAB_SIZE / ALIGNMENT slots.
+#define SLAB_SIZE ((size_t)4096)
+#define SLAB_BITMAP_WORDS 4
+
+/*
+ * Header of a slab page. Headers are kept out of the pages, in a table at the start of the
+ * chunk holding one header per page, so objects fill their page, the bitmaps mfree() updates
+ * lie together in a few hot cache lines, and freeing an object never reads the memory around it.
+ *
+ * Fields:
+ *   prev, next - links in the arena's list of slabs with free slots for this size class.
+ *   size       - size of each object, or 0 if the page is an empty slab in free_slabs.
+ *   capacity   - number of object slots.
+ *   used       - number of slots handed out, including objects sitting in thread caches.
+ *   listed     - 1 if the slab is in the arena's list for its size class.
+ *   arena      - index of the owning arena.
+ *   free_map   - bit i is set when slot i is free, so free slots are found with ctz.
+ */
+typedef struct __attribute__((aligned(64))) Slab
+{
+    struct Slab *prev;
+    struct Slab *next;
+    uint16_t size;
+    uint16_t capacity;
+    uint16_t used;
+    uint16_t listed;
+    uint32_t arena;
+    uint64_t free_map[SLAB_BITMAP_WORDS];
+} Slab;
+
+_Static_assert(sizeof(Slab) == 64, "slab header is not one cache line");
+_Static_assert(SLAB_SIZE / ALIGNMENT <= SLAB_BITMAP_WORDS * 64, "slab bitmap too small");
+
+// Pages at the start of a slab chunk taken by the table of slab headers. The headers of these
+// pages are never used, and always have a size of 0.
+#define SLAB_TABLE_PAGES (CHUNK_SIZE / SLAB_SIZE * sizeof(Slab) / SLAB_SIZE)
+
+// The header of the slab of an object, and the page of a slab header.
+#define SLAB_OF(ptr) ((Slab *)((uintptr_t)(ptr) & ~(CHUNK_SIZE - 1)) + (((uintptr_t)(ptr) & (CHUNK_SIZE - 1)) / SLAB_SIZE))
+#define SLAB_OBJECTS(slab)                                                                                   \
+    ((char *)((uintptr_t)(slab) & ~(CHUNK_SIZE - 1)) + (((uintptr_t)(slab) & (CHUNK_SIZE - 1)) / sizeof(Slab)) * SLAB_SIZE)
+
+/*
+ * Header of a chunk mapped for slabs. Overlaps the links of the first slab header of the table,
+ * whose page holds the table itself.
+ */
+typedef struct SlabChunk
+{
+    struct SlabChunk *next;
+} SlabChunk;
+
+_Static_assert(sizeof(SlabChunk) <= offsetof(Slab, size), "slab chunk header overlaps a slab size");
+
+/*
+ * A free small object, while it sits in a thread cache or a remote free stack.
+ * 'key' holds tcache_key while it is cached, and remote_key while it waits on a remote free stack,
+ * to catch double frees.
+ */
+typedef struct FreeObject
+{
+    struct FreeObject *next;
+    uintptr_t key;
+} FreeObject;
+
+/*
+ * An independent heap with its own lock, free lists and memory.
+ *
+ * Fields:
+ *   lock    - protects every other field and the blocks of the arena.
+ *   runs    - runs of memory of the arena, oldest first.
+ *   tail    - last block of the newest run, where memory obtained by growing the arena is appended.
+ *   bins    - segregated free lists of small free blocks, one per size class.
+ *   bin_map - bit i is set when bins[i] is non-empty, so the next usable bin is found with one ctz.
+ *   tree    - root of the tree of free blocks larger than SMALL_BIN_LIMIT.
+ *   index   - position of the arena in arenas[], stored in each of its slabs.
+ *   node    - NUMA node the memory of the arena is bound to, or -1 on machines with a single node.
+ *   growth  - number of bytes the next sbrk() growth of arena 0 asks for, at least.
+ *   remote_frees - stack of blocks freed by threads of other arenas, linked through FreeLinks.next.
+ *                  Pushed without the lock, drained under it.
+ *   slabs        - slabs with at least one free slot, one doubly linked list per size class.
+ *   free_slabs   - empty slab pages, ready to be used for any size class.
+ *   slab_chunks  - chunks mapped for the arena's slabs, newest first.
+ *   slab_next    - first page of the newest slab chunk not handed out yet.
+ *   slab_end     - end of the newest slab chunk.
+ *   remote_slab_frees - stack of slab objects freed by threads of other arenas.
+ *   free_bytes   - usable bytes of the free blocks in the bins and the tree.
+ *   slab_bytes   - room for objects in the slab pages carved so far, used or not.
+ */
+typedef struct Arena
+{
+    pthread_mutex_t lock;
+    Run *runs;
+    Block *tail;
+    Block *bins[NUM_SMALL_BINS];
+    uint64_t bin_map;
+    Block *tree;
+    unsigned int index;
+    int node;
+    size_t growth;
+    _Atomic(Block *) remote_frees;
+    struct Slab *slabs[NUM_SLAB_CLASSES];
+    struct Slab *free_slabs;
+    struct SlabChunk *slab_chunks;
+    char *slab_next;
+    char *slab_end;
+    _Atomic(struct FreeObject *) remote_slab_frees;
+    size_t free_bytes;
+    size_t slab_bytes;
+} Arena;
+
+// Bounds of the step by which the sbrk() heap grows. The step doubles with every growth
+// and falls back to MIN_HEAP_GROWTH when the heap is trimmed.
+// The top of the heap also keeps MIN_HEAP_GROWTH bytes when it is trimmed.
+#define MIN_HEAP_GROWTH ((size_t)64 * 1024)
+#define MAX_HEAP_GROWTH ((size_t)2 * 1024 * 1024)
+
+// Upper bound on the number of arenas. By default one arena is used per online CPU.
+#define MAX_ARENAS 64
+
+// Upper bound on the number of NUMA nodes told apart. Nodes past it share the arenas of lower ones.
+#define MAX_NODES 64
+
+// Memory of arenas other than arena 0, and the memory of all slabs, is mapped in chunks of
+// CHUNK_SIZE bytes, aligned to CHUNK_SIZE so the owning arena of any address can be looked up
+// in chunk_map. An entry is the owning Arena pointer, tagged with CHUNK_SLAB for slab chunks
+// and CHUNK_HUGE for chunks backed by huge pages. A chunk is exactly one 2 MiB huge page.
+#define CHUNK_SHIFT 21
+#define CHUNK_SIZE ((size_t)1 << CHUNK_SHIFT)
+#define CHUNK_SLAB ((uintptr_t)1)
+#define CHUNK_HUGE ((uintptr_t)2)
+#define CHUNK_FLAGS (CHUNK_SLAB | CHUNK_HUGE)
+#define CHUNK_ARENA(entry) ((Arena *)((entry) & ~CHUNK_FLAGS))
+
+// chunk_map is a two-level table indexed by chunk number covering the 47-bit user address space.
+// Leaves are mapped on first use.
+#define CHUNK_MAP_LEAF_BITS 13
+#define CHUNK_MAP_ROOT_BITS (47 - CHUNK_SHIFT - CHUNK_MAP_LEAF_BITS)
+#define CHUNK_MAP_LEAF_SIZE ((size_t)1 << CHUNK_MAP_LEAF_BITS)
+
+typedef _Atomic(uintptr_t) ChunkMapLeaf[CHUNK_MAP_LEAF_SIZE];
+
+// Requests above this size are rejected so size computations can never overflow.
+#define MAX_REQUEST_SIZE ((size_t)PTRDIFF_MAX - 2 * CHUNK_SIZE)
+
 static size_t align(size_t size);
-static Block *split(Block *block, size_t size);
-static Block *coalesce(Block *block);
+static void *allocate(size_t size);
+static __attribute__((noinline)) void *hooked_allocate(size_t size);
+static __attribute__((noinline)) void hooked_deallocate(void *ptr);
+static void *allocate_aligned(size_t alignment, size_t size);
+static void *allocate_isolated(size_t alignment, size_t size);
+static void *allocate_zeroed(size_t count, size_t size);
+static void deallocate(void *ptr);
+static void *reallocate(void *ptr, size_t size);
+static size_t allocate_batch(size_t size, size_t n, void **out);
+static Block *split(Arena *arena, Block *block, size_t size);
+static Block *coalesce(Arena *arena, Block *block);
+static void tree_insert(Arena *arena, Block *block);
+static void tree_remove(Arena *arena, Block *block);
+static void tree_remove_fixup(Arena *arena, Block *x, Block *parent);
+static void tree_rotate(Arena *arena, Block *block, int dir);
+static void tree_replace(Arena *arena, Block *old_block, Block *new_block);
+static Block *tree_best_fit(Arena *arena, size_t size);
+static Block *tree_first(Block *block);
+static Block *tree_next(Block *block);
+static void bin_insert(Arena *arena, Block *block);
+static void bin_remove(Arena *arena, Block *block);
+static Block *find_free_block(Arena *arena, size_t size);
+static Block *heap_alloc(Arena *arena, size_t size);
+static void heap_free(Arena *arena, Block *block);
+static Block *grow_heap(Arena *arena, size_t size);
+static int trim_heap(Arena *arena, Block *block);
+static void purge_pages(Block *block, uintptr_t start, uintptr_t end);
+static void purger_start(void);
+static void purger_cond_init(void);
+static void *purger_main(void *arg);
+static void decay_arena(Arena *arena, uint32_t epoch, size_t *budget);
+static double decay_curve(uint32_t age);
+static void *heap_extend(Arena *arena, uintptr_t brk_end, size_t needed, size_t *increment);
+static int resize_block(Arena *arena, Block *block, size_t size);
+static void shrink_block(Arena *arena, Block *block, size_t size);
+static Block *align_block(Arena *arena, Block *block, size_t alignment);
+static int extend_top(Arena *arena, Block *block, size_t size);
+static void *move_allocation(void *ptr, size_t old_size, size_t size);
+static size_t carve_batch(Arena *arena, size_t size, size_t n, void **out);
+static Block *grow_arena(Arena *arena, size_t size);
+static Block *append_block(Arena *arena, void *memory, size_t size);
+static Block *next_adjacent(Block *block);
+static Block *prev_adjacent(Block *block);
+static void update_next_prev_size(Block *block);
+static Arena *arena_get(void);
+static int remote_claim(Block *block);
+static void remote_free(Arena *arena, Block *block);
+static void drain_remote_frees(Arena *arena);
+static uintptr_t owner_of(void *ptr);
+static uintptr_t chunk_lookup(void *ptr);
+static int chunk_register(void *chunk, size_t size, uintptr_t entry);
+static void *map_chunks(size_t size, int node, uintptr_t *flags);
+static void bind_node(void *addr, size_t size, int node);
+static unsigned int current_node(void);
+static unsigned int count_nodes(void);
+static size_t huge_page_bytes(void);
+static void *slab_alloc(size_t size);
+static void slab_free(Arena *arena, void *ptr);
+static int slab_owns(void *ptr);
+static void *slab_get(Arena *arena, size_t index);
+static void slab_put(Arena *arena, void *ptr);
+static Slab *slab_create(Arena *arena, size_t index);
+static void slab_unlink(Arena *arena, Slab *slab);
+static void print_arena_blocks(Arena *arena);
+static int check_arena_blocks(Arena *arena);
+static int check_tree(Block *block, Block *parent, size_t *count, size_t *bytes);
+static Block *large_alloc(size_t size, size_t alignment);
+static int large_free(void *ptr);
+static void *large_realloc(void *ptr, size_t size);
+static void *large_mapping(Block *block);
+static int large_insert(Block *block);
+static int large_remove(Block *block);
+static int large_contains(Block *block);
+static size_t large_hash(Block *block);
+
+static Arena arenas[MAX_ARENAS];
+static unsigned int narenas = 1;
+
+// Number of NUMA nodes. Arena i belongs to node i % nnodes.
+static unsigned int nnodes = 1;
+
+// Arena the calling thread allocates from, assigned round-robin among the arenas
+// of the thread's node on first use.
+static _Thread_local Arena *thread_arena = NULL;
+static atomic_uint next_arena[MAX_NODES];
+
+// Owner and kind of each mmap()ed chunk. Written under chunk_lock, read without it.
+static _Atomic(ChunkMapLeaf *) chunk_map[(size_t)1 << CHUNK_MAP_ROOT_BITS];
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Tracks the start and end of the memory allocated by sbrk() for arena 0.
+// Used to check if pointers passed to mfree() are within the heap without a syscall.
+// Written under arena 0's lock, read without it.
+static _Atomic(uintptr_t) heap_start = 0;
+static _Atomic(uintptr_t) heap_end = 0;
+
+// Requests of at least this many bytes get their own mapping. Set with MALLOCATE_MMAP_THRESHOLD.
+static _Atomic(size_t) mmap_threshold = 128 * 1024;
+
+// The sbrk() heap is only shrunk once this many bytes can be released from its top free block,
+// so a heap that keeps growing and shrinking by a little does not call sbrk() every time.
+// Set with MALLOCATE_TRIM_THRESHOLD.
+static _Atomic(size_t) trim_threshold = 128 * 1024;
+
+// Pages of freed memory are only released once the coalesced free block reaches this size.
+// Set with MALLOCATE_PURGE_THRESHOLD.
+static _Atomic(size_t) purge_threshold = 256 * 1024;
+
+// Whether chunks are backed by huge pages. Set with MALLOCATE_HUGE_PAGES.
+static _Atomic(int) huge_pages = MALLOCATE_HUGE_OFF;
+
+// Milliseconds over which free pages decay, and bytes per second the purger releases at most.
+// Set with MALLOCATE_DECAY_TIME and MALLOCATE_PURGE_RATE. Free pages are released in mfree()
+// while the decay time is 0.
+static _Atomic(size_t) decay_time = 0;
+static _Atomic(size_t) purge_rate = 0;
+
+// The purger advances the epoch DECAY_STEPS times per decay time. Blocks in the tree are stamped
+// with the epoch they were inserted at, so their age is counted in steps.
+#define DECAY_STEPS 16
+static _Atomic(uint32_t) decay_epoch = 1;
+
+// The purger thread is started by the first free once a decay time is set, since it cannot be
+// created during allocator_init(). purger_lock and purger_cond wake it when the options change.
+static atomic_int purger_started = 0;
+static pthread_mutex_t purger_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t purger_cond = PTHREAD_COND_INITIALIZER;
+
+static size_t page_size = 4096;
+
+// Open-addressing hash set of the blocks with their own mapping, keyed by block address.
+// Capacity is a power of two, and the table is mapped anew when it grows.
+static Block **large_slots = NULL;
+static size_t large_capacity = 0;
+static size_t large_count = 0;
+static pthread_mutex_t large_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Every slab size class has a bin in the per-thread cache.
+#define TCACHE_BINS NUM_SLAB_CLASSES
+
+// Maximum number of objects kept per cache bin.
+#define TCACHE_MAX_COUNT 32
+
+// Number of objects moved between a cache bin and the slabs under one lock.
+// Refills of a bin start with a single object and double up to TCACHE_BATCH,
+// so size classes a thread rarely uses do not hoard memory.
+#define TCACHE_BATCH 16
+
+_Static_assert(NUM_SLAB_CLASSES == MALLOCATE_SMALL_CLASSES, "stats classes do not match the slab classes");
+
+/*
+ * Statistics counted by one thread, summed over all threads by mallocate_stats().
+ *
+ * Only the owning thread writes its counters, so it updates them with a relaxed load and store
+ * instead of an atomic read-modify-write. They are atomic only so readers see whole values.
+ * 'allocated' and 'mapped' go down as well as up. A thread that frees memory another thread
+ * allocated wraps its own counter around, but the sum over all threads is exact.
+ *
+ * Fields:
+ *   allocs, frees - allocations and frees per size class, see MALLOCATE_NUM_CLASSES.
+ *   allocated     - usable bytes of blocks allocated minus those freed. The bytes of small
+ *                   objects follow from the counts of their size class.
+ *   mapped        - bytes obtained from the system minus bytes given back.
+ *   sbrk_calls, mmap_calls, contentions, huge_mapped - see MallocateStats.
+ *   prev, next    - links in the list of live threads, protected by stats_lock.
+ */
+typedef struct ThreadStats
+{
+    _Atomic(size_t) allocs[MALLOCATE_NUM_CLASSES];
+    _Atomic(size_t) frees[MALLOCATE_NUM_CLASSES];
+    _Atomic(size_t) allocated;
+    _Atomic(size_t) mapped;
+    _Atomic(size_t) sbrk_calls;
+    _Atomic(size_t) mmap_calls;
+    _Atomic(size_t) contentions;
+    _Atomic(size_t) huge_mapped;
+    struct ThreadStats *prev;
+    struct ThreadStats *next;
+} ThreadStats;
+
+// Records in each thread's trace buffer. Full buffers are handed to the trace writer thread.
+#define TRACE_BUFFER_RECORDS 4096
+
+/*
+ * Buffer of trace records of one thread.
+ *
+ * Fields:
+ *   next    - next buffer in the queue of full buffers or in the list of spare ones.
+ *   all     - next buffer in the list of every buffer, walked when the trace stops.
+ *   count   - number of records in the buffer. Written by the thread filling the buffer, and read
+ *             by mallocate_trace_stop() to write out the records of threads that are still running.
+ *   records - the records.
+ */
+typedef struct TraceBuffer
+{
+    struct TraceBuffer *next;
+    struct TraceBuffer *all;
+    _Atomic(size_t) count;
+    MallocateTraceRecord records[TRACE_BUFFER_RECORDS];
+} TraceBuffer;
+
+#define TRACE_IDLE 0    // no trace was started yet
+#define TRACE_RUNNING 1 // calls are being recorded
+#define TRACE_STOPPED 2 // the trace was stopped, and cannot be started again
+
+/*
+ * Per-thread cache of free small objects.
+ *
+ * Only objects of the thread's own arena are cached. They stay marked as used in
+ * their slab, so the arena never hands them out. They are chained through
+ * FreeObject.next, and FreeObject.key holds tcache_key to catch double frees.
+ *
+ * Fields:
+ *   entries - singly linked list of cached objects for each size class.
+ *   counts  - number of objects in each list.
+ *   fill    - number of objects the next refill of each bin takes from the slabs.
+ *   state   - TCACHE_UNREGISTERED until the exit destructor is installed,
+ *             TCACHE_DEAD once the thread is exiting and the cache must not be used.
+ *   stats   - statistics of the thread, counted while the cache is active.
+ *   trace   - buffer the thread appends its trace records to, or NULL.
+ *   trace_thread - number of the thread in trace records, or 0 before its first one.
+ *   sample_left  - bytes the thread still allocates before its next heap profile sample.
+ *   sample_seed  - state of the thread's random generator for sample distances, 0 before first use.
+ *   guard_left   - allocations the thread still makes up to its next guarded one, 0 before first use.
+ *   latency      - latency histograms the thread counts in, or NULL before its first timed call.
+ */
+typedef struct TCache
+{
+    FreeObject *entries[TCACHE_BINS];
+    unsigned int counts[TCACHE_BINS];
+    unsigned int fill[TCACHE_BINS];
+    int state;
+    ThreadStats stats;
+    TraceBuffer *trace;
+    uint32_t trace_thread;
+    int64_t sample_left;
+    uint64_t sample_seed;
+    int64_t guard_left;
+    struct LatencyHistogram *latency;
+} TCache;
+
+#define TCACHE_UNREGISTERED 0
+#define TCACHE_ACTIVE 1
+#define TCACHE_DEAD 2
+
+static _Thread_local TCache tcache;
+
+// Marker stored in cached objects. Chosen at startup so user data rarely matches it.
+static uintptr_t tcache_key = 0;
+
+// Marker stored in objects on a remote free stack. Set atomically before the push, so an object
+// freed twice from other arenas is pushed once.
+static uintptr_t remote_key = 0;
+
+// Used to flush a thread's cache back to its arena when it exits.
+static pthread_key_t tcache_exit_key;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// Statistics of the threads whose cache is active, and the totals of all other threads:
+// those that exited and those counting before or after their cache existed.
+// The totals are shared, so they are updated with atomic additions.
+static ThreadStats *stats_threads = NULL;
+static ThreadStats retired_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Features that see every allocation call: tracing, heap profiling, cache line isolation,
+// guarded sampling and latency histograms.
+// It is the only part of any of them that the fast paths read.
+#define HOOK_TRACE 1
+#define HOOK_PROFILE 2
+#define HOOK_ISOLATE 4
+#define HOOK_GUARD 8
+#define HOOK_LATENCY 16
+static _Atomic(int) hooks = 0;
+
+// State of the trace and the buffers it uses, protected by trace_lock.
+// The writer thread takes full buffers from the queue, oldest first, and puts them on
+// the spare list once written. Threads that are exiting share trace_orphans.
+static int trace_state = TRACE_IDLE;
+static int trace_fd = -1;
+static uint64_t trace_epoch = 0;
+static TraceBuffer *trace_queue = NULL;
+static TraceBuffer *trace_queue_tail = NULL;
+static TraceBuffer *trace_spares = NULL;
+static TraceBuffer *trace_buffers = NULL;
+static TraceBuffer *trace_orphans = NULL;
+static int trace_writer_running = 0;
+static pthread_t trace_writer;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int trace_writer_started = 0;
+static atomic_uint trace_threads = 0;
+
+// Set while the calling thread must not record its calls: inside trace_record() itself,
+// so the allocations of pthread_create() are not traced, and on the writer thread.
+static _Thread_local int trace_busy = 0;
+
+// Frames kept of the stack of a sampled allocation, and heads of each profile hash table.
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_TABLE_SIZE 4096
+
+// Frames of the allocator itself on top of the stack returned by backtrace():
+// profile_record(), profile_allocate() and the public function or hooked_allocate().
+#define PROFILE_SKIP 3
+
+/*
+ * Allocations and frees of the samples taken at one stack.
+ *
+ * Fields:
+ *   next        - next bucket with the same hash head.
+ *   hash        - hash of the stack.
+ *   depth       - number of frames in 'stack'.
+ *   stack       - return addresses, innermost first.
+ *   allocs      - samples taken at the stack, and the bytes they requested.
+ *   alloc_bytes
+ *   frees       - samples freed since, and their bytes.
+ *   free_bytes
+ */
+typedef struct ProfileBucket
+{
+    struct ProfileBucket *next;
+    uint64_t hash;
+    int depth;
+    void *stack[PROFILE_MAX_DEPTH];
+    size_t allocs;
+    size_t alloc_bytes;
+    size_t frees;
+    size_t free_bytes;
+} ProfileBucket;
+
+/*
+ * Sampled object that was not freed yet.
+ *
+ * Fields:
+ *   next   - next sample with the same hash head, or next spare sample.
+ *   ptr    - usable memory of the object.
+ *   size   - bytes requested.
+ *   bucket - stack the object was allocated at.
+ */
+typedef struct ProfileSample
+{
+    struct ProfileSample *next;
+    void *ptr;
+    size_t size;
+    ProfileBucket *bucket;
+} ProfileSample;
+
+// Mean bytes between samples, MALLOCATE_PROFILE_INTERVAL. Profiling is on while it is not 0.
+static _Atomic(size_t) profile_interval = 0;
+
+// Number of sampled objects not freed yet. Frees of mapped blocks only look them up while it is not 0.
+static _Atomic(size_t) profile_live = 0;
+
+// Buckets and live samples, hashed by stack and by address, protected by profile_lock.
+// Both are carved from pages of their own, so profiling never calls the allocator.
+static ProfileBucket *profile_buckets[PROFILE_TABLE_SIZE];
+static ProfileSample *profile_samples[PROFILE_TABLE_SIZE];
+static ProfileSample *profile_spares = NULL;
+static char *profile_next = NULL;
+static char *profile_end = NULL;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set while the calling thread takes a backtrace, which allocates the first time it runs.
+static _Thread_local int backtrace_busy = 0;
+
+// Slots of the guarded pool, and frames kept of the stacks that allocated and freed their object.
+#define GUARD_SLOTS 256
+#define GUARD_MAX_DEPTH 16
+
+// Bytes of the guarded pool: the page of each slot, with a guard page on both sides.
+#define GUARD_POOL_SIZE ((2 * GUARD_SLOTS + 1) * page_size)
+
+// States of a guarded slot.
+#define GUARD_UNUSED 0 // no object was ever allocated in the slot
+#define GUARD_LIVE 1   // the object is in use and its page is accessible
+#define GUARD_FREED 2  // the object was freed and its page is inaccessible again
+
+/*
+ * A slot of the guarded pool.
+ *
+ * Fields:
+ *   ptr         - the last object allocated in the slot.
+ *   size        - bytes it requested.
+ *   state       - GUARD_UNUSED, GUARD_LIVE or GUARD_FREED.
+ *   alloc_depth - number of frames in alloc_stack, the stack that allocated the object.
+ *   free_depth  - number of frames in free_stack, the stack that freed it.
+ */
+typedef struct GuardSlot
+{
+    void *ptr;
+    size_t size;
+    int state;
+    int alloc_depth;
+    int free_depth;
+    void *alloc_stack[GUARD_MAX_DEPTH];
+    void *free_stack[GUARD_MAX_DEPTH];
+} GuardSlot;
+
+// Mean number of allocations per guarded one, MALLOCATE_GUARD_INTERVAL. Sampling is on while it is not 0.
+static _Atomic(size_t) guard_interval = 0;
+
+// Start of the guarded pool, or 0 until the first guarded allocation maps it.
+static _Atomic(uintptr_t) guard_base = 0;
+
+// Slots, and the indexes of the freed ones in the order they were freed, protected by guard_lock.
+// Freed slots stay inaccessible until every slot was used once, and are then reused oldest first,
+// so a dangling pointer keeps faulting for as long as possible.
+static GuardSlot guard_slots[GUARD_SLOTS];
+static unsigned int guard_queue[GUARD_SLOTS];
+static unsigned int guard_queue_head = 0;
+static unsigned int guard_queue_count = 0;
+static unsigned int guard_used = 0;
+static pthread_mutex_t guard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// SIGSEGV action replaced by guard_fault(), which it passes faults outside the pool to.
+static struct sigaction guard_previous;
+
+/*
+ * Latency histograms of the calls of the threads using them, see MALLOCATE_LATENCY.
+ * Only the owning thread writes them, like its statistics.
+ *
+ * A histogram is never freed: when its thread exits it goes to the spare list, and the next
+ * thread needing one keeps counting in it, so the sum over every histogram stays exact.
+ *
+ * Fields:
+ *   buckets - calls per latency bucket, for MALLOCATE_LATENCY_ALLOC and MALLOCATE_LATENCY_FREE.
+ *   next    - next histogram in the spare list.
+ *   all     - next histogram in the list of every histogram, walked by mallocate_latency().
+ */
+typedef struct LatencyHistogram
+{
+    _Atomic(size_t) buckets[2][MALLOCATE_LATENCY_BUCKETS];
+    struct LatencyHistogram *next;
+    struct LatencyHistogram *all;
+} LatencyHistogram;
+
+// Every histogram and the spare ones, protected by stats_lock. Threads without a histogram of
+// their own count in latency_shared, with atomic additions.
+static LatencyHistogram *latency_all = NULL;
+static LatencyHistogram *latency_spares = NULL;
+static LatencyHistogram latency_shared;
 
-// Head of the linked list of Blocks used to track allocated memory.
-static Block *head = NULL;
+/*
+ * Static probes, in the format of the SystemTap <sys/sdt.h> probes that bpftrace, perf and gdb
+ * read, without depending on that header. Each probe is a nop in the code and an ELF note
+ * giving its address, provider "mallocate", name and arguments, which are 64-bit values
+ * passed in registers. Attaching a tool replaces the nop with a breakpoint; until then the
+ * probe costs the nop and keeping its arguments in registers. For example:
+ *
+ *   bpftrace -e 'usdt:./libmallocate.so:mallocate:lock_wait { @start[tid] = nsecs; }
+ *                usdt:./libmallocate.so:mallocate:lock_acquire /@start[tid]/ {
+ *                    @wait_ns = hist(nsecs - @start[tid]); delete(@start[tid]); }'
+ *
+ * Probes:
+ *   heap_grow(arena, bytes)      - arena number 'arena' grew by 'bytes', with sbrk() or mmap().
+ *   sbrk(increment, previous)    - the break moved by 'increment', a signed value, from 'previous'.
+ *   mmap(addr, bytes)            - 'bytes' were mapped at 'addr', or 'addr' is MAP_FAILED.
+ *   munmap(addr, bytes)          - 'bytes' at 'addr' were unmapped.
+ *   coalesce(block, bytes)       - a freed block merged with a neighbour into one of 'bytes'.
+ *   tcache_refill(class, count)  - the thread cache took 'count' objects of size class 'class'.
+ *   tcache_flush(class, count)   - the thread cache gave back 'count' objects of size class 'class'.
+ *   lock_wait(mutex)             - the thread blocks on 'mutex', held by another thread.
+ *   lock_acquire(mutex)          - the thread got 'mutex' after waiting for it.
+ *   purge(addr, bytes)           - the pages of 'bytes' at 'addr' were released with madvise().
+ */
+#if defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+#define PROBE_ASM(name, args)                                             \
+    "990: nop\n"                                                          \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                         \
+    ".balign 4\n"                                                         \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                    \
+    "991: .asciz \"stapsdt\"\n"                                           \
+    "992: .balign 4\n"                                                    \
+    "993: .8byte 990b\n"                                                  \
+    ".8byte _.stapsdt.base\n"                                             \
+    ".8byte 0\n"                                                          \
+    ".asciz \"mallocate\"\n"                                              \
+    ".asciz \"" #name "\"\n"                                              \
+    ".asciz \"" args "\"\n"                                               \
+    "994: .balign 4\n"                                                    \
+    ".popsection\n"                                                       \
+    ".ifndef _.stapsdt.base\n"                                            \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n"                                              \
+    ".hidden _.stapsdt.base\n"                                            \
+    "_.stapsdt.base: .space 1\n"                                          \
+    ".size _.stapsdt.base, 1\n"                                           \
+    ".popsection\n"                                                       \
+    ".endif\n"
+#define PROBE1(name, a) __asm__ __volatile__(PROBE_ASM(name, "8@%0") ::"r"((uint64_t)(a)))
+#define PROBE2(name, a, b) \
+    __asm__ __volatile__(PROBE_ASM(name, "8@%0 8@%1") ::"r"((uint64_t)(a)), "r"((uint64_t)(b)))
+#else
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#endif
 
-// Tracks the start of the memory allocated by sbrk().
-// Used to check if pointers passed to mfree() are within the heap.
-static void *heap_start = NULL;
+static void allocator_init(void);
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+static TCache *tcache_get(void);
+static __attribute__((noinline)) TCache *tcache_register(void);
+static void tcache_destroy(void *arg);
+static void *tcache_refill(TCache *cache, Arena *arena, size_t index);
+static void tcache_flush(TCache *cache, size_t index, unsigned int keep);
+static ThreadStats *stats_get(void);
+static void stats_add(ThreadStats *stats, _Atomic(size_t) *counter, size_t n);
+static void stats_bump(_Atomic(size_t) *counter, size_t n);
+static void stats_retire(ThreadStats *stats);
+static void stats_alloc(size_t size_class, size_t bytes);
+static void stats_free(size_t size_class, size_t bytes);
+static int trace_open(const char *path);
+static void trace_record(uint32_t op, void *ptr, uintptr_t arg, size_t size);
+static void trace_append_slow(TCache *cache, MallocateTraceRecord *record);
+static TraceBuffer *trace_swap(TraceBuffer *full);
+static void trace_enqueue(TraceBuffer *buffer);
+static void *trace_writer_main(void *arg);
+static void trace_write(TraceBuffer *buffer);
+static uint64_t trace_clock(void);
+static int profile_tick(size_t size);
+static __attribute__((noinline)) int profile_next_sample(void);
+static int64_t profile_distance(TCache *cache);
+static uint64_t sample_random(TCache *cache);
+static double profile_log(double x);
+static void *profile_allocate(size_t alignment, size_t size);
+static __attribute__((noinline)) void profile_record(void *ptr, size_t size);
+static void profile_forget(void *ptr);
+static void profile_moved(void *old_ptr, void *new_ptr, size_t size);
+static void *profile_carve(size_t size);
+static size_t profile_slot(void *ptr);
+static int profile_write(int fd, const char *text, size_t length);
+static int guard_tick(void);
+static __attribute__((noinline)) int guard_next_sample(void);
+static __attribute__((noinline)) void *guard_allocate(size_t alignment, size_t size);
+static __attribute__((noinline)) void guard_free(void *ptr);
+static int guard_owns(void *ptr);
+static size_t guard_size(void *ptr);
+static int guard_init(void);
+static void guard_fault(int signo, siginfo_t *info, void *context);
+static void guard_report(const char *what, GuardSlot *slot, uintptr_t address);
+static void guard_restore(void);
+static size_t guard_append(char *text, size_t length, size_t capacity, const char *string);
+static size_t guard_append_number(char *text, size_t length, size_t capacity, uintptr_t value, unsigned int base);
+static __attribute__((noinline)) void latency_record(int op, uint64_t start);
+static size_t latency_bucket(uint64_t ns);
+static LatencyHistogram *latency_attach(void);
+static void mutex_lock(pthread_mutex_t *mutex);
+static void *map_pages(size_t size, int flags);
+static void unmap_pages(void *addr, size_t size);
+static void *move_break(intptr_t increment);
 
 /*
 * Allocates a block of memory of 'size' bytes.
@@ -69,198 +900,4834 @@ static void *heap_start = NULL;
 */
 void *mallocate(size_t size)
 {
-    if (heap_start == NULL)
+    // Both calls are tail calls, so tracing and profiling cost the fast path a single load.
+    if (atomic_load_explicit(&hooks, memory_order_relaxed))
     {
-        heap_start = sbrk(0);
+        return hooked_allocate(size);
     }
+    return allocate(size);
+}
 
-    // Ensure 16-byte alignment.
-    size_t aligned_size = align(size);
-    size_t total_size = ALIGNED_METADATA_SIZE + aligned_size;
-
-    // If no memory has been allocated yet.
-    if (head == NULL)
+/*
+ * mallocate() while a hook is active. The call is timed whole, hooks included, since that is
+ * the latency the program sees.
+ */
+static __attribute__((noinline)) void *hooked_allocate(size_t size)
+{
+    int active = atomic_load_explicit(&hooks, memory_order_relaxed);
+    uint64_t start = active & HOOK_LATENCY ? trace_clock() : 0;
+    void *ptr = guard_tick() ? guard_allocate(ALIGNMENT, size) : NULL;
+    if (ptr == NULL)
     {
-        void *allocated = sbrk(total_size);
-        if (allocated == (void *)-1)
-        {
-            return NULL;
-        }
-
-        Block *memory = (Block *)allocated;
-
-        memory->size = aligned_size;
-        memory->free = 0;
-        memory->next = NULL;
-
-        head = memory;
-
-        return (void *)((char *)allocated + ALIGNED_METADATA_SIZE);
+        ptr = profile_tick(size)            ? profile_allocate(ALIGNMENT, size)
+              : (active & HOOK_ISOLATE) ? allocate_isolated(ALIGNMENT, size)
+                                        : allocate(size);
+    }
+    if (active & HOOK_TRACE)
+    {
+        trace_record(MALLOCATE_TRACE_ALLOC, ptr, 0, size);
+    }
+    if (active & HOOK_LATENCY)
+    {
+        latency_record(MALLOCATE_LATENCY_ALLOC, start);
     }
+    return ptr;
+}
 
-    Block *curr = head;
-    Block *last = NULL;
+/*
+ * Does the work of mallocate() for it and for the allocator's own calls, which are not traced.
+ */
+static void *allocate(size_t size)
+{
+    pthread_once(&init_once, allocator_init);
 
-    // Traverse the linked list to find a free block large enough for the requested size.
-    // If a suitable block is found, split it if it’s bigger than needed and return a pointer to its usable memory.
-    while (curr != NULL)
+    if (size > MAX_REQUEST_SIZE)
     {
-        if (curr->free && curr->size >= aligned_size)
-        {
-            curr = split(curr, aligned_size);
-            return (void *)((char *)curr + ALIGNED_METADATA_SIZE);
-        }
-
-        last = curr;
-        curr = curr->next;
+        return NULL;
     }
 
-    // No suitable free block found: extend the heap and append a new block to the list.
-    void *allocated = sbrk(total_size);
-    if (allocated == (void *)-1)
+    // Ensure 16-byte alignment.
+    // Every block needs room for its free-list links once it is freed.
+    size_t aligned_size = align(size);
+    if (aligned_size < ALIGNMENT)
     {
-        return NULL;
+        aligned_size = ALIGNMENT;
     }
 
-    Block *memory = (Block *)allocated;
+    // Large requests get their own mapping and never touch an arena.
+    if (aligned_size >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed))
+    {
+        Block *block = large_alloc(aligned_size, ALIGNMENT);
+        return block ? (void *)((char *)block + ALIGNED_METADATA_SIZE) : NULL;
+    }
 
-    memory->size = aligned_size;
-    memory->free = 0;
-    memory->next = NULL;
+    // Small requests are served from slabs.
+    if (aligned_size <= SLAB_MAX_SIZE)
+    {
+        return slab_alloc(aligned_size);
+    }
 
-    last->next = memory;
+    Arena *arena = arena_get();
+    mutex_lock(&arena->lock);
+    Block *block = heap_alloc(arena, aligned_size);
+    pthread_mutex_unlock(&arena->lock);
 
-    return (void *)((char *)allocated + ALIGNED_METADATA_SIZE);
+    if (block == NULL)
+    {
+        return NULL;
+    }
+    stats_alloc(MALLOCATE_CLASS_BLOCK, BLOCK_SIZE(block));
+    return (char *)block + ALIGNED_METADATA_SIZE;
 }
 
 /*
- * Frees memory blocked pointed to by ptr.
+ * Allocates a block of memory of at least 'size' bytes whose address is
+ * a multiple of 'alignment', which must be a power of two.
  *
- * Ensures the passed in memory was allocated by this program
- * by checking that it is within the bounds of the heap and
- * that it is aligned to 16 bytes.
+ * Small requests come from a slab whose object size is a multiple of the alignment,
+ * since every object of such a slab is aligned: slots start at a page boundary.
+ * Other requests take a block with enough spare room to align it, and the memory in front
+ * of the aligned address and after the request is returned to the free lists.
+ * Large requests get their own mapping, trimmed to the aligned region.
  *
- * Shrinks the heap using sbrk() if the block is at the end.
+ * The memory is freed with mfree() like any other.
  *
- * Combines adjacent free blocks using coalesce() if possible.
+ * Returns a pointer to the memory, or NULL if the alignment is invalid or the allocation failed.
  */
-void mfree(void *ptr)
+void *maligned_alloc(size_t alignment, size_t size)
 {
-    if (ptr == NULL)
+    int active = atomic_load_explicit(&hooks, memory_order_relaxed);
+    if (!active)
     {
-        return;
+        return allocate_aligned(alignment, size);
     }
-
-    // Verify that the memory is within the heap.
-    void *heap_end = sbrk(0);
-    if (ptr < heap_start || ptr >= heap_end)
+    uint64_t start = active & HOOK_LATENCY ? trace_clock() : 0;
+    void *ptr = guard_tick() ? guard_allocate(alignment, size) : NULL;
+    if (ptr == NULL)
     {
-        return;
+        ptr = profile_tick(size)            ? profile_allocate(alignment, size)
+              : (active & HOOK_ISOLATE) ? allocate_isolated(alignment, size)
+                                        : allocate_aligned(alignment, size);
     }
-
-    // Verify that the pointer is properly aligned.
-    if (!is_aligned(ptr))
+    trace_record(MALLOCATE_TRACE_ALIGNED, ptr, alignment, size);
+    if (active & HOOK_LATENCY)
     {
-        return;
+        latency_record(MALLOCATE_LATENCY_ALLOC, start);
     }
-
-    // Set block status to free and coalesce.
-    Block *metadata = (Block *)((char *)ptr - ALIGNED_METADATA_SIZE);
-    if (metadata->free) return;
-    metadata->free = 1;
-    metadata = coalesce(metadata);
+    return ptr;
 }
 
 /*
- * Splits a memory block into two if it is larger than the requested size.
- *
- * Helps use memory more efficiently and reduces unnecessary calls to sbrk().
- * The original block keeps the requested size, and the remaining memory
- * becomes a new free block linked into the list.
+ * Does the work of maligned_alloc().
  */
-static Block *split(Block *block, size_t size)
+static void *allocate_aligned(size_t alignment, size_t size)
 {
-    // If the block is too small to split.
-    // Mark as allocated and return it.
-    if (block->size < size + MIN_BLOCK_SIZE)
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > MAX_REQUEST_SIZE)
     {
-        block->free = 0;
-        return block;
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT)
+    {
+        return allocate(size);
     }
 
-    // Calculate the size of the remaining memory after splitting.
-    size_t leftover_size = block->size - size - ALIGNED_METADATA_SIZE;
-
-    // Create a new free block from the leftover memory.
-    Block *new_block = (Block *)((char *)block + ALIGNED_METADATA_SIZE + size);
-    new_block->size = leftover_size;
-    new_block->free = 1;
-    new_block->next = block->next;
-
-    // Update the original block to the requested size and link it to the new free block.
-    block->size = size;
-    block->free = 0;
-    block->next = new_block;
+    pthread_once(&init_once, allocator_init);
 
-    return block;
-}
+    if (size > MAX_REQUEST_SIZE - alignment - MIN_BLOCK_SIZE)
+    {
+        return NULL;
+    }
 
-/*
- * Merges the given free block with adjacent blocks of free memory, if any,
- * to reduce fragmentation and utilize memory more efficiently.
- */
-static Block *coalesce(Block *block)
-{
-    // Merge the block with consecutive free blocks that follow it in memory
-    while (block->next && block->next->free)
+    // A slab object is at least one alignment unit, a block at least ALIGNMENT bytes.
+    size_t aligned_size = size > 0 ? (size + alignment - 1) & ~(alignment - 1) : alignment;
+    if (aligned_size <= SLAB_MAX_SIZE)
     {
-        block->size += ALIGNED_METADATA_SIZE + block->next->size;
-        block->next = block->next->next;
+        return slab_alloc(aligned_size);
     }
 
-    // Iterate to the preceding block.
-    Block *curr = head;
-    Block *prev = NULL;
-    while (curr && curr != block)
+    aligned_size = size > 0 ? align(size) : ALIGNMENT;
+    size_t search_size = aligned_size + alignment + MIN_BLOCK_SIZE;
+    if (search_size >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed))
     {
-        prev = curr;
-        curr = curr->next;
+        Block *block = large_alloc(aligned_size, alignment);
+        return block ? (void *)((char *)block + ALIGNED_METADATA_SIZE) : NULL;
     }
 
-    // If the previous block is free, merge it with the current block and return it.
-    if (prev && prev->free)
+    Arena *arena = arena_get();
+    mutex_lock(&arena->lock);
+    Block *block = heap_alloc(arena, search_size);
+    if (block != NULL)
     {
-        prev->size += ALIGNED_METADATA_SIZE + block->size;
-        prev->next = block->next;
-        return prev;
+        block = align_block(arena, block, alignment);
+        shrink_block(arena, block, aligned_size);
     }
+    pthread_mutex_unlock(&arena->lock);
 
-    return block;
+    if (block == NULL)
+    {
+        return NULL;
+    }
+    stats_alloc(MALLOCATE_CLASS_BLOCK, BLOCK_SIZE(block));
+    return (char *)block + ALIGNED_METADATA_SIZE;
 }
 
 /*
- * Aligns the given size to the next multiple of ALIGNMENT (16 bytes).
- * Uses bitwise arithmetic to round up efficiently.
+ * Allocates like allocate_aligned() while MALLOCATE_ISOLATE_LINES is set: the memory is aligned
+ * to at least CACHE_LINE_SIZE and rounded up to whole cache lines, so no other object shares
+ * a line with it. Small requests come from the slabs of line multiples, whose slots start on
+ * a line, and blocks are split on a line boundary after the request.
  */
-static size_t align(size_t size)
+static void *allocate_isolated(size_t alignment, size_t size)
 {
-    return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1); 
-}
-
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || size > MAX_REQUEST_SIZE)
+    {
+        return NULL;
+    }
+    size_t lines = size > 0 ? (size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1) : CACHE_LINE_SIZE;
+    return allocate_aligned(alignment > CACHE_LINE_SIZE ? alignment : CACHE_LINE_SIZE, lines);
+}
+
+/*
+ * Allocates zeroed memory for an array of 'count' elements of 'size' bytes each.
+ *
+ * Memory of a new mapping is already zero, so only memory from the heap is cleared.
+ *
+ * Returns a pointer to the memory, or NULL if count * size overflows or the allocation failed.
+ */
+void *mcalloc(size_t count, size_t size)
+{
+    int active = atomic_load_explicit(&hooks, memory_order_relaxed);
+    if (!active)
+    {
+        return allocate_zeroed(count, size);
+    }
+    uint64_t start = active & HOOK_LATENCY ? trace_clock() : 0;
+    // A sampled allocation is a new or decommitted page, which is zeroed already.
+    int overflow = size != 0 && count > MAX_REQUEST_SIZE / size;
+    void *ptr = !overflow && guard_tick() ? guard_allocate(ALIGNMENT, count * size) : NULL;
+    if (ptr == NULL)
+    {
+        ptr = !overflow && profile_tick(count * size) ? profile_allocate(ALIGNMENT, count * size) : allocate_zeroed(count, size);
+    }
+    trace_record(MALLOCATE_TRACE_CALLOC, ptr, 0, count * size);
+    if (active & HOOK_LATENCY)
+    {
+        latency_record(MALLOCATE_LATENCY_ALLOC, start);
+    }
+    return ptr;
+}
+
+/*
+ * Does the work of mcalloc().
+ */
+static void *allocate_zeroed(size_t count, size_t size)
+{
+    if (size != 0 && count > MAX_REQUEST_SIZE / size)
+    {
+        return NULL;
+    }
+
+    size_t total = count * size;
+    int isolated = (atomic_load_explicit(&hooks, memory_order_relaxed) & HOOK_ISOLATE) != 0;
+    pthread_once(&init_once, allocator_init);
+    if (align(total) >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed))
+    {
+        Block *block = large_alloc(align(total), isolated ? CACHE_LINE_SIZE : ALIGNMENT);
+        return block ? (void *)((char *)block + ALIGNED_METADATA_SIZE) : NULL;
+    }
+
+    void *ptr = isolated ? allocate_isolated(ALIGNMENT, total) : allocate(total);
+    if (ptr != NULL)
+    {
+        memset(ptr, 0, total);
+    }
+    return ptr;
+}
+
+/*
+ * Frees memory blocked pointed to by ptr.
+ *
+ * Ensures the passed in memory was allocated by this program
+ * by checking that it is within the bounds of the heap and
+ * that it is aligned to 16 bytes.
+ *
+ * Small objects of the thread's own arena go to the thread cache. Once a cache bin
+ * is full, half of it is returned to the slabs under a single lock.
+ * Blocks and objects of other arenas are pushed onto their owner's remote free stack
+ * without taking any lock. Blocks with their own mapping are unmapped.
+ *
+ * Shrinks the heap using sbrk() if the block is at the end and the free
+ * space there has reached the trim threshold.
+ *
+ * Combines adjacent free blocks using coalesce() if possible.
+ */
+void mfree(void *ptr)
+{
+    if (atomic_load_explicit(&hooks, memory_order_relaxed))
+    {
+        hooked_deallocate(ptr);
+        return;
+    }
+    deallocate(ptr);
+}
+
+/*
+ * mfree() while a trace is recorded or the heap is profiled. The free is recorded first,
+ * so another thread reusing the memory is traced after it. Sampled objects have their own
+ * mapping, so large_free() forgets them.
+ */
+static __attribute__((noinline)) void hooked_deallocate(void *ptr)
+{
+    int active = atomic_load_explicit(&hooks, memory_order_relaxed);
+    uint64_t start = active & HOOK_LATENCY ? trace_clock() : 0;
+    if (ptr != NULL && (active & HOOK_TRACE))
+    {
+        trace_record(MALLOCATE_TRACE_FREE, ptr, 0, 0);
+    }
+    deallocate(ptr);
+    if (active & HOOK_LATENCY)
+    {
+        latency_record(MALLOCATE_LATENCY_FREE, start);
+    }
+}
+
+/*
+ * Does the work of mfree() for it and for the allocator's own calls, which are not traced.
+ */
+static void deallocate(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    // Verify that the memory is within the sbrk() heap or a chunk mapped by an arena.
+    // Anything else can only be a guarded object or a block with its own mapping.
+    uintptr_t owner = owner_of(ptr);
+    if (owner == 0)
+    {
+        if (guard_owns(ptr))
+        {
+            guard_free(ptr);
+            return;
+        }
+        large_free(ptr);
+        return;
+    }
+    if (owner & CHUNK_SLAB)
+    {
+        slab_free(CHUNK_ARENA(owner), ptr);
+        return;
+    }
+    Arena *arena = CHUNK_ARENA(owner);
+
+    // Verify that the pointer is properly aligned.
+    if (!is_aligned(ptr))
+    {
+        return;
+    }
+
+    Block *metadata = (Block *)((char *)ptr - ALIGNED_METADATA_SIZE);
+    if (metadata->size & (BLOCK_FREE | BLOCK_REMOTE)) return;
+
+    // A block of another arena is claimed before anything else, so only one of two frees of it pushes it.
+    int remote = arena != arena_get();
+    if (remote && !remote_claim(metadata))
+    {
+        return;
+    }
+
+    stats_free(MALLOCATE_CLASS_BLOCK, BLOCK_SIZE(metadata));
+    if (atomic_load_explicit(&decay_time, memory_order_relaxed) != 0 &&
+        !atomic_load_explicit(&purger_started, memory_order_relaxed))
+    {
+        purger_start();
+    }
+    if (remote)
+    {
+        remote_free(arena, metadata);
+        return;
+    }
+
+    mutex_lock(&arena->lock);
+    heap_free(arena, metadata);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/*
+ * Resizes the memory pointed to by ptr to 'size' bytes, keeping its contents.
+ *
+ * Resizes in place when possible: a block grows into a free block following it or,
+ * at the top of the sbrk() heap, by moving the break, and shrinks by splitting off
+ * the rest. Blocks with their own mapping are resized with mremap().
+ * Small objects stay in their slot while the new size fits it without wasting half of it.
+ * Otherwise the memory is moved to a new allocation.
+ *
+ * Behaves like mallocate() if ptr is NULL, and like mfree() if size is 0.
+ *
+ * Returns the resized memory, or NULL if it could not be resized.
+ * The original memory is left untouched in that case.
+ */
+void *mrealloc(void *ptr, size_t size)
+{
+    void *resized = reallocate(ptr, size);
+    if (atomic_load_explicit(&hooks, memory_order_relaxed))
+    {
+        trace_record(MALLOCATE_TRACE_REALLOC, resized, (uintptr_t)ptr, size);
+    }
+    return resized;
+}
+
+/*
+ * Does the work of mrealloc().
+ */
+static void *reallocate(void *ptr, size_t size)
+{
+    int isolated = (atomic_load_explicit(&hooks, memory_order_relaxed) & HOOK_ISOLATE) != 0;
+    if (ptr == NULL)
+    {
+        return isolated ? allocate_isolated(ALIGNMENT, size) : allocate(size);
+    }
+    if (size == 0)
+    {
+        deallocate(ptr);
+        return NULL;
+    }
+    if (size > MAX_REQUEST_SIZE)
+    {
+        return NULL;
+    }
+
+    size_t aligned_size = align(size);
+    if (aligned_size < ALIGNMENT)
+    {
+        aligned_size = ALIGNMENT;
+    }
+    // Isolated memory is resized in place only if it starts a line, and to whole lines.
+    if (isolated)
+    {
+        aligned_size = (aligned_size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+    }
+
+    uintptr_t owner = owner_of(ptr);
+    if (owner == 0)
+    {
+        // A guarded object is moved out of the pool, and its old page guarded.
+        if (guard_owns(ptr))
+        {
+            return move_allocation(ptr, guard_size(ptr), size);
+        }
+        return large_realloc(ptr, aligned_size);
+    }
+    if (owner & CHUNK_SLAB)
+    {
+        Slab *slab = SLAB_OF(ptr);
+        if (aligned_size <= slab->size && aligned_size * 2 > slab->size && (!isolated || slab->size % CACHE_LINE_SIZE == 0))
+        {
+            return ptr;
+        }
+        return move_allocation(ptr, slab->size, size);
+    }
+    Arena *arena = CHUNK_ARENA(owner);
+
+    if (!is_aligned(ptr))
+    {
+        return NULL;
+    }
+
+    Block *block = (Block *)((char *)ptr - ALIGNED_METADATA_SIZE);
+    if (IS_FREE(block)) return NULL;
+
+    // Blocks of other arenas are resized under their owner's lock too.
+    mutex_lock(&arena->lock);
+    size_t old_size = BLOCK_SIZE(block);
+    int resized = (!isolated || (uintptr_t)ptr % CACHE_LINE_SIZE == 0) && resize_block(arena, block, aligned_size);
+    if (!resized && BLOCK_SIZE(block) != old_size)
+    {
+        // A failed grow may have absorbed the free tail. Give it back, so the block is freed at the size
+        // it was counted at.
+        shrink_block(arena, block, old_size);
+    }
+    size_t new_size = BLOCK_SIZE(block);
+    pthread_mutex_unlock(&arena->lock);
+
+    if (!resized)
+    {
+        return move_allocation(ptr, old_size, size);
+    }
+    ThreadStats *stats = stats_get();
+    stats_add(stats, &stats->allocated, new_size - old_size);
+    return ptr;
+}
+
+/*
+ * Moves an allocation of 'old_size' bytes to a new allocation of 'size' bytes.
+ *
+ * Returns the new allocation, or NULL if it failed. The old one is freed only on success.
+ */
+static void *move_allocation(void *ptr, size_t old_size, size_t size)
+{
+    void *moved = (atomic_load_explicit(&hooks, memory_order_relaxed) & HOOK_ISOLATE) ? allocate_isolated(ALIGNMENT, size)
+                                                                                      : allocate(size);
+    if (moved == NULL)
+    {
+        return NULL;
+    }
+    memcpy(moved, ptr, old_size < size ? old_size : size);
+    deallocate(ptr);
+    return moved;
+}
+
+/*
+ * Returns the number of usable bytes of the memory pointed to by ptr,
+ * which is at least the size it was allocated or last resized with.
+ * Returns 0 for NULL or for memory that was not allocated by this allocator.
+ */
+size_t musable_size(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return 0;
+    }
+
+    uintptr_t owner = owner_of(ptr);
+    if (owner & CHUNK_SLAB)
+    {
+        return slab_owns(ptr) ? SLAB_OF(ptr)->size : 0;
+    }
+
+    if (owner == 0 && guard_owns(ptr))
+    {
+        return guard_size(ptr);
+    }
+
+    // The header of a large block is only read once the table confirmed the pointer.
+    Block *block = (Block *)((char *)ptr - ALIGNED_METADATA_SIZE);
+    if (owner == 0)
+    {
+        mutex_lock(&large_lock);
+        int found = large_contains(block);
+        pthread_mutex_unlock(&large_lock);
+        if (!found)
+        {
+            return 0;
+        }
+    }
+    return is_aligned(ptr) ? BLOCK_SIZE(block) : 0;
+}
+
+/*
+ * Allocates 'n' blocks of memory of 'size' bytes each and stores pointers to them in 'out'.
+ *
+ * The whole batch takes the arena's lock at most once. Small objects come from the thread
+ * cache first and then straight from the slabs. Blocks are carved back to back out of
+ * a single region, found or grown like one large block.
+ *
+ * Returns the number of blocks allocated, which is less than 'n' only if memory ran out.
+ * Each of them is freed with mfree() or mfree_batch().
+ */
+size_t mallocate_batch(size_t size, size_t n, void **out)
+{
+    int active = atomic_load_explicit(&hooks, memory_order_relaxed);
+    size_t count = 0;
+    if (active & HOOK_ISOLATE)
+    {
+        // Blocks carved back to back would share lines at their boundaries.
+        while (count < n && (out[count] = allocate_isolated(ALIGNMENT, size)) != NULL)
+        {
+            count++;
+        }
+    }
+    else
+    {
+        count = allocate_batch(size, n, out);
+    }
+    if (active & HOOK_TRACE)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            trace_record(MALLOCATE_TRACE_ALLOC, out[i], 0, size);
+        }
+    }
+    return count;
+}
+
+/*
+ * Does the work of mallocate_batch().
+ */
+static size_t allocate_batch(size_t size, size_t n, void **out)
+{
+    pthread_once(&init_once, allocator_init);
+
+    if (n == 0 || size > MAX_REQUEST_SIZE)
+    {
+        return 0;
+    }
+
+    size_t aligned_size = align(size);
+    if (aligned_size < ALIGNMENT)
+    {
+        aligned_size = ALIGNMENT;
+    }
+
+    size_t count = 0;
+    if (aligned_size >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed))
+    {
+        for (; count < n; count++)
+        {
+            Block *block = large_alloc(aligned_size, ALIGNMENT);
+            if (block == NULL)
+            {
+                break;
+            }
+            out[count] = (char *)block + ALIGNED_METADATA_SIZE;
+        }
+        return count;
+    }
+
+    Arena *arena = arena_get();
+    if (aligned_size <= SLAB_MAX_SIZE)
+    {
+        size_t index = aligned_size / ALIGNMENT - 1;
+        TCache *cache = tcache_get();
+        while (cache != NULL && count < n && cache->entries[index] != NULL)
+        {
+            out[count++] = cache->entries[index];
+            cache->entries[index] = cache->entries[index]->next;
+            cache->counts[index]--;
+        }
+
+        if (count < n)
+        {
+            mutex_lock(&arena->lock);
+            drain_remote_frees(arena);
+            for (; count < n; count++)
+            {
+                out[count] = slab_get(arena, index);
+                if (out[count] == NULL)
+                {
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&arena->lock);
+        }
+
+        ThreadStats *stats = stats_get();
+        stats_add(stats, &stats->allocs[index], count);
+        return count;
+    }
+
+    mutex_lock(&arena->lock);
+    count = carve_batch(arena, aligned_size, n, out);
+    pthread_mutex_unlock(&arena->lock);
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        bytes += BLOCK_SIZE((Block *)((char *)out[i] - ALIGNED_METADATA_SIZE));
+    }
+    ThreadStats *stats = stats_get();
+    stats_add(stats, &stats->allocs[MALLOCATE_CLASS_BLOCK], count);
+    stats_add(stats, &stats->allocated, bytes);
+    return count;
+}
+
+/*
+ * Frees 'n' blocks of memory, skipping NULL pointers.
+ *
+ * Runs of pointers owned by the same arena are freed under a single lock. Blocks of other
+ * arenas go to their remote free stacks, like with mfree(), while small objects of any arena
+ * go straight back to their slabs. Since a freed block
+ * coalesces with its free neighbors, a batch carved by mallocate_batch() and freed in order
+ * becomes a single free block again.
+ */
+void mfree_batch(void **ptrs, size_t n)
+{
+    if (atomic_load_explicit(&hooks, memory_order_relaxed))
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            if (ptrs[i] != NULL)
+            {
+                trace_record(MALLOCATE_TRACE_FREE, ptrs[i], 0, 0);
+            }
+        }
+    }
+
+    Arena *locked = NULL;
+    for (size_t i = 0; i < n; i++)
+    {
+        void *ptr = ptrs[i];
+        if (ptr == NULL)
+        {
+            continue;
+        }
+
+        uintptr_t owner = owner_of(ptr);
+        if (owner == 0)
+        {
+            if (guard_owns(ptr))
+            {
+                guard_free(ptr);
+                continue;
+            }
+            large_free(ptr);
+            continue;
+        }
+
+        Arena *arena = CHUNK_ARENA(owner);
+        if (!(owner & CHUNK_SLAB) && arena != arena_get())
+        {
+            // Blocks of other arenas go to their remote free stack, as with mfree().
+            Block *block = (Block *)((char *)ptr - ALIGNED_METADATA_SIZE);
+            if (is_aligned(ptr) && !(block->size & (BLOCK_FREE | BLOCK_REMOTE)) && remote_claim(block))
+            {
+                stats_free(MALLOCATE_CLASS_BLOCK, BLOCK_SIZE(block));
+                remote_free(arena, block);
+            }
+            continue;
+        }
+        if (arena != locked)
+        {
+            if (locked != NULL)
+            {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            mutex_lock(&arena->lock);
+            locked = arena;
+        }
+
+        if (owner & CHUNK_SLAB)
+        {
+            if (slab_owns(ptr))
+            {
+                stats_free(SLAB_OF(ptr)->size / ALIGNMENT - 1, 0);
+                slab_put(arena, ptr);
+            }
+            continue;
+        }
+
+        Block *block = (Block *)((char *)ptr - ALIGNED_METADATA_SIZE);
+        if (is_aligned(ptr) && !(block->size & (BLOCK_FREE | BLOCK_REMOTE)))
+        {
+            stats_free(MALLOCATE_CLASS_BLOCK, BLOCK_SIZE(block));
+            heap_free(arena, block);
+        }
+    }
+
+    if (locked != NULL)
+    {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+/*
+ * Carves 'n' allocated blocks of 'size' bytes out of one region of the arena, back to back.
+ * The last block keeps whatever the region has beyond the batch, if it was too little to split.
+ * Falls back to one block at a time if no region for the whole batch can be found.
+ *
+ * Returns the number of blocks stored in 'out'.
+ * Must be called with the arena's lock held. 'size' must already be aligned.
+ */
+static size_t carve_batch(Arena *arena, size_t size, size_t n, void **out)
+{
+    size_t stride = ALIGNED_METADATA_SIZE + size;
+    Block *region = n <= MAX_REQUEST_SIZE / stride ? heap_alloc(arena, n * stride - ALIGNED_METADATA_SIZE) : NULL;
+    if (region == NULL)
+    {
+        size_t count = 0;
+        for (; count < n; count++)
+        {
+            Block *block = heap_alloc(arena, size);
+            if (block == NULL)
+            {
+                break;
+            }
+            out[count] = (char *)block + ALIGNED_METADATA_SIZE;
+        }
+        return count;
+    }
+
+    size_t region_size = BLOCK_SIZE(region);
+    size_t last = region->size & BLOCK_LAST;
+
+    Block *block = region;
+    for (size_t i = 0; i + 1 < n; i++)
+    {
+        block->size = size;
+        out[i] = (char *)block + ALIGNED_METADATA_SIZE;
+
+        Block *next = (Block *)((char *)block + stride);
+        next->prev_size = size;
+        block = next;
+    }
+    block->size = (region_size - (n - 1) * stride) | last;
+    out[n - 1] = (char *)block + ALIGNED_METADATA_SIZE;
+
+    update_next_prev_size(block);
+    if (arena->tail == region)
+    {
+        arena->tail = block;
+    }
+    return n;
+}
+
+/*
+ * Returns every object cached by the calling thread to its slabs,
+ * where it can be reused by other threads and empty slabs can be recycled.
+ */
+void mflush_cache(void)
+{
+    TCache *cache = tcache_get();
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    for (size_t index = 0; index < TCACHE_BINS; index++)
+    {
+        tcache_flush(cache, index, 0);
+    }
+}
+
+/*
+ * Allocates a block with 'size' bytes of usable memory from the arena,
+ * reusing a free block from the bins or growing the arena.
+ *
+ * Must be called with the arena's lock held. 'size' must already be aligned.
+ */
+static Block *heap_alloc(Arena *arena, size_t size)
+{
+    drain_remote_frees(arena);
+
+    // Look for a free block large enough for the requested size in the bins.
+    // If a suitable block is found, split it if it’s bigger than needed.
+    Block *block = find_free_block(arena, size);
+    if (block != NULL)
+    {
+        bin_remove(arena, block);
+        return split(arena, block, size);
+    }
+
+    if (arena->index == 0 && atomic_load_explicit(&huge_pages, memory_order_relaxed) == MALLOCATE_HUGE_OFF)
+    {
+        return grow_heap(arena, size);
+    }
+    return grow_arena(arena, size);
+}
+
+/*
+ * Returns a block to its arena: marks it free, coalesces it
+ * with its neighbors and places the result in its bin.
+ *
+ * If the result is the top of the sbrk() heap, the heap is trimmed. Otherwise, if it is
+ * large enough, the pages of the freed block are released. Pages of the neighbors it
+ * merged with were already considered when they were freed, so they are not released again.
+ *
+ * Must be called with the arena's lock held.
+ */
+static void heap_free(Arena *arena, Block *block)
+{
+    uintptr_t freed_start = (uintptr_t)block;
+    uintptr_t freed_end = freed_start + ALIGNED_METADATA_SIZE + BLOCK_SIZE(block);
+
+    block->size |= BLOCK_FREE;
+    block = coalesce(arena, block);
+
+    // The purger releases the block once it decayed.
+    if (atomic_load_explicit(&decay_time, memory_order_relaxed) != 0)
+    {
+        bin_insert(arena, block);
+        return;
+    }
+
+    if (!trim_heap(arena, block) &&
+        BLOCK_SIZE(block) >= atomic_load_explicit(&purge_threshold, memory_order_relaxed))
+    {
+        purge_pages(block, freed_start, freed_end);
+    }
+
+    bin_insert(arena, block);
+}
+
+/*
+ * Shrinks the sbrk() heap if 'block' is the free block at its top and at least
+ * trim_threshold bytes can be released from it. The block keeps MIN_HEAP_GROWTH bytes,
+ * so it stays in the list and the next allocations do not have to grow the heap again.
+ * The growth step starts over from MIN_HEAP_GROWTH.
+ *
+ * Returns 1 if the heap was shrunk, or 0 otherwise.
+ * Must be called with arena 0's lock held, before the block is placed in a bin.
+ */
+static int trim_heap(Arena *arena, Block *block)
+{
+    size_t threshold = atomic_load_explicit(&trim_threshold, memory_order_relaxed);
+    if (arena->index != 0 || block != arena->tail || BLOCK_SIZE(block) < MIN_HEAP_GROWTH + threshold)
+    {
+        return 0;
+    }
+
+    // The heap can only shrink if nobody else grew it after this block.
+    uintptr_t block_end = (uintptr_t)block + ALIGNED_METADATA_SIZE + BLOCK_SIZE(block);
+    if ((uintptr_t)sbrk(0) != block_end)
+    {
+        return 0;
+    }
+
+    uintptr_t keep_end = ((uintptr_t)block + ALIGNED_METADATA_SIZE + MIN_HEAP_GROWTH + page_size - 1) & ~(page_size - 1);
+    if (block_end < keep_end + threshold || move_break(-(intptr_t)(block_end - keep_end)) == (void *)-1)
+    {
+        return 0;
+    }
+
+    block->size = (keep_end - (uintptr_t)block - ALIGNED_METADATA_SIZE) | BLOCK_FREE | BLOCK_LAST;
+    atomic_store_explicit(&heap_end, keep_end, memory_order_release);
+    arena->growth = MIN_HEAP_GROWTH;
+    return 1;
+}
+
+/*
+ * Releases the physical pages of the part [start, end) of a free block with madvise().
+ * Only whole pages are released, and never the block header or its tree node.
+ * In chunks backed by huge pages only whole huge pages are released, so none is split.
+ *
+ * MADV_DONTNEED is used rather than MADV_FREE so the memory leaves the RSS right away.
+ */
+static void purge_pages(Block *block, uintptr_t start, uintptr_t end)
+{
+    size_t unit = chunk_lookup(block) & CHUNK_HUGE ? CHUNK_SIZE : page_size;
+    uintptr_t usable_start = (uintptr_t)block + ALIGNED_METADATA_SIZE + sizeof(TreeNode);
+    uintptr_t usable_end = (uintptr_t)block + ALIGNED_METADATA_SIZE + BLOCK_SIZE(block);
+
+    if (start < usable_start)
+    {
+        start = usable_start;
+    }
+    if (end > usable_end)
+    {
+        end = usable_end;
+    }
+
+    start = (start + unit - 1) & ~(unit - 1);
+    end &= ~(unit - 1);
+    if (start < end)
+    {
+        madvise((void *)start, end - start, MADV_DONTNEED);
+        PROBE2(purge, start, end - start);
+    }
+}
+
+/*
+ * Starts the purger thread, unless another call did already.
+ * Must be called without any lock held, since creating a thread allocates.
+ */
+static void purger_start(void)
+{
+    if (atomic_exchange_explicit(&purger_started, 1, memory_order_relaxed))
+    {
+        return;
+    }
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, purger_main, NULL) != 0)
+    {
+        // A later free tries again.
+        atomic_store_explicit(&purger_started, 0, memory_order_relaxed);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Initializes purger_cond on the monotonic clock, so changes of the system time do not
+ * wake the purger early or late.
+ */
+static void purger_cond_init(void)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&purger_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/*
+ * Body of the purger thread. Every DECAY_STEPS-th of the decay time it advances the epoch
+ * and releases the memory that decayed in every arena, within the purge rate.
+ */
+static void *purger_main(void *arg)
+{
+    (void)arg;
+    mutex_lock(&purger_lock);
+    for (;;)
+    {
+        size_t decay = atomic_load_explicit(&decay_time, memory_order_relaxed);
+        if (decay == 0)
+        {
+            pthread_cond_wait(&purger_cond, &purger_lock);
+            continue;
+        }
+
+        size_t step = decay / DECAY_STEPS > 0 ? decay / DECAY_STEPS : 1;
+        struct timespec wake;
+        clock_gettime(CLOCK_MONOTONIC, &wake);
+        wake.tv_sec += (time_t)(step / 1000);
+        wake.tv_nsec += (long)(step % 1000) * 1000000;
+        if (wake.tv_nsec >= 1000000000)
+        {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000;
+        }
+        // An option that changed wakes the thread early, to start over with the new step.
+        if (pthread_cond_timedwait(&purger_cond, &purger_lock, &wake) != ETIMEDOUT)
+        {
+            continue;
+        }
+        pthread_mutex_unlock(&purger_lock);
+
+        uint32_t epoch = atomic_load_explicit(&decay_epoch, memory_order_relaxed) + 1;
+        atomic_store_explicit(&decay_epoch, epoch != 0 ? epoch : 1, memory_order_relaxed);
+
+        size_t rate = atomic_load_explicit(&purge_rate, memory_order_relaxed);
+        size_t budget = rate == 0 ? SIZE_MAX : rate / 1000 * step + rate % 1000 * step / 1000;
+        for (unsigned int i = 0; i < narenas && budget > 0; i++)
+        {
+            decay_arena(&arenas[i], epoch, &budget);
+        }
+        mutex_lock(&purger_lock);
+    }
+    return NULL;
+}
+
+/*
+ * Releases the pages of the free blocks of an arena that decayed by 'epoch', taking the bytes
+ * released from '*budget'.
+ *
+ * Each block in the tree may stay dirty for a fraction of its size given by decay_curve() of its
+ * age, so memory freed in a spike is released gradually over the decay time. Whatever exceeds
+ * the sum of these fractions is released, oldest blocks first and rounded to whole blocks. The free block at the top of the
+ * sbrk() heap is trimmed instead, if trim_threshold allows.
+ *
+ * Blocks of the bins hold no whole page, so only the tree is walked.
+ */
+static void decay_arena(Arena *arena, uint32_t epoch, size_t *budget)
+{
+    // Bytes of dirty blocks by age in steps, the last entry gathering all that fully decayed.
+    size_t dirty[DECAY_STEPS + 1] = {0};
+    size_t min_size = ALIGNED_METADATA_SIZE + sizeof(TreeNode) + page_size;
+
+    mutex_lock(&arena->lock);
+    for (Block *block = tree_first(arena->tree); block != NULL; block = tree_next(block))
+    {
+        uint32_t since = TREE_NODE(block)->dirty;
+        if (since != 0 && BLOCK_SIZE(block) >= min_size)
+        {
+            uint32_t age = epoch - since;
+            dirty[age < DECAY_STEPS ? age : DECAY_STEPS] += BLOCK_SIZE(block);
+        }
+    }
+
+    // How much of each age to release, oldest first, to bring the dirty bytes down to the curve.
+    double excess = 0;
+    for (uint32_t age = 0; age <= DECAY_STEPS; age++)
+    {
+        excess += (double)dirty[age] * (1.0 - decay_curve(age));
+    }
+    size_t release[DECAY_STEPS + 1] = {0};
+    for (int age = DECAY_STEPS; age >= 0 && excess > 0; age--)
+    {
+        release[age] = excess < (double)dirty[age] ? (size_t)excess : dirty[age];
+        excess -= (double)release[age];
+    }
+
+    Block *top = NULL;
+    for (Block *block = tree_first(arena->tree); block != NULL && *budget > 0; block = tree_next(block))
+    {
+        uint32_t since = TREE_NODE(block)->dirty;
+        size_t size = BLOCK_SIZE(block);
+        if (since == 0 || size < min_size)
+        {
+            continue;
+        }
+        uint32_t age = epoch - since;
+        age = age < DECAY_STEPS ? age : DECAY_STEPS;
+        // Blocks are released whole, rounding the bytes to release to the nearest block.
+        if (release[age] <= size / 2)
+        {
+            continue;
+        }
+        release[age] -= size < release[age] ? size : release[age];
+        *budget -= size < *budget ? size : *budget;
+
+        // Trimming changes the size of the block, so it has to wait until the walk is over.
+        if (arena->index == 0 && block == arena->tail)
+        {
+            top = block;
+            continue;
+        }
+        purge_pages(block, (uintptr_t)block, (uintptr_t)block + ALIGNED_METADATA_SIZE + size);
+        TREE_NODE(block)->dirty = 0;
+    }
+
+    if (top != NULL)
+    {
+        bin_remove(arena, top);
+        trim_heap(arena, top);
+        purge_pages(top, (uintptr_t)top, (uintptr_t)top + ALIGNED_METADATA_SIZE + BLOCK_SIZE(top));
+        bin_insert(arena, top);
+        if (BLOCK_SIZE(top) > SMALL_BIN_LIMIT)
+        {
+            TREE_NODE(top)->dirty = 0;
+        }
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/*
+ * Fraction of the dirty bytes of age 'age' steps allowed to stay dirty: 1 right after they were
+ * freed, falling along a smoothstep to 0 once they are a whole decay time old.
+ */
+static double decay_curve(uint32_t age)
+{
+    if (age >= DECAY_STEPS)
+    {
+        return 0.0;
+    }
+    double x = (double)age / DECAY_STEPS;
+    return 1.0 - x * x * (3.0 - 2.0 * x);
+}
+
+/*
+ * Extends the heap of arena 0 with sbrk() so that it holds a block of 'size' bytes.
+ *
+ * The heap grows by at least the arena's growth step, up to a page boundary. If the block
+ * at the top of the heap is free it is extended, otherwise a new block is appended to the arena.
+ * The part not needed for the request is split off as a free block.
+ *
+ * Must be called with arena 0's lock held.
+ */
+static Block *grow_heap(Arena *arena, size_t size)
+{
+    uintptr_t brk_end = (uintptr_t)sbrk(0);
+
+    // Extend the free top block if nobody else moved the break since it was created.
+    Block *top = arena->tail;
+    if (top != NULL && (!IS_FREE(top) || (uintptr_t)top + ALIGNED_METADATA_SIZE + BLOCK_SIZE(top) != brk_end))
+    {
+        top = NULL;
+    }
+    size_t needed = top != NULL ? size - BLOCK_SIZE(top) : RUN_HEADER_SIZE + ALIGNED_METADATA_SIZE + size;
+
+    size_t increment;
+    void *allocated = heap_extend(arena, brk_end, needed, &increment);
+    if (allocated == NULL)
+    {
+        return NULL;
+    }
+
+    // Another sbrk() user may have moved the break in the meantime.
+    if (top != NULL && (uintptr_t)allocated != brk_end)
+    {
+        top = NULL;
+        if (increment < RUN_HEADER_SIZE + ALIGNED_METADATA_SIZE + size)
+        {
+            move_break(-(intptr_t)increment);
+            return NULL;
+        }
+    }
+
+    Block *block;
+    if (top != NULL)
+    {
+        bin_remove(arena, top);
+        top->size += increment;
+        block = top;
+    }
+    else
+    {
+        block = append_block(arena, allocated, increment);
+    }
+
+    if (atomic_load_explicit(&heap_start, memory_order_relaxed) == 0)
+    {
+        atomic_store_explicit(&heap_start, (uintptr_t)allocated, memory_order_relaxed);
+    }
+    atomic_store_explicit(&heap_end, (uintptr_t)allocated + increment, memory_order_release);
+
+    return split(arena, block, size);
+}
+
+/*
+ * Moves the break of the sbrk() heap up by at least 'needed' bytes: by the arena's growth step
+ * if that is more, up to a page boundary, or by exactly 'needed' bytes if that fails.
+ * The growth step doubles every time.
+ *
+ * Returns the start of the new memory and stores its size in 'increment', or returns NULL.
+ * This is the only place the allocator grows the heap with sbrk().
+ * Must be called with arena 0's lock held. 'brk_end' is the break before the call.
+ */
+static void *heap_extend(Arena *arena, uintptr_t brk_end, size_t needed, size_t *increment)
+{
+    size_t step = arena->growth > MIN_HEAP_GROWTH ? arena->growth : MIN_HEAP_GROWTH;
+    size_t bytes = needed > step ? needed : step;
+    bytes = ((brk_end + bytes + page_size - 1) & ~(page_size - 1)) - brk_end;
+
+    void *allocated = move_break((intptr_t)bytes);
+    if (allocated == (void *)-1)
+    {
+        // Fall back to exactly what the request needs.
+        bytes = needed;
+        allocated = move_break((intptr_t)bytes);
+        if (allocated == (void *)-1)
+        {
+            return NULL;
+        }
+    }
+    arena->growth = step < MAX_HEAP_GROWTH ? step * 2 : MAX_HEAP_GROWTH;
+    bind_node(allocated, bytes, arena->node);
+    PROBE2(heap_grow, arena->index, bytes);
+
+    *increment = bytes;
+    return allocated;
+}
+
+/*
+ * Resizes an allocated block to 'size' bytes without moving it.
+ *
+ * A free block following it is absorbed first, so the block can grow into it and memory
+ * released by a shrink merges with it. Memory left over is split off and freed like any
+ * other block. If that is still not enough and the block is at the top of the sbrk() heap,
+ * the heap is extended under it.
+ *
+ * Returns 1 if the block now holds 'size' bytes, or 0 if it has to move.
+ * The block may have absorbed its free neighbor even then.
+ * Must be called with the arena's lock held.
+ */
+static int resize_block(Arena *arena, Block *block, size_t size)
+{
+    Block *next = next_adjacent(block);
+    if (next != NULL && IS_FREE(next) &&
+        (BLOCK_SIZE(block) + ALIGNED_METADATA_SIZE + BLOCK_SIZE(next) >= size || next == arena->tail))
+    {
+        bin_remove(arena, next);
+        if (arena->tail == next)
+        {
+            arena->tail = block;
+        }
+        block->size = (BLOCK_SIZE(block) + ALIGNED_METADATA_SIZE + BLOCK_SIZE(next)) | (next->size & BLOCK_LAST);
+        update_next_prev_size(block);
+    }
+
+    if (BLOCK_SIZE(block) < size && !extend_top(arena, block, size))
+    {
+        return 0;
+    }
+
+    shrink_block(arena, block, size);
+    return 1;
+}
+
+/*
+ * Splits an allocated block down to 'size' bytes and frees the rest with heap_free(),
+ * so it merges with a free block following it and can trim the heap or release its pages.
+ *
+ * Must be called with the arena's lock held.
+ */
+static void shrink_block(Arena *arena, Block *block, size_t size)
+{
+    size_t full_size = BLOCK_SIZE(block);
+    split(arena, block, size);
+    if (BLOCK_SIZE(block) != full_size)
+    {
+        // split() put the leftover in a bin without looking at its neighbors.
+        Block *leftover = next_adjacent(block);
+        bin_remove(arena, leftover);
+        leftover->size &= ~BLOCK_FREE;
+        heap_free(arena, leftover);
+    }
+}
+
+/*
+ * Moves the start of the usable memory of an allocated block up to the next multiple
+ * of 'alignment'. The memory in front of it becomes a free block of its own, so it must
+ * be at least MIN_BLOCK_SIZE bytes: the block needs 'alignment' + MIN_BLOCK_SIZE spare bytes.
+ *
+ * Returns the aligned block, which keeps the rest of the memory.
+ * Must be called with the arena's lock held.
+ */
+static Block *align_block(Arena *arena, Block *block, size_t alignment)
+{
+    uintptr_t memory = (uintptr_t)block + ALIGNED_METADATA_SIZE;
+    uintptr_t aligned = (memory + alignment - 1) & ~(alignment - 1);
+    if (aligned == memory)
+    {
+        return block;
+    }
+    if (aligned - memory < MIN_BLOCK_SIZE)
+    {
+        aligned += alignment;
+    }
+
+    size_t lead_size = aligned - memory - ALIGNED_METADATA_SIZE;
+    Block *aligned_block = (Block *)(aligned - ALIGNED_METADATA_SIZE);
+    aligned_block->prev_size = lead_size;
+    aligned_block->size = (BLOCK_SIZE(block) - (aligned - memory)) | (block->size & BLOCK_LAST);
+    update_next_prev_size(aligned_block);
+    if (arena->tail == block)
+    {
+        arena->tail = aligned_block;
+    }
+
+    // The leading slack is freed, so it merges with a free block in front of it.
+    block->size = lead_size;
+    heap_free(arena, block);
+
+    return aligned_block;
+}
+
+/*
+ * Grows the allocated block at the top of the sbrk() heap to at least 'size' bytes
+ * by moving the break. Only arena 0 can grow in place.
+ *
+ * Returns 1 on success, or 0 if the block is not at the top or the heap could not grow.
+ * Must be called with arena 0's lock held.
+ */
+static int extend_top(Arena *arena, Block *block, size_t size)
+{
+    uintptr_t block_end = (uintptr_t)block + ALIGNED_METADATA_SIZE + BLOCK_SIZE(block);
+    if (arena->index != 0 || block != arena->tail || (uintptr_t)sbrk(0) != block_end)
+    {
+        return 0;
+    }
+
+    size_t increment;
+    void *allocated = heap_extend(arena, block_end, size - BLOCK_SIZE(block), &increment);
+    if (allocated == NULL)
+    {
+        return 0;
+    }
+
+    // Another sbrk() user moved the break in the meantime. Keep the memory as a free block.
+    if ((uintptr_t)allocated != block_end)
+    {
+        if (increment < RUN_HEADER_SIZE + MIN_BLOCK_SIZE)
+        {
+            move_break(-(intptr_t)increment);
+            return 0;
+        }
+        atomic_store_explicit(&heap_end, (uintptr_t)allocated + increment, memory_order_release);
+        heap_free(arena, append_block(arena, allocated, increment));
+        return 0;
+    }
+
+    block->size += increment;
+    atomic_store_explicit(&heap_end, block_end + increment, memory_order_release);
+    return 1;
+}
+
+/*
+ * Extends an arena with a newly mapped region of whole chunks, large enough for a block
+ * of 'size' bytes. The rest of the region is split off as a free block.
+ * Used by every arena but arena 0, and by arena 0 too when huge pages are enabled.
+ *
+ * Must be called with the arena's lock held.
+ */
+static Block *grow_arena(Arena *arena, size_t size)
+{
+    size_t region_size = (RUN_HEADER_SIZE + ALIGNED_METADATA_SIZE + size + CHUNK_SIZE - 1) & ~(CHUNK_SIZE - 1);
+
+    uintptr_t flags;
+    void *start = map_chunks(region_size, arena->node, &flags);
+    if (start == NULL)
+    {
+        return NULL;
+    }
+
+    if (!chunk_register(start, region_size, (uintptr_t)arena | flags))
+    {
+        unmap_pages(start, region_size);
+        return NULL;
+    }
+
+    PROBE2(heap_grow, arena->index, region_size);
+    Block *memory = append_block(arena, start, region_size);
+    return split(arena, memory, size);
+}
+
+/*
+ * Maps a CHUNK_SIZE-aligned region of 'size' bytes, a multiple of CHUNK_SIZE.
+ *
+ * With MALLOCATE_HUGE_EXPLICIT the region is taken from the reserved huge pages, which are
+ * aligned already, falling back to transparent huge pages once the reserve is used up.
+ * With MALLOCATE_HUGE_TRANSPARENT the region asks the kernel for transparent huge pages.
+ * 'flags' is set to CHUNK_HUGE in both cases, and to 0 otherwise.
+ * The region is bound to NUMA node 'node', unless it is -1.
+ *
+ * Returns the region, or NULL if the mapping failed.
+ */
+static void *map_chunks(size_t size, int node, uintptr_t *flags)
+{
+    int mode = atomic_load_explicit(&huge_pages, memory_order_relaxed);
+    *flags = mode != MALLOCATE_HUGE_OFF ? CHUNK_HUGE : 0;
+
+#ifdef MAP_HUGETLB
+    if (mode == MALLOCATE_HUGE_EXPLICIT)
+    {
+        void *reserved = map_pages(size, MAP_HUGETLB | (CHUNK_SHIFT << MAP_HUGE_SHIFT));
+        if (reserved != MAP_FAILED)
+        {
+            bind_node(reserved, size, node);
+            return reserved;
+        }
+    }
+#endif
+
+    // Map one extra chunk so an aligned region can be cut out of the mapping.
+    void *mapping = map_pages(size + CHUNK_SIZE, 0);
+    if (mapping == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    uintptr_t start = ((uintptr_t)mapping + CHUNK_SIZE - 1) & ~(CHUNK_SIZE - 1);
+    size_t lead = start - (uintptr_t)mapping;
+    if (lead > 0)
+    {
+        unmap_pages(mapping, lead);
+    }
+    unmap_pages((char *)start + size, CHUNK_SIZE - lead);
+
+    if (mode != MALLOCATE_HUGE_OFF)
+    {
+        madvise((void *)start, size, MADV_HUGEPAGE);
+    }
+    bind_node((void *)start, size, node);
+    return (void *)start;
+}
+
+/*
+ * Makes the pages of 'size' bytes at 'addr' come from NUMA node 'node' when they are first touched,
+ * whichever thread touches them, falling back to other nodes when it runs out of memory.
+ * Pages that cannot be bound are left to the default policy. Does nothing if 'node' is -1.
+ */
+static void bind_node(void *addr, size_t size, int node)
+{
+    if (node < 0)
+    {
+        return;
+    }
+
+    // Only whole pages can be bound.
+    uintptr_t start = ((uintptr_t)addr + page_size - 1) & ~(page_size - 1);
+    uintptr_t end = ((uintptr_t)addr + size) & ~(page_size - 1);
+    if (start >= end)
+    {
+        return;
+    }
+
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, mask, (unsigned long)MAX_NODES + 1, 0);
+}
+
+/*
+ * Maps 'size' bytes of zeroed memory, with 'flags' added to the mmap() flags.
+ * Every mapping of the allocator is made here.
+ *
+ * Returns the memory, or MAP_FAILED like mmap().
+ */
+static void *map_pages(size_t size, int flags)
+{
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    PROBE2(mmap, mapping, size);
+
+    ThreadStats *stats = stats_get();
+    stats_add(stats, &stats->mmap_calls, 1);
+    if (mapping != MAP_FAILED)
+    {
+        stats_add(stats, &stats->mapped, size);
+    }
+    return mapping;
+}
+
+/*
+ * Unmaps 'size' bytes of memory obtained with map_pages().
+ */
+static void unmap_pages(void *addr, size_t size)
+{
+    munmap(addr, size);
+    PROBE2(munmap, addr, size);
+
+    ThreadStats *stats = stats_get();
+    stats_add(stats, &stats->mmap_calls, 1);
+    stats_add(stats, &stats->mapped, -size);
+}
+
+/*
+ * Moves the break by 'increment' bytes with sbrk(). Every move of the break by the allocator is made here.
+ *
+ * Returns the previous break, or (void *)-1 like sbrk().
+ */
+static void *move_break(intptr_t increment)
+{
+    void *previous = sbrk(increment);
+    PROBE2(sbrk, increment, previous);
+
+    ThreadStats *stats = stats_get();
+    stats_add(stats, &stats->sbrk_calls, 1);
+    if (previous != (void *)-1)
+    {
+        stats_add(stats, &stats->mapped, (size_t)increment);
+    }
+    return previous;
+}
+
+/*
+ * Locks 'mutex', counting the acquisition as contended if another thread holds it.
+ */
+static void mutex_lock(pthread_mutex_t *mutex)
+{
+    if (pthread_mutex_trylock(mutex) != 0)
+    {
+        ThreadStats *stats = stats_get();
+        stats_add(stats, &stats->contentions, 1);
+        PROBE1(lock_wait, mutex);
+        pthread_mutex_lock(mutex);
+        PROBE1(lock_acquire, mutex);
+    }
+}
+
+/*
+ * Allocates a small object of 'size' bytes, an ALIGNMENT multiple up to SLAB_MAX_SIZE.
+ * Served from the thread cache without taking a lock, refilling it from the slabs when empty.
+ */
+static void *slab_alloc(size_t size)
+{
+    Arena *arena = arena_get();
+    size_t index = size / ALIGNMENT - 1;
+
+    TCache *cache = tcache_get();
+    if (cache == NULL)
+    {
+        mutex_lock(&arena->lock);
+        drain_remote_frees(arena);
+        void *object = slab_get(arena, index);
+        pthread_mutex_unlock(&arena->lock);
+        if (object != NULL)
+        {
+            stats_alloc(index, 0);
+        }
+        return object;
+    }
+
+    FreeObject *object = cache->entries[index];
+    if (object == NULL)
+    {
+        object = tcache_refill(cache, arena, index);
+        if (object == NULL)
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        cache->entries[index] = object->next;
+        cache->counts[index]--;
+    }
+    stats_bump(&cache->stats.allocs[index], 1);
+    return object;
+}
+
+/*
+ * Frees an object inside a slab chunk of 'arena'.
+ *
+ * Pointers that are not at the start of an allocated slot are ignored. Objects of the
+ * thread's own arena go to its cache, others to their arena's remote free stack.
+ */
+static void slab_free(Arena *arena, void *ptr)
+{
+    if (!slab_owns(ptr))
+    {
+        return;
+    }
+
+    Slab *slab = SLAB_OF(ptr);
+    FreeObject *object = (FreeObject *)ptr;
+    size_t index = slab->size / ALIGNMENT - 1;
+
+    // An object flushed back to its slab is a double free the cache scan below cannot see.
+    size_t slot = ((uintptr_t)ptr & (SLAB_SIZE - 1)) / slab->size;
+    if (slab->free_map[slot / 64] & ((uint64_t)1 << (slot % 64)))
+    {
+        return;
+    }
+
+    if (arena != arena_get())
+    {
+        _Atomic(uintptr_t) *key = (_Atomic(uintptr_t) *)&object->key;
+        uintptr_t old_key = atomic_load_explicit(key, memory_order_relaxed);
+        do
+        {
+            if (old_key == remote_key)
+            {
+                return;
+            }
+        } while (!atomic_compare_exchange_weak_explicit(key, &old_key, remote_key, memory_order_relaxed,
+                                                        memory_order_relaxed));
+
+        stats_free(index, 0);
+        FreeObject *top = atomic_load_explicit(&arena->remote_slab_frees, memory_order_relaxed);
+        do
+        {
+            object->next = top;
+        } while (!atomic_compare_exchange_weak_explicit(&arena->remote_slab_frees, &top, object,
+                                                        memory_order_release, memory_order_relaxed));
+        return;
+    }
+
+    TCache *cache = tcache_get();
+    if (cache == NULL)
+    {
+        stats_free(index, 0);
+        mutex_lock(&arena->lock);
+        slab_put(arena, ptr);
+        pthread_mutex_unlock(&arena->lock);
+        return;
+    }
+
+    // The key may also be user data, so only a hit in the list is a double free.
+    if (object->key == tcache_key)
+    {
+        for (FreeObject *curr = cache->entries[index]; curr != NULL; curr = curr->next)
+        {
+            if (curr == object)
+            {
+                return;
+            }
+        }
+    }
+
+    if (cache->counts[index] >= TCACHE_MAX_COUNT)
+    {
+        tcache_flush(cache, index, TCACHE_MAX_COUNT - TCACHE_BATCH);
+    }
+
+    object->next = cache->entries[index];
+    object->key = tcache_key;
+    cache->entries[index] = object;
+    cache->counts[index]++;
+    stats_bump(&cache->stats.frees[index], 1);
+}
+
+/*
+ * Returns 1 if 'ptr', an address inside a slab chunk, is the start of a slot of a slab in use.
+ */
+static int slab_owns(void *ptr)
+{
+    Slab *slab = SLAB_OF(ptr);
+    size_t offset = (uintptr_t)ptr & (SLAB_SIZE - 1);
+    return slab->size != 0 && offset % slab->size == 0 && offset / slab->size < slab->capacity;
+}
+
+/*
+ * Takes one free slot of size class 'index' from the arena's slabs,
+ * creating a new slab if none has a free slot.
+ *
+ * Returns the object, or NULL if no slab could be created.
+ * Must be called with the arena's lock held.
+ */
+static void *slab_get(Arena *arena, size_t index)
+{
+    Slab *slab = arena->slabs[index];
+    if (slab == NULL)
+    {
+        slab = slab_create(arena, index);
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    size_t word = 0;
+    while (slab->free_map[word] == 0)
+    {
+        word++;
+    }
+    unsigned int bit = (unsigned int)__builtin_ctzll(slab->free_map[word]);
+    slab->free_map[word] &= ~((uint64_t)1 << bit);
+
+    // A full slab leaves the list until one of its objects is freed.
+    if (++slab->used == slab->capacity)
+    {
+        slab_unlink(arena, slab);
+    }
+
+    return SLAB_OBJECTS(slab) + (word * 64 + bit) * slab->size;
+}
+
+/*
+ * Returns an object to its slab. Freeing a slot that is already free is ignored.
+ *
+ * A slab that was full goes back to the list of its size class. A slab that becomes
+ * empty is recycled into free_slabs, unless it is the only one of its class with
+ * free slots, so a single object allocated and freed in a loop does not
+ * recycle a slab every time.
+ *
+ * Must be called with the arena's lock held.
+ */
+static void slab_put(Arena *arena, void *ptr)
+{
+    Slab *slab = SLAB_OF(ptr);
+    size_t slot = ((uintptr_t)ptr & (SLAB_SIZE - 1)) / slab->size;
+    uint64_t mask = (uint64_t)1 << (slot % 64);
+    if (slab->free_map[slot / 64] & mask)
+    {
+        return;
+    }
+    slab->free_map[slot / 64] |= mask;
+
+    size_t index = slab->size / ALIGNMENT - 1;
+    if (!slab->listed)
+    {
+        slab->prev = NULL;
+        slab->next = arena->slabs[index];
+        if (slab->next != NULL)
+        {
+            slab->next->prev = slab;
+        }
+        arena->slabs[index] = slab;
+        slab->listed = 1;
+    }
+
+    if (--slab->used == 0 && (slab->prev != NULL || slab->next != NULL))
+    {
+        slab_unlink(arena, slab);
+        slab->size = 0;
+        slab->next = arena->free_slabs;
+        arena->free_slabs = slab;
+    }
+}
+
+/*
+ * Starts a new slab for size class 'index' and puts it in the class's list.
+ * The page is an empty slab from free_slabs if there is one, otherwise the next page
+ * of the newest slab chunk. A new slab chunk is mapped when the newest one is used up.
+ *
+ * Returns the slab, or NULL if no chunk could be mapped.
+ * Must be called with the arena's lock held.
+ */
+static Slab *slab_create(Arena *arena, size_t index)
+{
+    Slab *slab = arena->free_slabs;
+    if (slab != NULL)
+    {
+        arena->free_slabs = slab->next;
+    }
+    else
+    {
+        if (arena->slab_next == arena->slab_end)
+        {
+            uintptr_t flags;
+            void *chunk = map_chunks(CHUNK_SIZE, arena->node, &flags);
+            if (chunk == NULL)
+            {
+                return NULL;
+            }
+            if (!chunk_register(chunk, CHUNK_SIZE, (uintptr_t)arena | CHUNK_SLAB | flags))
+            {
+                unmap_pages(chunk, CHUNK_SIZE);
+                return NULL;
+            }
+
+            SlabChunk *header = (SlabChunk *)chunk;
+            header->next = arena->slab_chunks;
+            arena->slab_chunks = header;
+            arena->slab_next = (char *)chunk + SLAB_TABLE_PAGES * SLAB_SIZE;
+            arena->slab_end = (char *)chunk + CHUNK_SIZE;
+        }
+
+        slab = SLAB_OF(arena->slab_next);
+        arena->slab_next += SLAB_SIZE;
+        arena->slab_bytes += SLAB_SIZE;
+    }
+
+    size_t size = (index + 1) * ALIGNMENT;
+    slab->size = (uint16_t)size;
+    slab->capacity = (uint16_t)(SLAB_SIZE / size);
+    slab->used = 0;
+    slab->arena = arena->index;
+    memset(slab->free_map, 0, sizeof(slab->free_map));
+    for (size_t slot = 0; slot < slab->capacity; slot += 64)
+    {
+        size_t bits = slab->capacity - slot;
+        slab->free_map[slot / 64] = bits >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+    }
+
+    slab->prev = NULL;
+    slab->next = arena->slabs[index];
+    if (slab->next != NULL)
+    {
+        slab->next->prev = slab;
+    }
+    arena->slabs[index] = slab;
+    slab->listed = 1;
+
+    return slab;
+}
+
+/*
+ * Removes a slab from the list of its size class.
+ * Must be called with the arena's lock held.
+ */
+static void slab_unlink(Arena *arena, Slab *slab)
+{
+    size_t index = slab->size / ALIGNMENT - 1;
+
+    if (slab->prev != NULL)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        arena->slabs[index] = slab->next;
+    }
+    if (slab->next != NULL)
+    {
+        slab->next->prev = slab->prev;
+    }
+
+    slab->prev = NULL;
+    slab->next = NULL;
+    slab->listed = 0;
+}
+
+/*
+ * Turns 'bytes' bytes of newly obtained memory into an allocated block at the end of the arena.
+ * If the memory directly follows the arena's last block, the block continues its run.
+ * Otherwise the memory starts a new run, and its header takes RUN_HEADER_SIZE bytes.
+ */
+static Block *append_block(Arena *arena, void *memory, size_t bytes)
+{
+    Block *block;
+
+    Block *tail = arena->tail;
+    if (tail != NULL && (char *)tail + ALIGNED_METADATA_SIZE + BLOCK_SIZE(tail) == (char *)memory)
+    {
+        // Record the boundary tag, the block directly follows the last one.
+        tail->size &= ~BLOCK_LAST;
+        block = (Block *)memory;
+        block->prev_size = BLOCK_SIZE(tail);
+        block->size = (bytes - ALIGNED_METADATA_SIZE) | BLOCK_LAST;
+    }
+    else
+    {
+        Run *run = (Run *)memory;
+        run->next = NULL;
+
+        Run **link = &arena->runs;
+        while (*link != NULL)
+        {
+            link = &(*link)->next;
+        }
+        *link = run;
+
+        block = RUN_FIRST_BLOCK(run);
+        block->prev_size = 0;
+        block->size = (bytes - RUN_HEADER_SIZE - ALIGNED_METADATA_SIZE) | BLOCK_LAST;
+    }
+    arena->tail = block;
+
+    return block;
+}
+
+/*
+ * Returns the arena the calling thread allocates from, binding the thread on first use
+ * to the next arena round-robin among those of the node it runs on.
+ * If there are fewer arenas than nodes, a node without one picks among all of them.
+ */
+static Arena *arena_get(void)
+{
+    if (thread_arena == NULL)
+    {
+        pthread_once(&init_once, allocator_init);
+
+        unsigned int node = nnodes > 1 ? current_node() % nnodes : 0;
+        if (node >= narenas)
+        {
+            thread_arena = &arenas[atomic_fetch_add(&next_arena[node], 1) % narenas];
+        }
+        else
+        {
+            unsigned int count = (narenas - 1 - node) / nnodes + 1;
+            thread_arena = &arenas[node + nnodes * (atomic_fetch_add(&next_arena[node], 1) % count)];
+        }
+    }
+    return thread_arena;
+}
+
+/*
+ * Returns the NUMA node of the CPU the calling thread runs on, or 0 if it cannot be found.
+ */
+static unsigned int current_node(void)
+{
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+    {
+        return 0;
+    }
+    return node;
+}
+
+/*
+ * Returns the number of NUMA nodes: one more than the highest online node listed in
+ * /sys/devices/system/node/online, which holds ranges like "0-3" or "0,2".
+ * At most MAX_NODES are counted, and 1 is returned if the file cannot be read.
+ */
+static unsigned int count_nodes(void)
+{
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 1;
+    }
+
+    char buffer[256];
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0)
+    {
+        return 1;
+    }
+    buffer[length] = '\0';
+
+    // The list is sorted, so the last number in it is the highest node.
+    unsigned long highest = 0;
+    for (char *cursor = buffer; *cursor != '\0';)
+    {
+        char *end;
+        unsigned long node = strtoul(cursor, &end, 10);
+        if (end == cursor)
+        {
+            cursor++;
+            continue;
+        }
+        highest = node;
+        cursor = end;
+    }
+    return highest < MAX_NODES ? (unsigned int)highest + 1 : MAX_NODES;
+}
+
+/*
+ * Marks a block of another arena as waiting on its remote free stack.
+ * The owner clears the mark when it drains the stack.
+ *
+ * Returns 1 if the caller may push the block, or 0 if it is already waiting there.
+ */
+static int remote_claim(Block *block)
+{
+    // Only the thread freeing an allocated block writes its size, so the mark is the only race.
+    size_t size = atomic_fetch_or_explicit((_Atomic(size_t) *)&block->size, BLOCK_REMOTE, memory_order_relaxed);
+    return (size & BLOCK_REMOTE) == 0;
+}
+
+/*
+ * Hands a block back to its arena from a thread bound to another arena.
+ * Pushes it onto the arena's remote free stack with a single compare-and-swap loop,
+ * so the freeing thread never waits for the arena's lock.
+ */
+static void remote_free(Arena *arena, Block *block)
+{
+    Block *top = atomic_load_explicit(&arena->remote_frees, memory_order_relaxed);
+    do
+    {
+        FREE_LINKS(block)->next = top;
+    } while (!atomic_compare_exchange_weak_explicit(&arena->remote_frees, &top, block,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+/*
+ * Frees every block and slab object on the arena's remote free stacks.
+ * The whole stack is taken with one atomic exchange, so there is no ABA problem.
+ *
+ * Must be called with the arena's lock held.
+ */
+static void drain_remote_frees(Arena *arena)
+{
+    if (atomic_load_explicit(&arena->remote_frees, memory_order_relaxed) != NULL)
+    {
+        Block *block = atomic_exchange_explicit(&arena->remote_frees, NULL, memory_order_acquire);
+        while (block != NULL)
+        {
+            Block *next = FREE_LINKS(block)->next;
+            block->size &= ~BLOCK_REMOTE;
+            heap_free(arena, block);
+            block = next;
+        }
+    }
+
+    if (atomic_load_explicit(&arena->remote_slab_frees, memory_order_relaxed) != NULL)
+    {
+        FreeObject *object = atomic_exchange_explicit(&arena->remote_slab_frees, NULL, memory_order_acquire);
+        while (object != NULL)
+        {
+            FreeObject *next = object->next;
+            object->key = 0;
+            slab_put(arena, object);
+            object = next;
+        }
+    }
+}
+
+/*
+ * Returns the owner of the memory at 'ptr' in the form of a chunk_map entry: arena 0 for
+ * the sbrk() heap, otherwise the entry of the chunk containing it. 0 means the memory
+ * can only be a block with its own mapping. Safe to call on any address without holding a lock.
+ */
+static uintptr_t owner_of(void *ptr)
+{
+    uintptr_t addr = (uintptr_t)ptr;
+    if (addr >= atomic_load_explicit(&heap_start, memory_order_relaxed) &&
+        addr < atomic_load_explicit(&heap_end, memory_order_acquire))
+    {
+        return (uintptr_t)&arenas[0];
+    }
+    return chunk_lookup(ptr);
+}
+
+/*
+ * Returns the chunk_map entry of the mapped chunk containing 'ptr': the owning arena,
+ * tagged with CHUNK_SLAB and CHUNK_HUGE, or 0 if the address is not in a chunk
+ * mapped by the allocator. Safe to call on any address without holding a lock.
+ */
+static uintptr_t chunk_lookup(void *ptr)
+{
+    uintptr_t chunk = (uintptr_t)ptr >> CHUNK_SHIFT;
+    size_t root = chunk >> CHUNK_MAP_LEAF_BITS;
+    if (root >= ((size_t)1 << CHUNK_MAP_ROOT_BITS))
+    {
+        return 0;
+    }
+
+    ChunkMapLeaf *leaf = atomic_load_explicit(&chunk_map[root], memory_order_acquire);
+    if (leaf == NULL)
+    {
+        return 0;
+    }
+    return atomic_load_explicit(&(*leaf)[chunk & (CHUNK_MAP_LEAF_SIZE - 1)], memory_order_acquire);
+}
+
+/*
+ * Records 'entry' for every chunk in the aligned region [chunk, chunk + size).
+ *
+ * Returns 1 on success, or 0 if a leaf of the map could not be allocated.
+ */
+static int chunk_register(void *chunk, size_t size, uintptr_t entry)
+{
+    mutex_lock(&chunk_lock);
+    for (uintptr_t addr = (uintptr_t)chunk; addr < (uintptr_t)chunk + size; addr += CHUNK_SIZE)
+    {
+        uintptr_t index = addr >> CHUNK_SHIFT;
+        size_t root = index >> CHUNK_MAP_LEAF_BITS;
+
+        ChunkMapLeaf *leaf = atomic_load_explicit(&chunk_map[root], memory_order_relaxed);
+        if (leaf == NULL)
+        {
+            void *mapped = map_pages(sizeof(ChunkMapLeaf), 0);
+            if (mapped == MAP_FAILED)
+            {
+                pthread_mutex_unlock(&chunk_lock);
+                return 0;
+            }
+            leaf = (ChunkMapLeaf *)mapped;
+            atomic_store_explicit(&chunk_map[root], leaf, memory_order_release);
+        }
+        atomic_store_explicit(&(*leaf)[index & (CHUNK_MAP_LEAF_SIZE - 1)], entry, memory_order_release);
+    }
+    pthread_mutex_unlock(&chunk_lock);
+
+    if (entry & CHUNK_HUGE)
+    {
+        ThreadStats *stats = stats_get();
+        stats_add(stats, &stats->huge_mapped, size);
+    }
+    return 1;
+}
+
+/*
+ * Sets a tuning option of the allocator.
+ *
+ * Options:
+ *   MALLOCATE_MMAP_THRESHOLD  - requests of at least 'value' bytes get their own mapping.
+ *   MALLOCATE_TRIM_THRESHOLD  - the sbrk() heap is shrunk once 'value' bytes can be released from its top.
+ *   MALLOCATE_PURGE_THRESHOLD - pages of freed memory are released once it is part of a free
+ *                               block of at least 'value' bytes.
+ *   MALLOCATE_HUGE_PAGES      - chunks mapped from now on are backed by huge pages: 'value' is
+ *                               MALLOCATE_HUGE_OFF, MALLOCATE_HUGE_TRANSPARENT or MALLOCATE_HUGE_EXPLICIT.
+ *   MALLOCATE_DECAY_TIME      - free pages are released by a background thread over 'value' ms
+ *                               instead of in mfree(). 0 releases them in mfree() again.
+ *   MALLOCATE_PURGE_RATE      - the background thread releases at most 'value' bytes per second,
+ *                               or any amount if 'value' is 0.
+ *   MALLOCATE_PROFILE_INTERVAL - samples about one allocation per 'value' bytes for the heap profile,
+ *                               see mallocate_profile_dump(). 0 stops sampling; objects sampled
+ *                               before stay in the profile until they are freed.
+ *   MALLOCATE_ISOLATE_LINES   - if 'value' is 1, memory allocated from now on takes whole cache lines
+ *                               of its own, so objects used by different threads never share one.
+ *                               0 packs objects again.
+ *   MALLOCATE_GUARD_INTERVAL  - puts one allocation of up to a page in every 'value' on average in a page
+ *                               of its own between guard pages, see guard_allocate(). 0 stops; objects
+ *                               guarded before stay guarded until they are freed.
+ *
+ * Returns 1 on success, or 0 if the option is unknown or the value is invalid.
+ */
+int mallocate_set_option(int option, size_t value)
+{
+    switch (option)
+    {
+    case MALLOCATE_MMAP_THRESHOLD:
+        if (value == 0)
+        {
+            return 0;
+        }
+        atomic_store_explicit(&mmap_threshold, value, memory_order_relaxed);
+        return 1;
+    case MALLOCATE_TRIM_THRESHOLD:
+        atomic_store_explicit(&trim_threshold, value, memory_order_relaxed);
+        return 1;
+    case MALLOCATE_PURGE_THRESHOLD:
+        atomic_store_explicit(&purge_threshold, value, memory_order_relaxed);
+        return 1;
+    case MALLOCATE_HUGE_PAGES:
+        if (value > MALLOCATE_HUGE_EXPLICIT)
+        {
+            return 0;
+        }
+        atomic_store_explicit(&huge_pages, (int)value, memory_order_relaxed);
+        return 1;
+    case MALLOCATE_DECAY_TIME:
+    case MALLOCATE_PURGE_RATE:
+        mutex_lock(&purger_lock);
+        atomic_store_explicit(option == MALLOCATE_DECAY_TIME ? &decay_time : &purge_rate, value, memory_order_relaxed);
+        pthread_cond_signal(&purger_cond);
+        pthread_mutex_unlock(&purger_lock);
+        return 1;
+    case MALLOCATE_PROFILE_INTERVAL:
+        atomic_store_explicit(&profile_interval, value, memory_order_relaxed);
+        if (value != 0)
+        {
+            atomic_fetch_or_explicit(&hooks, HOOK_PROFILE, memory_order_relaxed);
+        }
+        else
+        {
+            atomic_fetch_and_explicit(&hooks, ~HOOK_PROFILE, memory_order_relaxed);
+        }
+        return 1;
+    case MALLOCATE_GUARD_INTERVAL:
+        atomic_store_explicit(&guard_interval, value, memory_order_relaxed);
+        if (value != 0)
+        {
+            atomic_fetch_or_explicit(&hooks, HOOK_GUARD, memory_order_relaxed);
+        }
+        else
+        {
+            atomic_fetch_and_explicit(&hooks, ~HOOK_GUARD, memory_order_relaxed);
+        }
+        return 1;
+    case MALLOCATE_ISOLATE_LINES:
+    case MALLOCATE_LATENCY:
+        if (value > 1)
+        {
+            return 0;
+        }
+        if (value)
+        {
+            atomic_fetch_or_explicit(&hooks, option == MALLOCATE_LATENCY ? HOOK_LATENCY : HOOK_ISOLATE, memory_order_relaxed);
+        }
+        else
+        {
+            atomic_fetch_and_explicit(&hooks, option == MALLOCATE_LATENCY ? ~HOOK_LATENCY : ~HOOK_ISOLATE, memory_order_relaxed);
+        }
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Fills in 'stats' with the current statistics of the allocator.
+ *
+ * Counters are summed over every thread under stats_lock, and the free memory of each arena
+ * is read under its lock, so the hot paths never synchronize for statistics. The snapshot is not
+ * atomic: operations running concurrently may be counted in one field and not yet in another.
+ *
+ * Blocks freed by other threads that are still on an arena's remote free stack already count
+ * as freed, but not yet as free memory. Free small object slots include objects in thread caches.
+ */
+void mallocate_stats(MallocateStats *stats)
+{
+    pthread_once(&init_once, allocator_init);
+    memset(stats, 0, sizeof(*stats));
+
+    size_t allocated = 0;
+    size_t mapped = 0;
+    mutex_lock(&stats_lock);
+    ThreadStats *thread = &retired_stats;
+    while (thread != NULL)
+    {
+        for (size_t i = 0; i < MALLOCATE_NUM_CLASSES; i++)
+        {
+            stats->allocs[i] += atomic_load_explicit(&thread->allocs[i], memory_order_relaxed);
+            stats->frees[i] += atomic_load_explicit(&thread->frees[i], memory_order_relaxed);
+        }
+        allocated += atomic_load_explicit(&thread->allocated, memory_order_relaxed);
+        mapped += atomic_load_explicit(&thread->mapped, memory_order_relaxed);
+        stats->sbrk_calls += atomic_load_explicit(&thread->sbrk_calls, memory_order_relaxed);
+        stats->mmap_calls += atomic_load_explicit(&thread->mmap_calls, memory_order_relaxed);
+        stats->lock_contentions += atomic_load_explicit(&thread->contentions, memory_order_relaxed);
+        stats->huge_mapped += atomic_load_explicit(&thread->huge_mapped, memory_order_relaxed);
+        thread = thread == &retired_stats ? stats_threads : thread->next;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    size_t small_allocated = 0;
+    for (size_t i = 0; i < MALLOCATE_SMALL_CLASSES; i++)
+    {
+        small_allocated += (stats->allocs[i] - stats->frees[i]) * (i + 1) * ALIGNMENT;
+    }
+
+    // Counters of different threads are read at different times, so the sums can briefly be off.
+    allocated += small_allocated;
+    stats->allocated = (ptrdiff_t)allocated > 0 ? allocated : 0;
+    stats->mapped = (ptrdiff_t)mapped > 0 ? mapped : 0;
+
+    size_t slab_bytes = 0;
+    for (unsigned int i = 0; i < narenas; i++)
+    {
+        mutex_lock(&arenas[i].lock);
+        stats->free += arenas[i].free_bytes;
+        slab_bytes += arenas[i].slab_bytes;
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    if (slab_bytes > small_allocated)
+    {
+        stats->free += slab_bytes - small_allocated;
+    }
+
+    if (stats->allocated + stats->free > 0)
+    {
+        stats->fragmentation = (double)stats->free / (double)(stats->allocated + stats->free);
+    }
+
+    // Reading the kernel's page tables is slow, so it is only done if huge chunks exist.
+    if (stats->huge_mapped > 0)
+    {
+        stats->huge_backed = huge_page_bytes();
+    }
+}
+
+/*
+ * Returns the number of bytes of the allocator's huge chunks that are currently backed
+ * by huge pages, transparent or reserved, as reported by /proc/self/smaps.
+ * Parses the file with a fixed buffer, since it must not allocate.
+ *
+ * Returns 0 if the file cannot be read.
+ */
+static size_t huge_page_bytes(void)
+{
+    int fd = open("/proc/self/smaps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    char buffer[4096];
+    char line[256];
+    size_t length = 0;
+    int ours = 0;
+    size_t bytes = 0;
+
+    ssize_t count;
+    while ((count = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (ssize_t i = 0; i < count; i++)
+        {
+            if (buffer[i] != '\n')
+            {
+                // Only the start of a line matters, the rest of long lines is dropped.
+                if (length < sizeof(line) - 1)
+                {
+                    line[length++] = buffer[i];
+                }
+                continue;
+            }
+            line[length] = '\0';
+            length = 0;
+
+            // A mapping starts with its address range, followed by lines of "Field: value kB".
+            char *end;
+            uintptr_t start = (uintptr_t)strtoull(line, &end, 16);
+            if (*end == '-')
+            {
+                ours = (chunk_lookup((void *)start) & CHUNK_HUGE) != 0;
+            }
+            else if (ours && (strncmp(line, "AnonHugePages:", 14) == 0 ||
+                              strncmp(line, "Private_Hugetlb:", 16) == 0))
+            {
+                char *value = strchr(line, ':') + 1;
+                bytes += (size_t)strtoull(value, NULL, 10) * 1024;
+            }
+        }
+    }
+    close(fd);
+    return bytes;
+}
+
+/*
+ * Fills in 'histogram' with the latencies of the calls of kind 'op', MALLOCATE_LATENCY_ALLOC or
+ * MALLOCATE_LATENCY_FREE, timed by every thread since MALLOCATE_LATENCY was first set.
+ * Counts only grow, so the latencies of an interval are the difference of two snapshots.
+ * Like mallocate_stats(), the snapshot is not atomic.
+ *
+ * Returns 1, or 0 if 'op' is invalid.
+ */
+int mallocate_latency(int op, MallocateLatency *histogram)
+{
+    if (op != MALLOCATE_LATENCY_ALLOC && op != MALLOCATE_LATENCY_FREE)
+    {
+        return 0;
+    }
+    memset(histogram, 0, sizeof(*histogram));
+
+    mutex_lock(&stats_lock);
+    LatencyHistogram *thread = &latency_shared;
+    while (thread != NULL)
+    {
+        for (size_t i = 0; i < MALLOCATE_LATENCY_BUCKETS; i++)
+        {
+            histogram->buckets[i] += atomic_load_explicit(&thread->buckets[op][i], memory_order_relaxed);
+        }
+        thread = thread == &latency_shared ? latency_all : thread->all;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    for (size_t i = 0; i < MALLOCATE_LATENCY_BUCKETS; i++)
+    {
+        histogram->count += histogram->buckets[i];
+    }
+    return 1;
+}
+
+/*
+ * Returns the lowest latency in ns counted in bucket 'bucket' of a MallocateLatency,
+ * or UINT64_MAX if there is no such bucket.
+ */
+uint64_t mallocate_latency_bound(size_t bucket)
+{
+    if (bucket >= MALLOCATE_LATENCY_BUCKETS)
+    {
+        return UINT64_MAX;
+    }
+    if (bucket < 8)
+    {
+        return bucket;
+    }
+    return (uint64_t)(8 + bucket % 8) << (bucket / 8 - 1);
+}
+
+/*
+ * Returns a latency in ns that the fraction 'fraction' of the calls of 'histogram' did not
+ * exceed, between 0 and 1: 0.99 gives the 99th percentile. The latency is the highest of
+ * its bucket, so it is exact to the width of a bucket and never too low, except for calls
+ * slower than the last bucket, for which its bound is returned.
+ *
+ * Returns 0 if no call was timed.
+ */
+uint64_t mallocate_latency_percentile(const MallocateLatency *histogram, double fraction)
+{
+    if (histogram->count == 0)
+    {
+        return 0;
+    }
+    // The rank of the call wanted, counting from 1, rounded up.
+    double rank = fraction * (double)histogram->count;
+    size_t wanted = histogram->count;
+    if (rank < (double)histogram->count)
+    {
+        wanted = rank > 1 ? (size_t)rank : 1;
+        wanted += (double)wanted < rank;
+    }
+
+    size_t seen = 0;
+    for (size_t i = 0; i < MALLOCATE_LATENCY_BUCKETS - 1; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= wanted)
+        {
+            return mallocate_latency_bound(i + 1) - 1;
+        }
+    }
+    return mallocate_latency_bound(MALLOCATE_LATENCY_BUCKETS - 1);
+}
+
+/*
+ * Starts recording every allocation call of the process to the file at 'path', which is
+ * created or truncated. The file format is described by MallocateTraceRecord.
+ *
+ * Tracing can also be started by setting MALLOCATE_TRACE to a path. The trace is written out
+ * by mallocate_trace_stop(), or at exit. A process records at most one trace, and a child
+ * created by fork() does not record its parent's.
+ *
+ * Returns 1 if the trace started, or 0 if one was started before or the file cannot be written.
+ */
+int mallocate_trace_start(const char *path)
+{
+    pthread_once(&init_once, allocator_init);
+    return trace_open(path);
+}
+
+/*
+ * Stops the trace and writes out every record, including those of threads still running.
+ * Does nothing if no trace is running.
+ */
+void mallocate_trace_stop(void)
+{
+    mutex_lock(&trace_lock);
+    if (trace_state != TRACE_RUNNING)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    atomic_fetch_and_explicit(&hooks, ~HOOK_TRACE, memory_order_relaxed);
+    trace_state = TRACE_STOPPED;
+    pthread_cond_signal(&trace_cond);
+    int running = trace_writer_running;
+    pthread_mutex_unlock(&trace_lock);
+
+    // The writer finishes the queue before it exits.
+    if (running)
+    {
+        pthread_join(trace_writer, NULL);
+    }
+
+    // Every buffer with records left is either queued, because the writer never started,
+    // or still being filled by its thread. Records a thread adds while this runs are lost.
+    mutex_lock(&trace_lock);
+    for (TraceBuffer *buffer = trace_buffers; buffer != NULL; buffer = buffer->all)
+    {
+        trace_write(buffer);
+        atomic_store_explicit(&buffer->count, 0, memory_order_relaxed);
+    }
+    close(trace_fd);
+    trace_fd = -1;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+ * Writes out the trace when the program exits or the library is unloaded.
+ */
+static __attribute__((destructor)) void trace_exit(void)
+{
+    mallocate_trace_stop();
+}
+
+/*
+ * Creates the trace file at 'path', writes its header and starts tracing.
+ * Does not allocate, so it can run from allocator_init().
+ *
+ * Returns 1 on success, or 0 like mallocate_trace_start().
+ */
+static int trace_open(const char *path)
+{
+    mutex_lock(&trace_lock);
+    if (trace_state != TRACE_IDLE)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        return 0;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        return 0;
+    }
+
+    MallocateTraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MALLOCATE_TRACE_MAGIC, sizeof(header.magic));
+    header.version = MALLOCATE_TRACE_VERSION;
+    header.record_size = sizeof(MallocateTraceRecord);
+    if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
+    {
+        close(fd);
+        pthread_mutex_unlock(&trace_lock);
+        return 0;
+    }
+
+    trace_fd = fd;
+    trace_epoch = trace_clock();
+    trace_state = TRACE_RUNNING;
+    atomic_fetch_or_explicit(&hooks, HOOK_TRACE, memory_order_release);
+    pthread_mutex_unlock(&trace_lock);
+    return 1;
+}
+
+/*
+ * Records a traced call in the calling thread's buffer. Only swapping a full buffer
+ * for an empty one takes trace_lock, once every TRACE_BUFFER_RECORDS records.
+ */
+static void trace_record(uint32_t op, void *ptr, uintptr_t arg, size_t size)
+{
+    if (trace_busy || !(atomic_load_explicit(&hooks, memory_order_acquire) & HOOK_TRACE))
+    {
+        return;
+    }
+    trace_busy = 1;
+
+    TCache *cache = tcache_get();
+    if (tcache.trace_thread == 0)
+    {
+        tcache.trace_thread = atomic_fetch_add_explicit(&trace_threads, 1, memory_order_relaxed) + 1;
+    }
+
+    MallocateTraceRecord record;
+    record.time = trace_clock() - trace_epoch;
+    record.ptr = (uintptr_t)ptr;
+    record.arg = arg;
+    record.size = size;
+    record.thread = tcache.trace_thread;
+    record.op = op;
+
+    TraceBuffer *buffer = cache != NULL ? cache->trace : NULL;
+    size_t count = buffer != NULL ? atomic_load_explicit(&buffer->count, memory_order_relaxed) : TRACE_BUFFER_RECORDS;
+    if (count < TRACE_BUFFER_RECORDS)
+    {
+        buffer->records[count] = record;
+        atomic_store_explicit(&buffer->count, count + 1, memory_order_release);
+    }
+    else
+    {
+        trace_append_slow(cache, &record);
+    }
+
+    trace_busy = 0;
+}
+
+/*
+ * Appends a record when the thread's buffer is full or missing, or the thread is exiting
+ * and 'cache' is NULL. The writer thread is started when the first buffer fills up.
+ */
+static void trace_append_slow(TCache *cache, MallocateTraceRecord *record)
+{
+    TraceBuffer **slot = cache != NULL ? &cache->trace : &trace_orphans;
+    if (*slot != NULL && atomic_exchange_explicit(&trace_writer_started, 1, memory_order_relaxed) == 0)
+    {
+        pthread_t writer;
+        if (pthread_create(&writer, NULL, trace_writer_main, NULL) == 0)
+        {
+            mutex_lock(&trace_lock);
+            trace_writer = writer;
+            trace_writer_running = 1;
+            pthread_mutex_unlock(&trace_lock);
+        }
+    }
+
+    mutex_lock(&trace_lock);
+    TraceBuffer *buffer = *slot;
+    if (buffer == NULL || atomic_load_explicit(&buffer->count, memory_order_relaxed) == TRACE_BUFFER_RECORDS)
+    {
+        buffer = trace_swap(buffer);
+        *slot = buffer;
+    }
+    if (buffer != NULL)
+    {
+        size_t count = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+        buffer->records[count] = *record;
+        atomic_store_explicit(&buffer->count, count + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+ * Queues a full buffer, if any, for the writer thread and returns an empty one,
+ * taken from the spare buffers or mapped.
+ *
+ * Returns NULL if the trace is not running or no buffer could be mapped.
+ * Must be called with trace_lock held.
+ */
+static TraceBuffer *trace_swap(TraceBuffer *full)
+{
+    if (trace_state != TRACE_RUNNING)
+    {
+        return NULL;
+    }
+    if (full != NULL)
+    {
+        trace_enqueue(full);
+    }
+
+    TraceBuffer *buffer = trace_spares;
+    if (buffer != NULL)
+    {
+        trace_spares = buffer->next;
+        return buffer;
+    }
+
+    buffer = map_pages(sizeof(TraceBuffer), 0);
+    if (buffer == MAP_FAILED)
+    {
+        return NULL;
+    }
+    buffer->all = trace_buffers;
+    trace_buffers = buffer;
+    return buffer;
+}
+
+/*
+ * Hands a buffer to the writer thread, or puts it on the spare list if it is empty.
+ * Must be called with trace_lock held.
+ */
+static void trace_enqueue(TraceBuffer *buffer)
+{
+    if (atomic_load_explicit(&buffer->count, memory_order_relaxed) == 0)
+    {
+        buffer->next = trace_spares;
+        trace_spares = buffer;
+        return;
+    }
+
+    buffer->next = NULL;
+    if (trace_queue_tail != NULL)
+    {
+        trace_queue_tail->next = buffer;
+    }
+    else
+    {
+        trace_queue = buffer;
+    }
+    trace_queue_tail = buffer;
+    pthread_cond_signal(&trace_cond);
+}
+
+/*
+ * Writer thread: writes out queued buffers until the trace stops and the queue is empty.
+ * The file is written without holding trace_lock, so threads swapping buffers never wait for it.
+ */
+static void *trace_writer_main(void *arg)
+{
+    (void)arg;
+    trace_busy = 1;
+
+    mutex_lock(&trace_lock);
+    for (;;)
+    {
+        while (trace_queue == NULL && trace_state == TRACE_RUNNING)
+        {
+            pthread_cond_wait(&trace_cond, &trace_lock);
+        }
+        TraceBuffer *buffers = trace_queue;
+        if (buffers == NULL)
+        {
+            break;
+        }
+        trace_queue = NULL;
+        trace_queue_tail = NULL;
+        pthread_mutex_unlock(&trace_lock);
+
+        for (TraceBuffer *buffer = buffers; buffer != NULL; buffer = buffer->next)
+        {
+            trace_write(buffer);
+        }
+
+        mutex_lock(&trace_lock);
+        while (buffers != NULL)
+        {
+            TraceBuffer *next = buffers->next;
+            atomic_store_explicit(&buffers->count, 0, memory_order_relaxed);
+            buffers->next = trace_spares;
+            trace_spares = buffers;
+            buffers = next;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return NULL;
+}
+
+/*
+ * Appends the records of a buffer to the trace file. Write errors drop the records.
+ */
+static void trace_write(TraceBuffer *buffer)
+{
+    const char *data = (const char *)buffer->records;
+    size_t left = atomic_load_explicit(&buffer->count, memory_order_acquire) * sizeof(MallocateTraceRecord);
+    while (left > 0)
+    {
+        ssize_t written = write(trace_fd, data, left);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return;
+        }
+        data += written;
+        left -= (size_t)written;
+    }
+}
+
+/*
+ * Returns the time of the monotonic clock in ns.
+ */
+static uint64_t trace_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/*
+ * Writes a heap profile of the sampled objects that are still allocated to the file at 'path',
+ * which is created or truncated. Sampling is started with MALLOCATE_PROFILE_INTERVAL, or the
+ * environment variable of the same name.
+ *
+ * The file is in the text format of gperftools heap profiles, which pprof reads:
+ *
+ *   pprof --text program profile
+ *
+ * Each line gives the objects still allocated at one stack and their bytes, then in brackets
+ * every object sampled there and their bytes, then the stack. A sampled object is one of about
+ * size / interval objects like it, so pprof scales the counts back up with the interval in the
+ * header. The process's mappings follow, so addresses can be symbolized.
+ *
+ * Returns 1 on success, or 0 if the file cannot be written.
+ */
+int mallocate_profile_dump(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    // Room for the header or one bucket: four counts and every frame.
+    char line[128 + PROFILE_MAX_DEPTH * 20];
+    mutex_lock(&profile_lock);
+    size_t inuse = 0, inuse_bytes = 0, allocs = 0, alloc_bytes = 0;
+    for (size_t i = 0; i < PROFILE_TABLE_SIZE; i++)
+    {
+        for (ProfileBucket *bucket = profile_buckets[i]; bucket != NULL; bucket = bucket->next)
+        {
+            inuse += bucket->allocs - bucket->frees;
+            inuse_bytes += bucket->alloc_bytes - bucket->free_bytes;
+            allocs += bucket->allocs;
+            alloc_bytes += bucket->alloc_bytes;
+        }
+    }
+    int length = snprintf(line, sizeof(line), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                          inuse, inuse_bytes, allocs, alloc_bytes,
+                          atomic_load_explicit(&profile_interval, memory_order_relaxed));
+    int ok = profile_write(fd, line, (size_t)length);
+
+    for (size_t i = 0; i < PROFILE_TABLE_SIZE && ok; i++)
+    {
+        for (ProfileBucket *bucket = profile_buckets[i]; bucket != NULL && ok; bucket = bucket->next)
+        {
+            length = snprintf(line, sizeof(line), "%zu: %zu [%zu: %zu] @",
+                              bucket->allocs - bucket->frees, bucket->alloc_bytes - bucket->free_bytes,
+                              bucket->allocs, bucket->alloc_bytes);
+            for (int frame = 0; frame < bucket->depth; frame++)
+            {
+                length += snprintf(line + length, sizeof(line) - (size_t)length, " %p", bucket->stack[frame]);
+            }
+            line[length++] = '\n';
+            ok = profile_write(fd, line, (size_t)length);
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    static const char maps_header[] = "\nMAPPED_LIBRARIES:\n";
+    ok = ok && profile_write(fd, maps_header, sizeof(maps_header) - 1);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0)
+    {
+        ssize_t n;
+        while (ok && (n = read(maps, line, sizeof(line))) > 0)
+        {
+            ok = profile_write(fd, line, (size_t)n);
+        }
+        close(maps);
+    }
+    return close(fd) == 0 && ok;
+}
+
+/*
+ * Counts an allocation of 'size' bytes against the calling thread's distance to its next sample.
+ * The distances are drawn from an exponential distribution, so the samples follow a Poisson
+ * process over the bytes allocated, and objects of any size are sampled in proportion to it.
+ *
+ * Returns 1 if the allocation should be sampled.
+ */
+static int profile_tick(size_t size)
+{
+    if ((atomic_load_explicit(&hooks, memory_order_relaxed) & HOOK_PROFILE) == 0)
+    {
+        return 0;
+    }
+    tcache.sample_left -= size < (size_t)INT64_MAX ? (int64_t)size : INT64_MAX;
+    if (tcache.sample_left >= 0)
+    {
+        return 0;
+    }
+    return profile_next_sample();
+}
+
+/*
+ * Draws the distance to the calling thread's next sample once it reached the current one.
+ * Kept out of line so profile_tick() stays small enough to inline.
+ *
+ * Returns 1 if the allocation that reached the sample should be sampled.
+ */
+static __attribute__((noinline)) int profile_next_sample(void)
+{
+    // A thread's first allocation only draws the distance to its first sample. Otherwise every
+    // thread would sample its first allocation.
+    int first = tcache.sample_seed == 0;
+    if (first)
+    {
+        tcache.sample_seed = ((uintptr_t)&tcache ^ trace_clock()) * 0x9E3779B97F4A7C15ULL | 1;
+    }
+    tcache.sample_left = profile_distance(&tcache);
+    return !first && !backtrace_busy;
+}
+
+/*
+ * Draws the number of bytes to the next sample from an exponential distribution
+ * with the mean MALLOCATE_PROFILE_INTERVAL.
+ */
+static int64_t profile_distance(TCache *cache)
+{
+    uint64_t random = sample_random(cache);
+
+    // A uniform value in (0, 1] from the top 53 bits.
+    double u = (double)((random >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double interval = (double)atomic_load_explicit(&profile_interval, memory_order_relaxed);
+    double distance = -profile_log(u) * interval;
+    return distance < 1.0 ? 1 : distance > 1e18 ? (int64_t)1e18 : (int64_t)distance;
+}
+
+/*
+ * Returns the next value of the thread's random generator for sampling, seeded before.
+ */
+static uint64_t sample_random(TCache *cache)
+{
+    // xorshift64*: random enough for sampling, and cheap.
+    uint64_t x = cache->sample_seed;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    cache->sample_seed = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Natural logarithm of a positive, finite 'x', to within 0.004, which is plenty for sample
+ * distances. Computed from the bits of the double, so the library needs no libm.
+ */
+static double profile_log(double x)
+{
+    union
+    {
+        double value;
+        uint64_t bits;
+    } v = {x};
+    int exponent = (int)((v.bits >> 52) & 0x7FF) - 1023;
+
+    // log2 of the mantissa in [1, 2) by a quadratic fit.
+    v.bits = (v.bits & (((uint64_t)1 << 52) - 1)) | ((uint64_t)1023 << 52);
+    double m = v.value;
+    double log2_m = (-0.34484843 * m + 2.02466578) * m - 1.67487759;
+    return ((double)exponent + log2_m) * 0.69314718055994530942;
+}
+
+/*
+ * Allocates a sampled object of 'size' bytes aligned to 'alignment' and records it.
+ * Sampled objects always get their own mapping, so frees find them without a lookup on
+ * the fast path: only large_free() checks the profile. A new mapping is zeroed, so the
+ * object also serves mcalloc().
+ *
+ * Returns the object, or NULL like allocate_aligned().
+ */
+static void *profile_allocate(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > MAX_REQUEST_SIZE ||
+        size > MAX_REQUEST_SIZE - alignment)
+    {
+        return NULL;
+    }
+    pthread_once(&init_once, allocator_init);
+
+    Block *block = large_alloc(size == 0 ? ALIGNMENT : align(size), alignment > ALIGNMENT ? alignment : ALIGNMENT);
+    if (block == NULL)
+    {
+        return NULL;
+    }
+    void *ptr = (char *)block + ALIGNED_METADATA_SIZE;
+    profile_record(ptr, size);
+    return ptr;
+}
+
+/*
+ * Records the stack of a sampled object of 'size' bytes at 'ptr'. Kept out of line so the
+ * frames to skip are the same at every optimization level. An object whose sample or bucket
+ * cannot be allocated is not profiled.
+ */
+static __attribute__((noinline)) void profile_record(void *ptr, size_t size)
+{
+    void *stack[PROFILE_MAX_DEPTH + PROFILE_SKIP];
+    backtrace_busy = 1;
+    int depth = backtrace(stack, PROFILE_MAX_DEPTH + PROFILE_SKIP) - PROFILE_SKIP;
+    backtrace_busy = 0;
+    if (depth < 0)
+    {
+        depth = 0;
+    }
+
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int frame = 0; frame < depth; frame++)
+    {
+        hash = (hash ^ (uintptr_t)stack[PROFILE_SKIP + frame]) * 0x100000001B3ULL;
+    }
+
+    mutex_lock(&profile_lock);
+    ProfileBucket **head = &profile_buckets[(hash >> 20) & (PROFILE_TABLE_SIZE - 1)];
+    ProfileBucket *bucket = *head;
+    while (bucket != NULL && (bucket->hash != hash || bucket->depth != depth ||
+                              memcmp(bucket->stack, stack + PROFILE_SKIP, (size_t)depth * sizeof(void *)) != 0))
+    {
+        bucket = bucket->next;
+    }
+    if (bucket == NULL && (bucket = profile_carve(sizeof(ProfileBucket))) != NULL)
+    {
+        bucket->hash = hash;
+        bucket->depth = depth;
+        memcpy(bucket->stack, stack + PROFILE_SKIP, (size_t)depth * sizeof(void *));
+        bucket->next = *head;
+        *head = bucket;
+    }
+
+    ProfileSample *sample = profile_spares;
+    if (sample != NULL)
+    {
+        profile_spares = sample->next;
+    }
+    else
+    {
+        sample = profile_carve(sizeof(ProfileSample));
+    }
+    if (bucket != NULL && sample != NULL)
+    {
+        bucket->allocs++;
+        bucket->alloc_bytes += size;
+        sample->ptr = ptr;
+        sample->size = size;
+        sample->bucket = bucket;
+        sample->next = profile_samples[profile_slot(ptr)];
+        profile_samples[profile_slot(ptr)] = sample;
+        atomic_fetch_add_explicit(&profile_live, 1, memory_order_relaxed);
+    }
+    else if (sample != NULL)
+    {
+        sample->next = profile_spares;
+        profile_spares = sample;
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/*
+ * Counts the sampled object at 'ptr' as freed, if it is one.
+ */
+static void profile_forget(void *ptr)
+{
+    mutex_lock(&profile_lock);
+    ProfileSample **link = &profile_samples[profile_slot(ptr)];
+    while (*link != NULL && (*link)->ptr != ptr)
+    {
+        link = &(*link)->next;
+    }
+    ProfileSample *sample = *link;
+    if (sample != NULL)
+    {
+        *link = sample->next;
+        sample->bucket->frees++;
+        sample->bucket->free_bytes += sample->size;
+        sample->next = profile_spares;
+        profile_spares = sample;
+        atomic_fetch_sub_explicit(&profile_live, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/*
+ * Follows a sampled object resized by mrealloc() from 'old_ptr' to 'new_ptr' and 'size' bytes,
+ * if it is one. It stays in the bucket of the stack it was first allocated at.
+ */
+static void profile_moved(void *old_ptr, void *new_ptr, size_t size)
+{
+    mutex_lock(&profile_lock);
+    ProfileSample **link = &profile_samples[profile_slot(old_ptr)];
+    while (*link != NULL && (*link)->ptr != old_ptr)
+    {
+        link = &(*link)->next;
+    }
+    ProfileSample *sample = *link;
+    if (sample != NULL)
+    {
+        *link = sample->next;
+        sample->bucket->alloc_bytes += size - sample->size;
+        sample->ptr = new_ptr;
+        sample->size = size;
+        sample->next = profile_samples[profile_slot(new_ptr)];
+        profile_samples[profile_slot(new_ptr)] = sample;
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/*
+ * Carves 'size' bytes of profile metadata from pages of its own. Called with profile_lock held.
+ * The memory is never given back, since buckets live as long as the process.
+ *
+ * Returns the memory, or NULL if no page could be mapped.
+ */
+static void *profile_carve(size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    if ((size_t)(profile_end - profile_next) < size)
+    {
+        size_t bytes = (size_t)16 * page_size;
+        char *pages = map_pages(bytes, 0);
+        if (pages == MAP_FAILED)
+        {
+            return NULL;
+        }
+        profile_next = pages;
+        profile_end = pages + bytes;
+    }
+    void *memory = profile_next;
+    profile_next += size;
+    return memory;
+}
+
+/*
+ * Hashes the address of a sampled object into the table of live samples.
+ * Sampled objects have a mapping of their own, so the low 12 bits carry little information.
+ */
+static size_t profile_slot(void *ptr)
+{
+    return (size_t)((((uintptr_t)ptr >> 12) * 0x9E3779B97F4A7C15ULL) >> 40) & (PROFILE_TABLE_SIZE - 1);
+}
+
+/*
+ * Writes all of 'text' to 'fd'.
+ *
+ * Returns 1 on success, or 0 if the write failed.
+ */
+static int profile_write(int fd, const char *text, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, text, length);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return 0;
+        }
+        text += written;
+        length -= (size_t)written;
+    }
+    return 1;
+}
+
+/*
+ * Counts an allocation towards the calling thread's next guarded one.
+ * Inlined in the hooked paths, so only the draw of the next sample is a call.
+ *
+ * Returns 1 if the allocation should be guarded.
+ */
+static int guard_tick(void)
+{
+    if ((atomic_load_explicit(&hooks, memory_order_relaxed) & HOOK_GUARD) == 0)
+    {
+        return 0;
+    }
+    if (tcache.guard_left > 1)
+    {
+        tcache.guard_left--;
+        return 0;
+    }
+    return guard_next_sample();
+}
+
+/*
+ * Draws the number of allocations to the calling thread's next guarded one, uniformly between
+ * 1 and twice MALLOCATE_GUARD_INTERVAL, so guarded allocations cannot be predicted.
+ *
+ * Returns 1 if the allocation that reached the sample should be guarded.
+ */
+static __attribute__((noinline)) int guard_next_sample(void)
+{
+    size_t interval = atomic_load_explicit(&guard_interval, memory_order_relaxed);
+    if (interval == 0)
+    {
+        return 0;
+    }
+    // Like the heap profile, a thread's first allocation only draws the distance to its first sample.
+    int first = tcache.guard_left == 0;
+    if (tcache.sample_seed == 0)
+    {
+        tcache.sample_seed = ((uintptr_t)&tcache ^ trace_clock()) * 0x9E3779B97F4A7C15ULL | 1;
+    }
+    uint64_t span = interval < (size_t)INT64_MAX / 2 ? (uint64_t)interval * 2 - 1 : (uint64_t)INT64_MAX;
+    tcache.guard_left = 1 + (int64_t)(sample_random(&tcache) % span);
+    return !first && !backtrace_busy;
+}
+
+/*
+ * Allocates a guarded object of 'size' bytes aligned to 'alignment', a power of two of at least
+ * ALIGNMENT, in a slot of the guarded pool. The object is placed as close to the end of its page
+ * as its alignment allows, against the guard page that follows, so overflowing an object whose
+ * size is a multiple of the alignment by a single byte faults. The page is either new or was
+ * decommitted when its last object was freed, so the memory is zeroed and also serves mcalloc().
+ *
+ * Returns the object, or NULL if it does not fit in a page or every slot is in use, in which case
+ * the allocation is not guarded.
+ */
+static __attribute__((noinline)) void *guard_allocate(size_t alignment, size_t size)
+{
+    pthread_once(&init_once, allocator_init);
+    if (size == 0 || size > page_size || alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > page_size)
+    {
+        return NULL;
+    }
+    if (alignment < ALIGNMENT)
+    {
+        alignment = ALIGNMENT;
+    }
+
+    void *stack[GUARD_MAX_DEPTH + 1];
+    backtrace_busy = 1;
+    int depth = backtrace(stack, GUARD_MAX_DEPTH + 1) - 1;
+    backtrace_busy = 0;
+
+    mutex_lock(&guard_lock);
+    if (atomic_load_explicit(&guard_base, memory_order_relaxed) == 0 && !guard_init())
+    {
+        pthread_mutex_unlock(&guard_lock);
+        return NULL;
+    }
+    unsigned int index;
+    if (guard_used < GUARD_SLOTS)
+    {
+        index = guard_used++;
+    }
+    else if (guard_queue_count > 0)
+    {
+        index = guard_queue[guard_queue_head];
+        guard_queue_head = (guard_queue_head + 1) % GUARD_SLOTS;
+        guard_queue_count--;
+    }
+    else
+    {
+        pthread_mutex_unlock(&guard_lock);
+        return NULL;
+    }
+
+    char *page = (char *)atomic_load_explicit(&guard_base, memory_order_relaxed) + (2 * (size_t)index + 1) * page_size;
+    if (mprotect(page, page_size, PROT_READ | PROT_WRITE) != 0)
+    {
+        // The slot is skipped for now, and tried again once every other freed slot was.
+        guard_queue[(guard_queue_head + guard_queue_count++) % GUARD_SLOTS] = index;
+        pthread_mutex_unlock(&guard_lock);
+        return NULL;
+    }
+
+    GuardSlot *slot = &guard_slots[index];
+    slot->ptr = (void *)((uintptr_t)(page + page_size - size) & ~(alignment - 1));
+    slot->size = size;
+    slot->state = GUARD_LIVE;
+    slot->alloc_depth = depth > 0 ? depth : 0;
+    memcpy(slot->alloc_stack, stack + 1, (size_t)slot->alloc_depth * sizeof(void *));
+    slot->free_depth = 0;
+    void *ptr = slot->ptr;
+    pthread_mutex_unlock(&guard_lock);
+
+    stats_alloc(MALLOCATE_CLASS_MAPPED, size);
+    return ptr;
+}
+
+/*
+ * Frees a guarded object: its page is decommitted and made inaccessible, so any later access
+ * faults until the slot is reused. Freeing anything else in the pool, or freeing an object twice,
+ * is reported and aborts the program.
+ */
+static __attribute__((noinline)) void guard_free(void *ptr)
+{
+    void *stack[GUARD_MAX_DEPTH + 1];
+    backtrace_busy = 1;
+    int depth = backtrace(stack, GUARD_MAX_DEPTH + 1) - 1;
+    backtrace_busy = 0;
+
+    mutex_lock(&guard_lock);
+    size_t page = ((uintptr_t)ptr - atomic_load_explicit(&guard_base, memory_order_relaxed)) / page_size;
+    GuardSlot *slot = page % 2 == 1 ? &guard_slots[page / 2] : NULL;
+    if (slot == NULL || slot->ptr != ptr || slot->state != GUARD_LIVE)
+    {
+        guard_report(slot != NULL && slot->ptr == ptr && slot->state == GUARD_FREED ? "double free" : "invalid free",
+                     slot, (uintptr_t)ptr);
+        abort();
+    }
+
+    // Mapping the page again decommits it and makes it inaccessible with a single call.
+    char *start = (char *)((uintptr_t)ptr & ~(page_size - 1));
+    void *mapping = mmap(start, page_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    PROBE2(mmap, mapping, page_size);
+    ThreadStats *stats = stats_get();
+    stats_add(stats, &stats->mmap_calls, 1);
+    if (mapping == MAP_FAILED)
+    {
+        // A use after free must still fault, so the page is protected and released in two calls.
+        mprotect(start, page_size, PROT_NONE);
+        madvise(start, page_size, MADV_DONTNEED);
+    }
+    slot->state = GUARD_FREED;
+    slot->free_depth = depth > 0 ? depth : 0;
+    memcpy(slot->free_stack, stack + 1, (size_t)slot->free_depth * sizeof(void *));
+    guard_queue[(guard_queue_head + guard_queue_count++) % GUARD_SLOTS] = (unsigned int)(page / 2);
+    size_t size = slot->size;
+    pthread_mutex_unlock(&guard_lock);
+
+    stats_free(MALLOCATE_CLASS_MAPPED, size);
+}
+
+/*
+ * Returns 1 if 'ptr' lies in the guarded pool. Only called for memory outside every arena.
+ */
+static int guard_owns(void *ptr)
+{
+    uintptr_t base = atomic_load_explicit(&guard_base, memory_order_acquire);
+    return base != 0 && (uintptr_t)ptr - base < GUARD_POOL_SIZE;
+}
+
+/*
+ * Returns the size of the live guarded object at 'ptr', or 0 if it is not one.
+ */
+static size_t guard_size(void *ptr)
+{
+    mutex_lock(&guard_lock);
+    size_t page = ((uintptr_t)ptr - atomic_load_explicit(&guard_base, memory_order_relaxed)) / page_size;
+    GuardSlot *slot = page % 2 == 1 ? &guard_slots[page / 2] : NULL;
+    size_t size = slot != NULL && slot->ptr == ptr && slot->state == GUARD_LIVE ? slot->size : 0;
+    pthread_mutex_unlock(&guard_lock);
+    return size;
+}
+
+/*
+ * Reserves the guarded pool, inaccessible as a whole, and installs the SIGSEGV handler that
+ * reports faults inside it. Called with guard_lock held.
+ *
+ * Returns 1 on success, or 0 if the pool could not be reserved.
+ */
+static int guard_init(void)
+{
+    void *pool = mmap(NULL, GUARD_POOL_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pool == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guard_fault;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &guard_previous);
+
+    atomic_store_explicit(&guard_base, (uintptr_t)pool, memory_order_release);
+    return 1;
+}
+
+/*
+ * SIGSEGV handler. A fault in the guarded pool is reported, then the previous action is restored
+ * and the access runs again, so the program crashes the way it would have without the pool.
+ * Other faults go to the previous handler.
+ */
+static void guard_fault(int signo, siginfo_t *info, void *context)
+{
+    uintptr_t base = atomic_load_explicit(&guard_base, memory_order_relaxed);
+    uintptr_t address = (uintptr_t)info->si_addr;
+    if (base == 0 || address - base >= GUARD_POOL_SIZE)
+    {
+        if (guard_previous.sa_flags & SA_SIGINFO)
+        {
+            guard_previous.sa_sigaction(signo, info, context);
+        }
+        else if (guard_previous.sa_handler != SIG_DFL && guard_previous.sa_handler != SIG_IGN)
+        {
+            guard_previous.sa_handler(signo);
+        }
+        else
+        {
+            guard_restore();
+        }
+        return;
+    }
+
+    // The slot's state is read without guard_lock, which the faulting thread may hold.
+    size_t page = (address - base) / page_size;
+    GuardSlot *slot = NULL;
+    const char *what = "access to the guarded pool";
+    if (page % 2 == 1)
+    {
+        slot = &guard_slots[page / 2];
+        what = slot->state == GUARD_FREED ? "use after free" : what;
+    }
+    else
+    {
+        // Objects end against the guard page after them, so an overflow of the one before
+        // is likelier than an underflow of the one after.
+        GuardSlot *before = page > 0 ? &guard_slots[page / 2 - 1] : NULL;
+        GuardSlot *after = page / 2 < GUARD_SLOTS ? &guard_slots[page / 2] : NULL;
+        if (before != NULL && before->state != GUARD_UNUSED)
+        {
+            slot = before;
+            what = "buffer overflow";
+        }
+        else if (after != NULL && after->state != GUARD_UNUSED)
+        {
+            slot = after;
+            what = "buffer underflow";
+        }
+    }
+    guard_report(what, slot, address);
+    guard_restore();
+}
+
+/*
+ * Appends 'string' to the 'length' bytes of 'text', truncated to fit 'capacity' bytes.
+ *
+ * Returns the new length.
+ */
+static size_t guard_append(char *text, size_t length, size_t capacity, const char *string)
+{
+    while (*string != '\0' && length < capacity)
+    {
+        text[length++] = *string++;
+    }
+    return length;
+}
+
+/*
+ * Appends the digits of 'value' in 'base', 10 or 16, to the 'length' bytes of 'text',
+ * truncated to fit 'capacity' bytes.
+ *
+ * Returns the new length.
+ */
+static size_t guard_append_number(char *text, size_t length, size_t capacity, uintptr_t value, unsigned int base)
+{
+    char digits[sizeof(uintptr_t) * 3];
+    size_t count = 0;
+    do
+    {
+        digits[count++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value != 0);
+
+    while (count > 0 && length < capacity)
+    {
+        text[length++] = digits[--count];
+    }
+    return length;
+}
+
+/*
+ * Puts back the SIGSEGV action that was in place before the pool, so the faulting access runs
+ * again under it. An ignored SIGSEGV is reset to the default action: the access would fault forever.
+ */
+static void guard_restore(void)
+{
+    struct sigaction action = guard_previous;
+    if (!(action.sa_flags & SA_SIGINFO) && action.sa_handler == SIG_IGN)
+    {
+        action.sa_handler = SIG_DFL;
+    }
+    sigaction(SIGSEGV, &action, NULL);
+}
+
+/*
+ * Writes a report of 'what' happened at 'address' to stderr, with the stacks that allocated
+ * and freed the object of 'slot' if there is one. Runs in the SIGSEGV handler, so it formats
+ * the report itself and only uses calls that do not allocate.
+ */
+static void guard_report(const char *what, GuardSlot *slot, uintptr_t address)
+{
+    char text[256];
+    size_t length = guard_append(text, 0, sizeof(text), "mallocate: ");
+    length = guard_append(text, length, sizeof(text), what);
+    length = guard_append(text, length, sizeof(text), " at 0x");
+    length = guard_append_number(text, length, sizeof(text), address, 16);
+    if (slot != NULL && slot->state != GUARD_UNUSED)
+    {
+        uintptr_t start = (uintptr_t)slot->ptr;
+        length = guard_append(text, length, sizeof(text), address < start ? ", byte -" : ", byte ");
+        length = guard_append_number(text, length, sizeof(text), address < start ? start - address : address - start, 10);
+        length = guard_append(text, length, sizeof(text), " of a ");
+        length = guard_append_number(text, length, sizeof(text), slot->size, 10);
+        length = guard_append(text, length, sizeof(text), "-byte object at 0x");
+        length = guard_append_number(text, length, sizeof(text), start, 16);
+    }
+    length = guard_append(text, length, sizeof(text), "\n");
+    profile_write(STDERR_FILENO, text, length);
+
+    if (slot != NULL && slot->state != GUARD_UNUSED)
+    {
+        const char *allocated = "  allocated by:\n";
+        profile_write(STDERR_FILENO, allocated, strlen(allocated));
+        backtrace_symbols_fd(slot->alloc_stack, slot->alloc_depth, STDERR_FILENO);
+        if (slot->state == GUARD_FREED)
+        {
+            const char *freed = "  freed by:\n";
+            profile_write(STDERR_FILENO, freed, strlen(freed));
+            backtrace_symbols_fd(slot->free_stack, slot->free_depth, STDERR_FILENO);
+        }
+    }
+}
+
+/*
+ * Maps a block of 'size' bytes of usable memory on its own and records it in the large block table.
+ * The usable memory starts at a multiple of 'alignment', a power of two of at least ALIGNMENT.
+ *
+ * The mapping is rounded up to whole pages, and the block's size covers all of it. For alignments
+ * above ALIGNMENT the header sits at the end of the page in front of the usable memory.
+ * Alignments above a page are reached by mapping extra memory and unmapping what is not needed.
+ */
+static Block *large_alloc(size_t size, size_t alignment)
+{
+    size_t lead = alignment > ALIGNED_METADATA_SIZE ? alignment : ALIGNED_METADATA_SIZE;
+    size_t slack = alignment > page_size ? alignment - page_size : 0;
+    size_t mapping_size = (lead + size + slack + page_size - 1) & ~(page_size - 1);
+
+    void *mapping = map_pages(mapping_size, 0);
+    if (mapping == MAP_FAILED)
+    {
+        return NULL;
+    }
+    bind_node(mapping, mapping_size, arena_get()->node);
+
+    uintptr_t memory = ((uintptr_t)mapping + lead + alignment - 1) & ~(alignment - 1);
+    uintptr_t start = (memory - ALIGNED_METADATA_SIZE) & ~(page_size - 1);
+    uintptr_t end = (memory + size + page_size - 1) & ~(page_size - 1);
+    if (start > (uintptr_t)mapping)
+    {
+        unmap_pages(mapping, start - (uintptr_t)mapping);
+    }
+    if (end < (uintptr_t)mapping + mapping_size)
+    {
+        unmap_pages((void *)end, (uintptr_t)mapping + mapping_size - end);
+    }
+
+    Block *block = (Block *)(memory - ALIGNED_METADATA_SIZE);
+    block->prev_size = 0;
+    block->size = (end - memory) | BLOCK_LAST;
+
+    mutex_lock(&large_lock);
+    int inserted = large_insert(block);
+    pthread_mutex_unlock(&large_lock);
+
+    if (!inserted)
+    {
+        unmap_pages((void *)start, end - start);
+        return NULL;
+    }
+    stats_alloc(MALLOCATE_CLASS_MAPPED, BLOCK_SIZE(block));
+    return block;
+}
+
+/*
+ * Returns the start of the mapping of a block with its own mapping.
+ * The header is at the start of the mapping, or at the end of its first page.
+ */
+static void *large_mapping(Block *block)
+{
+    return (void *)((uintptr_t)block & ~(page_size - 1));
+}
+
+/*
+ * Unmaps the block with its own mapping whose usable memory starts at 'ptr'.
+ *
+ * Returns 1 if the block was found and unmapped, or 0 if 'ptr' is not such a block.
+ * The block header is only read once the table confirmed the pointer.
+ */
+static int large_free(void *ptr)
+{
+    Block *block = (Block *)((char *)ptr - ALIGNED_METADATA_SIZE);
+
+    mutex_lock(&large_lock);
+    int found = large_remove(block);
+    pthread_mutex_unlock(&large_lock);
+
+    if (!found)
+    {
+        return 0;
+    }
+    // Sampled objects are forgotten before their address can be mapped again.
+    if (atomic_load_explicit(&profile_live, memory_order_relaxed) != 0)
+    {
+        profile_forget(ptr);
+    }
+    stats_free(MALLOCATE_CLASS_MAPPED, BLOCK_SIZE(block));
+    char *mapping = large_mapping(block);
+    unmap_pages(mapping, (char *)block + ALIGNED_METADATA_SIZE + BLOCK_SIZE(block) - mapping);
+    return 1;
+}
+
+/*
+ * Resizes the block with its own mapping whose usable memory starts at 'ptr' with mremap(),
+ * which may move it to another address without copying.
+ *
+ * Returns the usable memory of the resized block, or NULL if 'ptr' is not such a block or the
+ * mapping could not be resized. The lock is held across mremap() so the block can always
+ * be put back in the table: it never has to grow, since the block was just removed from it.
+ */
+static void *large_realloc(void *ptr, size_t size)
+{
+    Block *block = (Block *)((char *)ptr - ALIGNED_METADATA_SIZE);
+
+    mutex_lock(&large_lock);
+    if (!large_remove(block))
+    {
+        pthread_mutex_unlock(&large_lock);
+        return NULL;
+    }
+
+    // The block keeps its offset in the first page, so its alignment within a page is kept too.
+    char *old_mapping = large_mapping(block);
+    size_t offset = (size_t)((char *)block - old_mapping);
+    size_t mapping_size = offset + ALIGNED_METADATA_SIZE + BLOCK_SIZE(block);
+    size_t new_mapping_size = (offset + ALIGNED_METADATA_SIZE + size + page_size - 1) & ~(page_size - 1);
+    void *mapping = old_mapping;
+    ThreadStats *stats = stats_get();
+    if (new_mapping_size != mapping_size)
+    {
+        mapping = mremap(old_mapping, mapping_size, new_mapping_size, MREMAP_MAYMOVE);
+        stats_add(stats, &stats->mmap_calls, 1);
+    }
+    if (mapping == MAP_FAILED)
+    {
+        large_insert(block);
+        pthread_mutex_unlock(&large_lock);
+        return NULL;
+    }
+
+    block = (Block *)((char *)mapping + offset);
+    block->size = (new_mapping_size - offset - ALIGNED_METADATA_SIZE) | BLOCK_LAST;
+    large_insert(block);
+    pthread_mutex_unlock(&large_lock);
+
+    if (atomic_load_explicit(&profile_live, memory_order_relaxed) != 0)
+    {
+        profile_moved(ptr, (char *)block + ALIGNED_METADATA_SIZE, size);
+    }
+
+    stats_add(stats, &stats->mapped, new_mapping_size - mapping_size);
+    stats_add(stats, &stats->allocated, new_mapping_size - mapping_size);
+    return (char *)block + ALIGNED_METADATA_SIZE;
+}
+
+/*
+ * Hashes a block address into the large block table.
+ * Blocks start at a fixed offset in a page, so the low 12 bits carry little information.
+ */
+static size_t large_hash(Block *block)
+{
+    return (size_t)((((uintptr_t)block >> 12) * 0x9E3779B97F4A7C15ULL) >> 32) & (large_capacity - 1);
+}
+
+/*
+ * Adds a block to the large block table, doubling the table when it is half full.
+ *
+ * Returns 1 on success, or 0 if the table could not grow.
+ * Must be called with large_lock held.
+ */
+static int large_insert(Block *block)
+{
+    if (2 * (large_count + 1) > large_capacity)
+    {
+        size_t old_capacity = large_capacity;
+        Block **old_slots = large_slots;
+
+        size_t capacity = old_capacity ? old_capacity * 2 : 512;
+        void *mapped = map_pages(capacity * sizeof(Block *), 0);
+        if (mapped == MAP_FAILED)
+        {
+            return 0;
+        }
+
+        large_slots = (Block **)mapped;
+        large_capacity = capacity;
+        large_count = 0;
+        for (size_t i = 0; i < old_capacity; i++)
+        {
+            if (old_slots[i] != NULL)
+            {
+                large_insert(old_slots[i]);
+            }
+        }
+        if (old_slots != NULL)
+        {
+            unmap_pages(old_slots, old_capacity * sizeof(Block *));
+        }
+    }
+
+    size_t i = large_hash(block);
+    while (large_slots[i] != NULL)
+    {
+        i = (i + 1) & (large_capacity - 1);
+    }
+    large_slots[i] = block;
+    large_count++;
+    return 1;
+}
+
+/*
+ * Removes a block from the large block table.
+ * Uses backward-shift deletion, so lookups never need tombstones.
+ *
+ * Returns 1 if the block was in the table, or 0 otherwise.
+ * Must be called with large_lock held.
+ */
+static int large_remove(Block *block)
+{
+    if (large_count == 0)
+    {
+        return 0;
+    }
+
+    size_t i = large_hash(block);
+    while (large_slots[i] != block)
+    {
+        if (large_slots[i] == NULL)
+        {
+            return 0;
+        }
+        i = (i + 1) & (large_capacity - 1);
+    }
+
+    // Shift later entries of the same probe run back into the hole.
+    size_t hole = i;
+    for (size_t j = (i + 1) & (large_capacity - 1); large_slots[j] != NULL; j = (j + 1) & (large_capacity - 1))
+    {
+        size_t home = large_hash(large_slots[j]);
+        if (((j - home) & (large_capacity - 1)) >= ((j - hole) & (large_capacity - 1)))
+        {
+            large_slots[hole] = large_slots[j];
+            hole = j;
+        }
+    }
+    large_slots[hole] = NULL;
+    large_count--;
+    return 1;
+}
+
+/*
+ * Returns 1 if the block is in the large block table.
+ * Must be called with large_lock held.
+ */
+static int large_contains(Block *block)
+{
+    if (large_count == 0)
+    {
+        return 0;
+    }
+
+    for (size_t i = large_hash(block); large_slots[i] != NULL; i = (i + 1) & (large_capacity - 1))
+    {
+        if (large_slots[i] == block)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * One-time setup shared by all threads.
+ */
+static void allocator_init(void)
+{
+    tcache_key = ((uintptr_t)&tcache_key ^ (uintptr_t)getpid() * 0x9E3779B97F4A7C15ULL) | 1;
+    remote_key = tcache_key ^ 2;
+    pthread_key_create(&tcache_exit_key, tcache_destroy);
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+    purger_cond_init();
+
+    // One arena per online CPU, unless overridden with MALLOCATE_ARENAS.
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *env = getenv("MALLOCATE_ARENAS");
+    if (env != NULL && atol(env) > 0)
+    {
+        count = atol(env);
+    }
+    narenas = count < 1 ? 1 : count > MAX_ARENAS ? MAX_ARENAS : (unsigned int)count;
+
+    // Every node gets at least one arena of its own, unless MALLOCATE_ARENAS asks for fewer.
+    nnodes = count_nodes();
+    if (nnodes > 1 && env == NULL && narenas < nnodes)
+    {
+        narenas = nnodes < MAX_ARENAS ? nnodes : MAX_ARENAS;
+    }
+
+    // Huge pages can be enabled for programs that do not call mallocate_set_option() themselves.
+    env = getenv("MALLOCATE_HUGE_PAGES");
+    if (env != NULL)
+    {
+        mallocate_set_option(MALLOCATE_HUGE_PAGES, (size_t)atol(env));
+    }
+
+    // Decay and isolation can be set for programs that do not call mallocate_set_option() themselves.
+    env = getenv("MALLOCATE_DECAY_TIME");
+    if (env != NULL)
+    {
+        mallocate_set_option(MALLOCATE_DECAY_TIME, (size_t)atol(env));
+    }
+    env = getenv("MALLOCATE_PURGE_RATE");
+    if (env != NULL)
+    {
+        mallocate_set_option(MALLOCATE_PURGE_RATE, (size_t)atol(env));
+    }
+    env = getenv("MALLOCATE_ISOLATE_LINES");
+    if (env != NULL)
+    {
+        mallocate_set_option(MALLOCATE_ISOLATE_LINES, (size_t)atol(env));
+    }
+
+    // Lets programs be profiled, sampled for memory errors or timed without changing them,
+    // for example under LD_PRELOAD.
+    env = getenv("MALLOCATE_PROFILE_INTERVAL");
+    if (env != NULL)
+    {
+        mallocate_set_option(MALLOCATE_PROFILE_INTERVAL, (size_t)atol(env));
+    }
+    env = getenv("MALLOCATE_GUARD_INTERVAL");
+    if (env != NULL)
+    {
+        mallocate_set_option(MALLOCATE_GUARD_INTERVAL, (size_t)atol(env));
+    }
+    env = getenv("MALLOCATE_LATENCY");
+    if (env != NULL)
+    {
+        mallocate_set_option(MALLOCATE_LATENCY, (size_t)atol(env));
+    }
+
+    // Lets programs be traced without changing them, for example under LD_PRELOAD.
+    env = getenv("MALLOCATE_TRACE");
+    if (env != NULL && env[0] != '\0')
+    {
+        trace_open(env);
+    }
+    for (unsigned int i = 0; i < narenas; i++)
+    {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+        arenas[i].index = i;
+        arenas[i].node = nnodes > 1 ? (int)(i % nnodes) : -1;
+    }
+
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/*
+ * Takes every lock of the allocator before fork(), so the child never inherits one
+ * held by a thread that does not exist in it. Locks are taken in the order the
+ * allocator nests them: stats_lock, arenas, then chunk_lock, then large_lock.
+ * profile_lock, guard_lock, trace_lock and purger_lock are never held while taking another,
+ * so they come last.
+ */
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&stats_lock);
+    for (unsigned int i = 0; i < narenas; i++)
+    {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+    pthread_mutex_lock(&chunk_lock);
+    pthread_mutex_lock(&large_lock);
+    pthread_mutex_lock(&profile_lock);
+    pthread_mutex_lock(&guard_lock);
+    pthread_mutex_lock(&trace_lock);
+    pthread_mutex_lock(&purger_lock);
+}
+
+/*
+ * Releases the locks taken by fork_prepare() in the parent after fork().
+ */
+static void fork_parent(void)
+{
+    pthread_mutex_unlock(&purger_lock);
+    pthread_mutex_unlock(&trace_lock);
+    pthread_mutex_unlock(&guard_lock);
+    pthread_mutex_unlock(&profile_lock);
+    pthread_mutex_unlock(&large_lock);
+    pthread_mutex_unlock(&chunk_lock);
+    for (unsigned int i = 0; i < narenas; i++)
+    {
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * Resets the locks taken by fork_prepare() in the child after fork(),
+ * where only the forking thread exists. The statistics of the other threads are retired,
+ * since the C library may reuse their thread-local storage for new threads, and their latency
+ * histograms become spares.
+ */
+static void fork_child(void)
+{
+    ThreadStats *stats = stats_threads;
+    while (stats != NULL)
+    {
+        ThreadStats *next = stats->next;
+        if (stats != &tcache.stats)
+        {
+            stats_retire(stats);
+        }
+        stats = next;
+    }
+    latency_spares = NULL;
+    for (LatencyHistogram *histogram = latency_all; histogram != NULL; histogram = histogram->all)
+    {
+        if (histogram != tcache.latency)
+        {
+            histogram->next = latency_spares;
+            latency_spares = histogram;
+        }
+    }
+
+    pthread_mutex_init(&guard_lock, NULL);
+    pthread_mutex_init(&profile_lock, NULL);
+    pthread_mutex_init(&large_lock, NULL);
+    pthread_mutex_init(&chunk_lock, NULL);
+    for (unsigned int i = 0; i < narenas; i++)
+    {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+    }
+    pthread_mutex_init(&stats_lock, NULL);
+
+    // The writer thread does not exist in the child, so a trace of the parent is not continued.
+    if (trace_state == TRACE_RUNNING)
+    {
+        atomic_fetch_and_explicit(&hooks, ~HOOK_TRACE, memory_order_relaxed);
+        trace_state = TRACE_STOPPED;
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    tcache.trace = NULL;
+    trace_writer_running = 0;
+
+    // Nor does the purger, which the next free starts again.
+    atomic_store_explicit(&purger_started, 0, memory_order_relaxed);
+    pthread_mutex_init(&purger_lock, NULL);
+    purger_cond_init();
+    pthread_mutex_init(&trace_lock, NULL);
+    pthread_cond_init(&trace_cond, NULL);
+}
+
+/*
+ * Returns the calling thread's cache, or NULL if the thread is exiting.
+ * Registers the cache on first use.
+ */
+static TCache *tcache_get(void)
+{
+    if (tcache.state == TCACHE_ACTIVE)
+    {
+        return &tcache;
+    }
+    if (tcache.state == TCACHE_DEAD)
+    {
+        return NULL;
+    }
+    return tcache_register();
+}
+
+/*
+ * Activates the calling thread's cache: adds its statistics to the list of live threads
+ * and installs the exit destructor. Kept out of line so tcache_get() stays small enough to inline.
+ */
+static __attribute__((noinline)) TCache *tcache_register(void)
+{
+    pthread_once(&init_once, allocator_init);
+    tcache.state = TCACHE_ACTIVE;
+
+    mutex_lock(&stats_lock);
+    tcache.stats.prev = NULL;
+    tcache.stats.next = stats_threads;
+    if (stats_threads != NULL)
+    {
+        stats_threads->prev = &tcache.stats;
+    }
+    stats_threads = &tcache.stats;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_setspecific(tcache_exit_key, &tcache);
+    return &tcache;
+}
+
+/*
+ * Thread exit destructor: returns every cached object to the thread's arena
+ * and adds the thread's statistics to the totals of retired threads.
+ * Later frees from this thread go straight to the arena and count in the totals.
+ */
+static void tcache_destroy(void *arg)
+{
+    (void)arg;
+    mflush_cache();
+    tcache.state = TCACHE_DEAD;
+
+    // Records of the thread from now on go to the shared buffer of exiting threads.
+    if (tcache.trace != NULL)
+    {
+        mutex_lock(&trace_lock);
+        if (trace_state == TRACE_RUNNING)
+        {
+            trace_enqueue(tcache.trace);
+        }
+        tcache.trace = NULL;
+        pthread_mutex_unlock(&trace_lock);
+    }
+
+    // The histograms keep their counts for the next thread to use them. Later calls of this
+    // thread count in the shared ones.
+    mutex_lock(&stats_lock);
+    stats_retire(&tcache.stats);
+    if (tcache.latency != NULL)
+    {
+        tcache.latency->next = latency_spares;
+        latency_spares = tcache.latency;
+        tcache.latency = NULL;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * Removes a thread's statistics from the list of live threads and adds them to the totals.
+ * Must be called with stats_lock held.
+ */
+static void stats_retire(ThreadStats *stats)
+{
+    if (stats->prev != NULL)
+    {
+        stats->prev->next = stats->next;
+    }
+    else
+    {
+        stats_threads = stats->next;
+    }
+    if (stats->next != NULL)
+    {
+        stats->next->prev = stats->prev;
+    }
+
+    for (size_t i = 0; i < MALLOCATE_NUM_CLASSES; i++)
+    {
+        stats_add(&retired_stats, &retired_stats.allocs[i], atomic_load_explicit(&stats->allocs[i], memory_order_relaxed));
+        stats_add(&retired_stats, &retired_stats.frees[i], atomic_load_explicit(&stats->frees[i], memory_order_relaxed));
+    }
+    stats_add(&retired_stats, &retired_stats.allocated, atomic_load_explicit(&stats->allocated, memory_order_relaxed));
+    stats_add(&retired_stats, &retired_stats.mapped, atomic_load_explicit(&stats->mapped, memory_order_relaxed));
+    stats_add(&retired_stats, &retired_stats.sbrk_calls, atomic_load_explicit(&stats->sbrk_calls, memory_order_relaxed));
+    stats_add(&retired_stats, &retired_stats.mmap_calls, atomic_load_explicit(&stats->mmap_calls, memory_order_relaxed));
+    stats_add(&retired_stats, &retired_stats.contentions, atomic_load_explicit(&stats->contentions, memory_order_relaxed));
+    stats_add(&retired_stats, &retired_stats.huge_mapped, atomic_load_explicit(&stats->huge_mapped, memory_order_relaxed));
+}
+
+/*
+ * Takes a batch of objects of size class 'index' from the thread's arena under one lock.
+ * One is returned to the caller and the others are cached.
+ *
+ * Returns NULL if not even one object could be allocated.
+ */
+static void *tcache_refill(TCache *cache, Arena *arena, size_t index)
+{
+    unsigned int batch = cache->fill[index] ? cache->fill[index] : 1;
+    cache->fill[index] = batch < TCACHE_BATCH ? batch * 2 : TCACHE_BATCH;
+
+    unsigned int cached = cache->counts[index];
+    mutex_lock(&arena->lock);
+    drain_remote_frees(arena);
+    void *result = slab_get(arena, index);
+    for (unsigned int i = 1; result != NULL && i < batch; i++)
+    {
+        FreeObject *object = (FreeObject *)slab_get(arena, index);
+        if (object == NULL)
+        {
+            break;
+        }
+        object->next = cache->entries[index];
+        object->key = tcache_key;
+        cache->entries[index] = object;
+        cache->counts[index]++;
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    PROBE2(tcache_refill, index, cache->counts[index] - cached + (result != NULL));
+    return result;
+}
+
+/*
+ * Returns cached objects of one size class to the thread's arena under one lock,
+ * keeping at most 'keep' of them in the cache.
+ */
+static void tcache_flush(TCache *cache, size_t index, unsigned int keep)
+{
+    if (cache->counts[index] <= keep)
+    {
+        return;
+    }
+
+    PROBE2(tcache_flush, index, cache->counts[index] - keep);
+    Arena *arena = arena_get();
+    mutex_lock(&arena->lock);
+    while (cache->counts[index] > keep)
+    {
+        FreeObject *object = cache->entries[index];
+        cache->entries[index] = object->next;
+        cache->counts[index]--;
+        slab_put(arena, object);
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/*
+ * Returns the statistics the calling thread counts in: its own while its cache is active,
+ * otherwise the shared totals.
+ */
+static ThreadStats *stats_get(void)
+{
+    return tcache.state == TCACHE_ACTIVE ? &tcache.stats : &retired_stats;
+}
+
+/*
+ * Adds 'n' to a counter of 'stats', which stats_get() returned.
+ */
+static void stats_add(ThreadStats *stats, _Atomic(size_t) *counter, size_t n)
+{
+    if (stats == &retired_stats)
+    {
+        atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+        return;
+    }
+    stats_bump(counter, n);
+}
+
+/*
+ * Adds 'n' to a counter of the calling thread's own statistics.
+ * Only the thread writes them, so no atomic addition is needed.
+ */
+static void stats_bump(_Atomic(size_t) *counter, size_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/*
+ * Counts an allocation of 'bytes' usable bytes in 'size_class'.
+ */
+static void stats_alloc(size_t size_class, size_t bytes)
+{
+    ThreadStats *stats = stats_get();
+    stats_add(stats, &stats->allocs[size_class], 1);
+    stats_add(stats, &stats->allocated, bytes);
+}
+
+/*
+ * Counts a free of 'bytes' usable bytes in 'size_class'.
+ */
+static void stats_free(size_t size_class, size_t bytes)
+{
+    ThreadStats *stats = stats_get();
+    stats_add(stats, &stats->frees[size_class], 1);
+    stats_add(stats, &stats->allocated, -bytes);
+}
+
+/*
+ * Counts a call of kind 'op' that started at 'start', by trace_clock(), in the calling
+ * thread's latency histograms. Kept out of line, so the hooks only pay for the clock reads.
+ */
+static __attribute__((noinline)) void latency_record(int op, uint64_t start)
+{
+    size_t bucket = latency_bucket(trace_clock() - start);
+    TCache *cache = tcache_get();
+    if (cache != NULL && cache->latency == NULL)
+    {
+        cache->latency = latency_attach();
+    }
+    if (cache == NULL || cache->latency == NULL)
+    {
+        atomic_fetch_add_explicit(&latency_shared.buckets[op][bucket], 1, memory_order_relaxed);
+        return;
+    }
+    stats_bump(&cache->latency->buckets[op][bucket], 1);
+}
+
+/*
+ * Returns the bucket of a latency of 'ns' ns, see MALLOCATE_LATENCY_BUCKETS.
+ */
+static size_t latency_bucket(uint64_t ns)
+{
+    if (ns < 8)
+    {
+        return (size_t)ns;
+    }
+    // 8 buckets for each power of two, told apart by the 3 bits below the highest one.
+    unsigned int exponent = 63 - (unsigned int)__builtin_clzll(ns);
+    size_t bucket = (size_t)(exponent - 2) * 8 + ((ns >> (exponent - 3)) & 7);
+    return bucket < MALLOCATE_LATENCY_BUCKETS ? bucket : MALLOCATE_LATENCY_BUCKETS - 1;
+}
+
+/*
+ * Gives the calling thread a histogram: a spare one left by an exited thread, or a new one.
+ *
+ * Returns the histogram, or NULL if none could be mapped.
+ */
+static LatencyHistogram *latency_attach(void)
+{
+    mutex_lock(&stats_lock);
+    LatencyHistogram *histogram = latency_spares;
+    if (histogram != NULL)
+    {
+        latency_spares = histogram->next;
+    }
+    else
+    {
+        histogram = map_pages(sizeof(LatencyHistogram), 0);
+        if (histogram == MAP_FAILED)
+        {
+            histogram = NULL;
+        }
+        else
+        {
+            histogram->all = latency_all;
+            latency_all = histogram;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return histogram;
+}
+
+/*
+ * Splits a memory block into two if it is larger than the requested size.
+ *
+ * Helps use memory more efficiently and reduces unnecessary calls to sbrk().
+ * The original block keeps the requested size, and the remaining memory
+ * becomes a new free block placed in its bin.
+ *
+ * The block must already be removed from its bin.
+ */
+static Block *split(Arena *arena, Block *block, size_t size)
+{
+    // If the block is too small to split.
+    // Mark as allocated and return it.
+    if (BLOCK_SIZE(block) < size + MIN_BLOCK_SIZE)
+    {
+        block->size &= ~BLOCK_FREE;
+        return block;
+    }
+
+    // Calculate the size of the remaining memory after splitting.
+    size_t leftover_size = BLOCK_SIZE(block) - size - ALIGNED_METADATA_SIZE;
+
+    // Create a new free block from the leftover memory. It ends the run if the original did.
+    Block *new_block = (Block *)((char *)block + ALIGNED_METADATA_SIZE + size);
+    new_block->prev_size = size;
+    new_block->size = leftover_size | BLOCK_FREE | (block->size & BLOCK_LAST);
+    update_next_prev_size(new_block);
+    if (arena->tail == block)
+    {
+        arena->tail = new_block;
+    }
+    bin_insert(arena, new_block);
+
+    // Update the original block to the requested size, allocated and followed by the new block.
+    block->size = size;
+
+    return block;
+}
+
+/*
+ * Merges the given free block with adjacent blocks of free memory, if any,
+ * to reduce fragmentation and utilize memory more efficiently.
+ *
+ * Runs in constant time: the next block is found from the block's own size and
+ * the previous block from the prev_size boundary tag. Since free blocks are always
+ * merged, at most one free neighbor exists on each side.
+ *
+ * The given block must not be in a bin. Merged neighbors are taken out of their bins,
+ * and the returned block is left for the caller to insert.
+ */
+static Block *coalesce(Arena *arena, Block *block)
+{
+    size_t size = BLOCK_SIZE(block);
+
+    // Merge the block with the free block that follows it in memory.
+    Block *next = next_adjacent(block);
+    if (next && IS_FREE(next))
+    {
+        bin_remove(arena, next);
+        if (arena->tail == next)
+        {
+            arena->tail = block;
+        }
+        block->size = (BLOCK_SIZE(block) + ALIGNED_METADATA_SIZE + BLOCK_SIZE(next)) |
+                      BLOCK_FREE | (next->size & BLOCK_LAST);
+    }
+
+    // If the previous block is free, merge the current block into it.
+    Block *prev = prev_adjacent(block);
+    if (prev && IS_FREE(prev))
+    {
+        bin_remove(arena, prev);
+        if (arena->tail == block)
+        {
+            arena->tail = prev;
+        }
+        prev->size = (BLOCK_SIZE(prev) + ALIGNED_METADATA_SIZE + BLOCK_SIZE(block)) |
+                     BLOCK_FREE | (block->size & BLOCK_LAST);
+        block = prev;
+    }
+
+    if (BLOCK_SIZE(block) != size)
+    {
+        PROBE2(coalesce, block, BLOCK_SIZE(block));
+    }
+    update_next_prev_size(block);
+    return block;
+}
+
+/*
+ * Returns the block physically following the given one in memory,
+ * or NULL if the block is the last of its run
+ * (e.g. the heap was grown by someone else after it).
+ * Since a run belongs to one arena, blocks of different arenas are never adjacent.
+ */
+static Block *next_adjacent(Block *block)
+{
+    if (block->size & BLOCK_LAST)
+    {
+        return NULL;
+    }
+    return (Block *)((char *)block + ALIGNED_METADATA_SIZE + BLOCK_SIZE(block));
+}
+
+/*
+ * Returns the block physically preceding the given one using its boundary tag,
+ * or NULL if the block starts a contiguous run of memory.
+ * Boundary tags are only recorded between blocks of the same arena.
+ */
+static Block *prev_adjacent(Block *block)
+{
+    if (block->prev_size == 0)
+    {
+        return NULL;
+    }
+    return (Block *)((char *)block - ALIGNED_METADATA_SIZE - block->prev_size);
+}
+
+/*
+ * Keeps the boundary tag of the block following 'block' in sync after its size changed.
+ */
+static void update_next_prev_size(Block *block)
+{
+    Block *next = next_adjacent(block);
+    if (next)
+    {
+        next->prev_size = BLOCK_SIZE(block);
+    }
+}
+
+/*
+ * Puts a free block in its bin, or in the tree if it is larger than SMALL_BIN_LIMIT.
+ */
+static void bin_insert(Arena *arena, Block *block)
+{
+    size_t size = BLOCK_SIZE(block);
+    arena->free_bytes += size;
+    if (size > SMALL_BIN_LIMIT)
+    {
+        tree_insert(arena, block);
+        return;
+    }
+
+    size_t index = size / ALIGNMENT - 1;
+    FreeLinks *links = FREE_LINKS(block);
+
+    links->prev = NULL;
+    links->next = arena->bins[index];
+    if (arena->bins[index] != NULL)
+    {
+        FREE_LINKS(arena->bins[index])->prev = block;
+    }
+    arena->bins[index] = block;
+    arena->bin_map |= (uint64_t)1 << index;
+}
+
+/*
+ * Takes a free block out of its bin or the tree.
+ */
+static void bin_remove(Arena *arena, Block *block)
+{
+    size_t size = BLOCK_SIZE(block);
+    arena->free_bytes -= size;
+    if (size > SMALL_BIN_LIMIT)
+    {
+        tree_remove(arena, block);
+        return;
+    }
+
+    size_t index = size / ALIGNMENT - 1;
+    FreeLinks *links = FREE_LINKS(block);
+
+    if (links->prev != NULL)
+    {
+        FREE_LINKS(links->prev)->next = links->next;
+    }
+    else
+    {
+        arena->bins[index] = links->next;
+    }
+    if (links->next != NULL)
+    {
+        FREE_LINKS(links->next)->prev = links->prev;
+    }
+
+    if (arena->bins[index] == NULL)
+    {
+        arena->bin_map &= ~((uint64_t)1 << index);
+    }
+}
+
+/*
+ * Finds a free block with at least 'size' bytes of usable memory.
+ *
+ * Every block in a bin at or above the requested small size class fits, and the first
+ * non-empty one is found with a single bit scan of bin_map. Larger blocks are found
+ * best-fit in the tree in O(log n).
+ *
+ * Returns the block, still in its bin or the tree, or NULL if no free block is large enough.
+ */
+static Block *find_free_block(Arena *arena, size_t size)
+{
+    if (size <= SMALL_BIN_LIMIT)
+    {
+        size_t index = size / ALIGNMENT - 1;
+        uint64_t fits = arena->bin_map & ~(((uint64_t)1 << index) - 1);
+        if (fits != 0)
+        {
+            return arena->bins[__builtin_ctzll(fits)];
+        }
+    }
+
+    return tree_best_fit(arena, size);
+}
+
+/*
+ * Returns 1 if block 'a' comes before block 'b' in the tree: by size, then by address.
+ */
+static int tree_less(Block *a, Block *b)
+{
+    return BLOCK_SIZE(a) < BLOCK_SIZE(b) || (BLOCK_SIZE(a) == BLOCK_SIZE(b) && a < b);
+}
+
+static int tree_red(Block *block)
+{
+    return block != NULL && TREE_NODE(block)->red;
+}
+
+/*
+ * Returns the smallest block of the subtree rooted at 'block', or NULL if it is empty.
+ */
+static Block *tree_first(Block *block)
+{
+    while (block != NULL && TREE_NODE(block)->child[0] != NULL)
+    {
+        block = TREE_NODE(block)->child[0];
+    }
+    return block;
+}
+
+/*
+ * Returns the block after 'block' in the order of its tree, or NULL if it is the last one.
+ */
+static Block *tree_next(Block *block)
+{
+    if (TREE_NODE(block)->child[1] != NULL)
+    {
+        return tree_first(TREE_NODE(block)->child[1]);
+    }
+    Block *parent = TREE_NODE(block)->parent;
+    while (parent != NULL && TREE_NODE(parent)->child[1] == block)
+    {
+        block = parent;
+        parent = TREE_NODE(block)->parent;
+    }
+    return parent;
+}
+
+/*
+ * Returns the smallest free block in the tree with at least 'size' bytes,
+ * the lowest one in memory among blocks of that size, or NULL if none is large enough.
+ */
+static Block *tree_best_fit(Arena *arena, size_t size)
+{
+    Block *best = NULL;
+    Block *curr = arena->tree;
+    while (curr != NULL)
+    {
+        if (BLOCK_SIZE(curr) >= size)
+        {
+            best = curr;
+            curr = TREE_NODE(curr)->child[0];
+        }
+        else
+        {
+            curr = TREE_NODE(curr)->child[1];
+        }
+    }
+    return best;
+}
+
+/*
+ * Inserts a free block into the tree and rebalances it.
+ */
+static void tree_insert(Arena *arena, Block *block)
+{
+    TreeNode *node = TREE_NODE(block);
+    node->child[0] = NULL;
+    node->child[1] = NULL;
+    node->red = 1;
+    node->dirty = atomic_load_explicit(&decay_epoch, memory_order_relaxed);
+
+    Block *parent = NULL;
+    int dir = 0;
+    for (Block *curr = arena->tree; curr != NULL; curr = TREE_NODE(curr)->child[dir])
+    {
+        parent = curr;
+        dir = tree_less(curr, block);
+    }
+
+    node->parent = parent;
+    if (parent == NULL)
+    {
+        arena->tree = block;
+    }
+    else
+    {
+        TREE_NODE(parent)->child[dir] = block;
+    }
+
+    // Fix red nodes with red parents, moving up the tree.
+    while (tree_red(parent = TREE_NODE(block)->parent))
+    {
+        // A red parent is never the root, so the grandparent exists.
+        Block *grandparent = TREE_NODE(parent)->parent;
+        int side = TREE_NODE(grandparent)->child[1] == parent;
+        Block *uncle = TREE_NODE(grandparent)->child[!side];
+
+        if (tree_red(uncle))
+        {
+            TREE_NODE(parent)->red = 0;
+            TREE_NODE(uncle)->red = 0;
+            TREE_NODE(grandparent)->red = 1;
+            block = grandparent;
+            continue;
+        }
+
+        if (TREE_NODE(parent)->child[!side] == block)
+        {
+            tree_rotate(arena, parent, side);
+            block = parent;
+            parent = TREE_NODE(block)->parent;
+        }
+        TREE_NODE(parent)->red = 0;
+        TREE_NODE(grandparent)->red = 1;
+        tree_rotate(arena, grandparent, !side);
+    }
+    TREE_NODE(arena->tree)->red = 0;
+}
+
+/*
+ * Removes a free block from the tree and rebalances it.
+ */
+static void tree_remove(Arena *arena, Block *block)
+{
+    TreeNode *node = TREE_NODE(block);
+    Block *x;
+    Block *x_parent;
+    int removed_red;
+
+    if (node->child[0] == NULL || node->child[1] == NULL)
+    {
+        x = node->child[0] != NULL ? node->child[0] : node->child[1];
+        x_parent = node->parent;
+        removed_red = node->red;
+        tree_replace(arena, block, x);
+    }
+    else
+    {
+        // Put the block's successor in its place.
+        Block *successor = node->child[1];
+        while (TREE_NODE(successor)->child[0] != NULL)
+        {
+            successor = TREE_NODE(successor)->child[0];
+        }
+        TreeNode *succ = TREE_NODE(successor);
+        removed_red = succ->red;
+        x = succ->child[1];
+
+        if (succ->parent == block)
+        {
+            x_parent = successor;
+        }
+        else
+        {
+            x_parent = succ->parent;
+            tree_replace(arena, successor, x);
+            succ->child[1] = node->child[1];
+            TREE_NODE(succ->child[1])->parent = successor;
+        }
+        tree_replace(arena, block, successor);
+        succ->child[0] = node->child[0];
+        TREE_NODE(succ->child[0])->parent = successor;
+        succ->red = node->red;
+    }
+
+    if (!removed_red)
+    {
+        tree_remove_fixup(arena, x, x_parent);
+    }
+}
+
+/*
+ * Restores the red-black properties after a black node was removed,
+ * where 'x' (possibly NULL) took its place under 'parent'.
+ */
+static void tree_remove_fixup(Arena *arena, Block *x, Block *parent)
+{
+    while (x != arena->tree && !tree_red(x))
+    {
+        TreeNode *pnode = TREE_NODE(parent);
+        int side = pnode->child[1] == x;
+
+        // The removed node was black, so x has a sibling.
+        Block *sibling = pnode->child[!side];
+        if (tree_red(sibling))
+        {
+            TREE_NODE(sibling)->red = 0;
+            pnode->red = 1;
+            tree_rotate(arena, parent, side);
+            sibling = pnode->child[!side];
+        }
+
+        TreeNode *snode = TREE_NODE(sibling);
+        if (!tree_red(snode->child[0]) && !tree_red(snode->child[1]))
+        {
+            snode->red = 1;
+            x = parent;
+            parent = TREE_NODE(x)->parent;
+            continue;
+        }
+
+        if (!tree_red(snode->child[!side]))
+        {
+            TREE_NODE(snode->child[side])->red = 0;
+            snode->red = 1;
+            tree_rotate(arena, sibling, !side);
+            sibling = pnode->child[!side];
+            snode = TREE_NODE(sibling);
+        }
+        snode->red = pnode->red;
+        pnode->red = 0;
+        TREE_NODE(snode->child[!side])->red = 0;
+        tree_rotate(arena, parent, side);
+        x = arena->tree;
+    }
+
+    if (x != NULL)
+    {
+        TREE_NODE(x)->red = 0;
+    }
+}
+
+/*
+ * Rotates the subtree rooted at 'block': its child on the side opposite to 'dir'
+ * takes its place, and the block moves down on side 'dir'.
+ */
+static void tree_rotate(Arena *arena, Block *block, int dir)
+{
+    TreeNode *node = TREE_NODE(block);
+    Block *pivot = node->child[!dir];
+    TreeNode *pivot_node = TREE_NODE(pivot);
+
+    node->child[!dir] = pivot_node->child[dir];
+    if (pivot_node->child[dir] != NULL)
+    {
+        TREE_NODE(pivot_node->child[dir])->parent = block;
+    }
+
+    tree_replace(arena, block, pivot);
+    pivot_node->child[dir] = block;
+    node->parent = pivot;
+}
+
+/*
+ * Puts 'new_block' (possibly NULL) where 'old_block' is attached to its parent.
+ */
+static void tree_replace(Arena *arena, Block *old_block, Block *new_block)
+{
+    Block *parent = TREE_NODE(old_block)->parent;
+    if (parent == NULL)
+    {
+        arena->tree = new_block;
+    }
+    else
+    {
+        TreeNode *pnode = TREE_NODE(parent);
+        pnode->child[pnode->child[1] == old_block] = new_block;
+    }
+
+    if (new_block != NULL)
+    {
+        TREE_NODE(new_block)->parent = parent;
+    }
+}
+
+/*
+ * Aligns the given size to the next multiple of ALIGNMENT (16 bytes).
+ * Uses bitwise arithmetic to round up efficiently.
+ */
+static size_t align(size_t size)
+{
+    return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1); 
+}
+
 /*
- * Prints the list of blocks.
+ * Prints the list of blocks of every arena.
  * Used for debugging and testing purposes.
+ *
+ * Slabs are listed after the blocks of their arena. Their used count includes
+ * objects sitting in thread caches.
  */
 void print_blocks()
 {
-    Block *curr = head;
+    pthread_once(&init_once, allocator_init);
     printf("Blocks list:\n");
-    while (curr != NULL)
+    for (unsigned int i = 0; i < narenas; i++)
+    {
+        print_arena_blocks(&arenas[i]);
+    }
+
+    mutex_lock(&large_lock);
+    if (large_count > 0)
+    {
+        printf(" Mapped:\n");
+    }
+    for (size_t i = 0; i < large_capacity; i++)
+    {
+        if (large_slots[i] != NULL)
+        {
+            printf("  Block at %p: size=%zu, free=false\n",
+                   (void *)large_slots[i], BLOCK_SIZE(large_slots[i]));
+        }
+    }
+    pthread_mutex_unlock(&large_lock);
+}
+
+/*
+ * Prints the blocks of one arena. Arena 0 is printed without a heading.
+ */
+static void print_arena_blocks(Arena *arena)
+{
+    mutex_lock(&arena->lock);
+    drain_remote_frees(arena);
+    if (arena->index > 0 && (arena->runs != NULL || arena->slab_chunks != NULL))
+    {
+        printf(" Arena %u:\n", arena->index);
+    }
+    for (Run *run = arena->runs; run != NULL; run = run->next)
+    {
+        for (Block *curr = RUN_FIRST_BLOCK(run); curr != NULL; curr = next_adjacent(curr))
+        {
+            printf("  Block at %p: size=%zu, free=%s\n",
+                   (void *)curr, BLOCK_SIZE(curr), IS_FREE(curr) ? "true" : "false");
+        }
+    }
+
+    for (SlabChunk *chunk = arena->slab_chunks; chunk != NULL; chunk = chunk->next)
+    {
+        char *end = chunk == arena->slab_chunks ? arena->slab_next : (char *)chunk + CHUNK_SIZE;
+        for (char *page = (char *)chunk + SLAB_TABLE_PAGES * SLAB_SIZE; page < end; page += SLAB_SIZE)
+        {
+            Slab *slab = SLAB_OF(page);
+            if (slab->size != 0)
+            {
+                printf("  Slab at %p: size=%u, used=%u/%u\n", (void *)page, slab->size, slab->used, slab->capacity);
+            }
+        }
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/*
+ * Checks the blocks, bins and tree of every arena, and prints the first problem found.
+ * Used for debugging and testing purposes.
+ *
+ * Returns 1 if every arena is consistent, or 0 otherwise.
+ */
+int check_blocks(void)
+{
+    pthread_once(&init_once, allocator_init);
+    for (unsigned int i = 0; i < narenas; i++)
+    {
+        if (!check_arena_blocks(&arenas[i]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Checks one arena: its blocks carry correct boundary tags and no two free blocks are
+ * neighbors, and the bins and the tree hold exactly its free blocks.
+ */
+static int check_arena_blocks(Arena *arena)
+{
+    mutex_lock(&arena->lock);
+    drain_remote_frees(arena);
+    const char *problem = NULL;
+    Block *where = NULL;
+
+    size_t free_count = 0, free_sum = 0;
+    for (Run *run = arena->runs; run != NULL && problem == NULL; run = run->next)
+    {
+        for (Block *curr = RUN_FIRST_BLOCK(run); curr != NULL && problem == NULL; curr = next_adjacent(curr))
+        {
+            Block *next = next_adjacent(curr);
+            where = curr;
+            if (next != NULL && next->prev_size != BLOCK_SIZE(curr))
+            {
+                problem = "wrong prev_size after block";
+            }
+            else if (next != NULL && IS_FREE(curr) && IS_FREE(next))
+            {
+                problem = "free blocks not coalesced";
+            }
+            else if (IS_FREE(curr))
+            {
+                free_count++;
+                free_sum += BLOCK_SIZE(curr);
+            }
+        }
+    }
+
+    size_t listed_count = 0, listed_sum = 0;
+    for (size_t index = 0; index < NUM_SMALL_BINS && problem == NULL; index++)
+    {
+        if ((arena->bins[index] != NULL) != ((arena->bin_map >> index) & 1))
+        {
+            problem = "bin_map out of date";
+        }
+        for (Block *curr = arena->bins[index]; curr != NULL && problem == NULL; curr = FREE_LINKS(curr)->next)
+        {
+            where = curr;
+            Block *next = FREE_LINKS(curr)->next;
+            if (!IS_FREE(curr) || BLOCK_SIZE(curr) != (index + 1) * ALIGNMENT)
+            {
+                problem = "block in the wrong bin";
+            }
+            else if (next != NULL && FREE_LINKS(next)->prev != curr)
+            {
+                problem = "broken bin links";
+            }
+            listed_count++;
+            listed_sum += BLOCK_SIZE(curr);
+        }
+    }
+
+    if (problem == NULL && arena->tree != NULL && TREE_NODE(arena->tree)->red)
+    {
+        where = arena->tree;
+        problem = "red tree root";
+    }
+    if (problem == NULL && check_tree(arena->tree, NULL, &listed_count, &listed_sum) == 0)
+    {
+        where = NULL;
+        problem = "tree invariants broken";
+    }
+    for (Block *curr = tree_first(arena->tree); curr != NULL && problem == NULL; curr = tree_next(curr))
+    {
+        Block *next = tree_next(curr);
+        if (next != NULL && !tree_less(curr, next))
+        {
+            where = curr;
+            problem = "tree out of order";
+        }
+    }
+    if (problem == NULL && (listed_count != free_count || listed_sum != free_sum || listed_sum != arena->free_bytes))
+    {
+        where = NULL;
+        problem = "bins and tree do not hold the free blocks";
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    if (problem != NULL)
+    {
+        printf("Arena %u: %s (block at %p)\n", arena->index, problem, (void *)where);
+    }
+    return problem == NULL;
+}
+
+/*
+ * Checks the subtree rooted at 'block': parent links, order, colors, and that it only holds
+ * free blocks larger than SMALL_BIN_LIMIT. Adds its blocks and their sizes to 'count' and 'bytes'.
+ *
+ * Returns the black height of the subtree plus one, or 0 if it is broken.
+ */
+static int check_tree(Block *block, Block *parent, size_t *count, size_t *bytes)
+{
+    if (block == NULL)
+    {
+        return 1;
+    }
+
+    TreeNode *node = TREE_NODE(block);
+    Block *left = node->child[0], *right = node->child[1];
+    if (node->parent != parent || !IS_FREE(block) || BLOCK_SIZE(block) <= SMALL_BIN_LIMIT ||
+        (left != NULL && !tree_less(left, block)) || (right != NULL && !tree_less(block, right)) ||
+        (node->red && (tree_red(left) || tree_red(right))))
+    {
+        return 0;
+    }
+    (*count)++;
+    *bytes += BLOCK_SIZE(block);
+
+    int left_height = check_tree(left, block, count, bytes);
+    int right_height = check_tree(right, block, count, bytes);
+    if (left_height == 0 || left_height != right_height)
     {
-        printf("  Block at %p: size=%zu, free=%s, next=%p\n",
-               curr, curr->size, curr->free ? "true" : "false", curr->next);
-        curr = curr->next;
+        return 0;
     }
+    return left_height + !node->red;
 }
 
 // Helper function to check alignment
@@ -0,0 +1,503 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for MADV_DONTNEED
+#endif
+#include "../include/allocator.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Author: Mitchell Lord
+ *
+ * Handles: objects the allocator may move, to undo fragmentation that splitting and coalescing
+ * cannot, like a few long-lived objects pinning down pages of otherwise free memory.
+ *
+ * A handle object is not addressed directly. mhandle_alloc() returns a handle, and the object's
+ * address is only valid between mhandle_pin() and mhandle_unpin(). Objects are bump-allocated,
+ * each behind a small header, from segments the handle space takes from the allocator with
+ * mallocate(). A freed object only marks its header free; its memory comes back through
+ * mhandle_compact().
+ *
+ * mhandle_compact() slides the unpinned objects towards the first segment, in the order they
+ * lie in the segments, and updates their handles. Pinned objects stay where they are, and objects
+ * after them only slide up to them. Once the whole space has been walked the segments past the
+ * last object are freed, and the pages past it in its segment are released. The work is done
+ * in steps, each under the lock for a few objects only, and stops after a time budget where the
+ * next call picks it up, so a program can compact a little between requests. Objects allocated
+ * and freed in the meantime are taken into account.
+ *
+ * The handle space is shared by the whole process and thread-safe, with a single lock.
+ * Segments are above the default mmap threshold, so freeing one unmaps it.
+ */
+
+// Bytes of objects in each segment, unless a larger object needs a segment of its own.
+#define HANDLE_SEGMENT_SIZE ((size_t)256 * 1024)
+
+// Alignment of every object, the same as the allocator's.
+#define HANDLE_ALIGNMENT 16
+
+// Index in the header of a free object.
+#define HANDLE_FREE UINT32_MAX
+
+// Objects mhandle_compact() walks under one lock, between checks of its budget.
+#define HANDLE_STEP 64
+
+// Largest object accepted by mhandle_alloc().
+#define HANDLE_MAX_SIZE (SIZE_MAX / 4)
+
+/*
+ * Header of a segment, followed by its objects.
+ *
+ * Fields:
+ *   next     - next segment, in the order objects slide in.
+ *   capacity - bytes of objects the segment holds. Every segment but the last is filled to
+ *              its capacity with objects, free or not; the last up to handle_top.
+ */
+typedef struct __attribute__((aligned(HANDLE_ALIGNMENT))) HandleSegment
+{
+    struct HandleSegment *next;
+    size_t capacity;
+} HandleSegment;
+
+#define SEGMENT_OBJECTS(segment) ((char *)(segment) + sizeof(HandleSegment))
+
+/*
+ * Header of an object, followed by its memory.
+ *
+ * Fields:
+ *   size  - bytes of the object, header included, a multiple of HANDLE_ALIGNMENT.
+ *   index - index of the object's handle entry, or HANDLE_FREE.
+ */
+typedef struct __attribute__((aligned(HANDLE_ALIGNMENT))) HandleObject
+{
+    size_t size;
+    uint32_t index;
+} HandleObject;
+
+/*
+ * What a handle refers to. The low 32 bits of a handle are the index of its entry, from 1,
+ * and the high bits the generation of the entry when the handle was returned.
+ *
+ * Fields:
+ *   object     - header of the object, or NULL while the entry is free.
+ *   generation - bumped when the object is freed, so older handles are refused.
+ *   pins       - number of mhandle_pin() calls not yet undone by mhandle_unpin().
+ *   next       - next free entry while the entry is free, or 0.
+ */
+typedef struct HandleEntry
+{
+    HandleObject *object;
+    uint32_t generation;
+    uint32_t pins;
+    uint32_t next;
+} HandleEntry;
+
+/*
+ * A position in the segments: the object at 'offset' bytes into the objects of 'segment'.
+ */
+typedef struct HandleCursor
+{
+    HandleSegment *segment;
+    size_t offset;
+} HandleCursor;
+
+// Everything below is protected by handle_lock.
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Handle entries, entry 0 unused, and the list of free ones.
+static HandleEntry *handle_entries = NULL;
+static uint32_t handle_capacity = 0;
+static uint32_t handle_used = 1;
+static uint32_t handle_free = 0;
+
+// Segments, and the end of the objects of the last one.
+static HandleSegment *handle_first = NULL;
+static HandleSegment *handle_last = NULL;
+static size_t handle_top = 0;
+
+// State of the compaction pass in progress. Every object before 'compact_to' is in place, the
+// next object to slide is at 'compact_from', and there is nothing but free space in between.
+static int compact_running = 0;
+static HandleCursor compact_to;
+static HandleCursor compact_from;
+static int compact_progress = 0;
+
+// Set when a pass found nothing to move or free, and no object was freed or unpinned meanwhile.
+static int compact_settled = 1;
+
+static HandleEntry *entry_of(MHandle handle);
+static HandleObject *space_take(size_t bytes);
+static void fill_free(HandleCursor *position, size_t end);
+static int compact_step(void);
+static void compact_next_segment(size_t size);
+static void compact_finish(void);
+static uint64_t handle_clock(void);
+
+/*
+ * Allocates a movable object of 'size' bytes. Its contents are undefined.
+ *
+ * Returns the object's handle, or 0 if the size is too large or memory ran out.
+ */
+MHandle mhandle_alloc(size_t size)
+{
+    if (size > HANDLE_MAX_SIZE)
+    {
+        return 0;
+    }
+    size_t bytes = sizeof(HandleObject) + ((size + HANDLE_ALIGNMENT - 1) & ~(size_t)(HANDLE_ALIGNMENT - 1));
+
+    pthread_mutex_lock(&handle_lock);
+    uint32_t index = handle_free;
+    if (index == 0 && handle_used >= handle_capacity)
+    {
+        if (handle_capacity >= UINT32_MAX / 2)
+        {
+            pthread_mutex_unlock(&handle_lock);
+            return 0;
+        }
+        uint32_t capacity = handle_capacity ? handle_capacity * 2 : 1024;
+        HandleEntry *entries = mrealloc(handle_entries, capacity * sizeof(HandleEntry));
+        if (entries == NULL)
+        {
+            pthread_mutex_unlock(&handle_lock);
+            return 0;
+        }
+        handle_entries = entries;
+        handle_capacity = capacity;
+    }
+
+    HandleObject *object = space_take(bytes);
+    if (object == NULL)
+    {
+        pthread_mutex_unlock(&handle_lock);
+        return 0;
+    }
+    HandleEntry *entry;
+    if (index != 0)
+    {
+        entry = &handle_entries[index];
+        handle_free = entry->next;
+    }
+    else
+    {
+        index = handle_used++;
+        entry = &handle_entries[index];
+        entry->generation = 1;
+    }
+    object->size = bytes;
+    object->index = index;
+    entry->object = object;
+    entry->pins = 0;
+    entry->next = 0;
+    MHandle handle = (MHandle)entry->generation << 32 | index;
+    pthread_mutex_unlock(&handle_lock);
+    return handle;
+}
+
+/*
+ * Frees the object of 'handle', which must not be pinned. The handle and every copy of it
+ * become invalid. Does nothing if the handle is 0 or invalid already.
+ */
+void mhandle_free(MHandle handle)
+{
+    pthread_mutex_lock(&handle_lock);
+    HandleEntry *entry = entry_of(handle);
+    if (entry != NULL)
+    {
+        entry->object->index = HANDLE_FREE;
+        entry->object = NULL;
+        entry->generation++;
+        entry->next = handle_free;
+        handle_free = (uint32_t)handle;
+        compact_settled = 0;
+    }
+    pthread_mutex_unlock(&handle_lock);
+}
+
+/*
+ * Keeps the object of 'handle' from moving until mhandle_unpin() is called as many times
+ * as this was. Pins are cheap, but an object pinned while the heap is compacted holds back
+ * every object after it, so they should be short.
+ *
+ * Returns the address of the object, valid while it is pinned, or NULL if the handle is invalid.
+ */
+void *mhandle_pin(MHandle handle)
+{
+    pthread_mutex_lock(&handle_lock);
+    HandleEntry *entry = entry_of(handle);
+    void *ptr = NULL;
+    if (entry != NULL)
+    {
+        entry->pins++;
+        ptr = (char *)entry->object + sizeof(HandleObject);
+    }
+    pthread_mutex_unlock(&handle_lock);
+    return ptr;
+}
+
+/*
+ * Undoes one mhandle_pin() of 'handle'. The object may move once no pin is left, so
+ * addresses returned by mhandle_pin() must not be used anymore.
+ */
+void mhandle_unpin(MHandle handle)
+{
+    pthread_mutex_lock(&handle_lock);
+    HandleEntry *entry = entry_of(handle);
+    if (entry != NULL && entry->pins > 0 && --entry->pins == 0)
+    {
+        // Objects after it may have been held back.
+        compact_settled = 0;
+    }
+    pthread_mutex_unlock(&handle_lock);
+}
+
+/*
+ * Compacts the handle space for at most about 'budget_ns' ns, or until it is done if 'budget_ns'
+ * is 0, continuing the pass a previous call left unfinished. A pass slides the unpinned objects
+ * together, then frees the segments left empty behind them and releases the pages past the last
+ * one, lowering the memory the process keeps.
+ *
+ * Returns 1 if there is nothing left to compact until objects are freed or unpinned, or 0 if the
+ * budget ran out first.
+ */
+int mhandle_compact(uint64_t budget_ns)
+{
+    uint64_t deadline = budget_ns != 0 ? handle_clock() + budget_ns : 0;
+    for (;;)
+    {
+        pthread_mutex_lock(&handle_lock);
+        int settled = compact_settled && !compact_running;
+        if (!settled)
+        {
+            settled = compact_step();
+        }
+        pthread_mutex_unlock(&handle_lock);
+
+        if (settled)
+        {
+            return 1;
+        }
+        if (deadline != 0 && handle_clock() >= deadline)
+        {
+            return 0;
+        }
+    }
+}
+
+/*
+ * Returns the entry of 'handle', or NULL if the handle is invalid.
+ * Must be called with handle_lock held.
+ */
+static HandleEntry *entry_of(MHandle handle)
+{
+    uint32_t index = (uint32_t)handle;
+    if (index == 0 || index >= handle_used)
+    {
+        return NULL;
+    }
+    HandleEntry *entry = &handle_entries[index];
+    return entry->object != NULL && entry->generation == (uint32_t)(handle >> 32) ? entry : NULL;
+}
+
+/*
+ * Takes 'bytes' bytes at the top of the last segment, or starts a new segment if they do not fit,
+ * filling the rest of the last one with a free object so it can be walked.
+ * Must be called with handle_lock held.
+ *
+ * Returns the memory, or NULL if no segment could be allocated.
+ */
+static HandleObject *space_take(size_t bytes)
+{
+    if (handle_last == NULL || handle_last->capacity - handle_top < bytes)
+    {
+        size_t capacity = bytes > HANDLE_SEGMENT_SIZE ? bytes : HANDLE_SEGMENT_SIZE;
+        HandleSegment *segment = mallocate(sizeof(HandleSegment) + capacity);
+        if (segment == NULL)
+        {
+            return NULL;
+        }
+        segment->next = NULL;
+        segment->capacity = capacity;
+        if (handle_last != NULL)
+        {
+            HandleCursor top = {handle_last, handle_top};
+            fill_free(&top, handle_last->capacity);
+            handle_last->next = segment;
+            compact_settled = 0;
+        }
+        else
+        {
+            handle_first = segment;
+        }
+        handle_last = segment;
+        handle_top = 0;
+    }
+
+    HandleObject *object = (HandleObject *)(SEGMENT_OBJECTS(handle_last) + handle_top);
+    handle_top += bytes;
+    return object;
+}
+
+/*
+ * Marks the bytes from 'position' to offset 'end' of its segment as one free object,
+ * if there are any, and moves 'position' to 'end'.
+ */
+static void fill_free(HandleCursor *position, size_t end)
+{
+    if (end > position->offset)
+    {
+        HandleObject *object = (HandleObject *)(SEGMENT_OBJECTS(position->segment) + position->offset);
+        object->size = end - position->offset;
+        object->index = HANDLE_FREE;
+    }
+    position->offset = end;
+}
+
+/*
+ * Walks up to HANDLE_STEP objects, sliding them, starting a pass if none is running, and finishes
+ * the pass once every object was walked. Must be called with handle_lock held.
+ *
+ * Returns 1 if the pass finished and settled the space.
+ */
+static int compact_step(void)
+{
+    if (!compact_running)
+    {
+        if (handle_first == NULL)
+        {
+            compact_settled = 1;
+            return 1;
+        }
+        compact_running = 1;
+        compact_progress = 0;
+        compact_settled = 1;
+        compact_to = (HandleCursor){handle_first, 0};
+        compact_from = compact_to;
+    }
+
+    for (int walked = 0; walked < HANDLE_STEP; walked++)
+    {
+        HandleSegment *segment = compact_from.segment;
+        size_t end = segment == handle_last ? handle_top : segment->capacity;
+        if (compact_from.offset == end)
+        {
+            if (segment == handle_last)
+            {
+                compact_finish();
+                return compact_settled;
+            }
+            compact_from = (HandleCursor){segment->next, 0};
+            continue;
+        }
+
+        HandleObject *object = (HandleObject *)(SEGMENT_OBJECTS(segment) + compact_from.offset);
+        size_t size = object->size;
+        if (object->index == HANDLE_FREE)
+        {
+            compact_from.offset += size;
+            continue;
+        }
+
+        HandleEntry *entry = &handle_entries[object->index];
+        if (entry->pins > 0)
+        {
+            // The space up to a pinned object stays free, and sliding resumes behind it.
+            while (compact_to.segment != segment)
+            {
+                compact_next_segment(SIZE_MAX);
+            }
+            fill_free(&compact_to, compact_from.offset);
+            compact_from.offset += size;
+            compact_to = compact_from;
+            continue;
+        }
+
+        // Objects keep their order, so one that does not fit in the rest of a segment
+        // goes to the next, which is at worst its own.
+        while (compact_to.segment != segment && compact_to.segment->capacity - compact_to.offset < size)
+        {
+            compact_next_segment(size);
+        }
+        HandleObject *target = (HandleObject *)(SEGMENT_OBJECTS(compact_to.segment) + compact_to.offset);
+        if (target != object)
+        {
+            memmove(target, object, size);
+            entry->object = target;
+            compact_progress = 1;
+        }
+        compact_to.offset += size;
+        compact_from.offset += size;
+    }
+    return 0;
+}
+
+/*
+ * Fills the rest of the segment of 'compact_to' with a free object and moves 'compact_to' to the
+ * next segment. The segments up to that of 'compact_from' are empty, and those that hold fewer
+ * than 'size' bytes are freed on the way. Must be called with handle_lock held.
+ */
+static void compact_next_segment(size_t size)
+{
+    HandleSegment *segment = compact_to.segment;
+    fill_free(&compact_to, segment->capacity);
+    while (segment->next != compact_from.segment && segment->next->capacity < size)
+    {
+        HandleSegment *empty = segment->next;
+        segment->next = empty->next;
+        mfree(empty);
+        compact_progress = 1;
+    }
+    compact_to = (HandleCursor){segment->next, 0};
+}
+
+/*
+ * Ends a pass: the last object is now the one before 'compact_to', so the segments after it are
+ * freed and the pages after it in its segment released. Must be called with handle_lock held.
+ */
+static void compact_finish(void)
+{
+    compact_running = 0;
+
+    HandleSegment *segment = compact_to.segment->next;
+    compact_to.segment->next = NULL;
+    while (segment != NULL)
+    {
+        HandleSegment *next = segment->next;
+        mfree(segment);
+        segment = next;
+        compact_progress = 1;
+    }
+    handle_last = compact_to.segment;
+    if (handle_top != compact_to.offset)
+    {
+        handle_top = compact_to.offset;
+        compact_progress = 1;
+    }
+
+    // The free pages of the segment are zeroed again when they are used.
+    uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)SEGMENT_OBJECTS(handle_last) + handle_top + page_size - 1) & ~(page_size - 1);
+    uintptr_t end = ((uintptr_t)SEGMENT_OBJECTS(handle_last) + handle_last->capacity) & ~(page_size - 1);
+    if (start < end)
+    {
+        madvise((void *)start, end - start, MADV_DONTNEED);
+    }
+
+    if (compact_progress)
+    {
+        compact_settled = 0;
+    }
+}
+
+/*
+ * Returns the time of the monotonic clock in ns.
+ */
+static uint64_t handle_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
@@ -0,0 +1,144 @@
+#include "../include/allocator.h"
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/*
+ * Author: Mitchell Lord
+ *
+ * Standard C allocation functions implemented with the allocator, so it can replace
+ * the C library's malloc() in existing programs:
+ *
+ *   LD_PRELOAD=./libmallocate.so program
+ *
+ * Besides the standard functions, the GNU extensions glibc implements internally
+ * (reallocarray(), memalign(), valloc(), pvalloc()) are replaced too. Otherwise they
+ * would hand memory of this allocator to glibc's realloc() and free().
+ *
+ * Failures set errno to ENOMEM, or EINVAL for an invalid alignment, like glibc does.
+ */
+
+void *malloc(size_t size)
+{
+    void *ptr = mallocate(size);
+    if (ptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void free(void *ptr)
+{
+    mfree(ptr);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    void *ptr = mcalloc(count, size);
+    if (ptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *resized = mrealloc(ptr, size);
+    if (resized == NULL && size != 0)
+    {
+        errno = ENOMEM;
+    }
+    return resized;
+}
+
+void *reallocarray(void *ptr, size_t count, size_t size)
+{
+    if (size != 0 && count > SIZE_MAX / size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, count * size);
+}
+
+/*
+ * Stores memory of 'size' bytes aligned to 'alignment' in *memptr.
+ * The alignment must be a power of two and a multiple of sizeof(void *).
+ *
+ * Returns 0 on success, EINVAL for an invalid alignment or ENOMEM if the allocation failed.
+ * errno is left untouched, as POSIX requires.
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0)
+    {
+        return EINVAL;
+    }
+
+    void *ptr = maligned_alloc(alignment, size);
+    if (ptr == NULL)
+    {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void *ptr = maligned_alloc(alignment, size);
+    if (ptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+/*
+ * Like glibc, rounds an alignment that is not a power of two up to the next one,
+ * where aligned_alloc() and posix_memalign() fail with EINVAL.
+ */
+void *memalign(size_t alignment, size_t size)
+{
+    if (alignment > SIZE_MAX / 2 + 1)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t rounded = 1;
+    while (rounded < alignment)
+    {
+        rounded <<= 1;
+    }
+    return aligned_alloc(rounded, size);
+}
+
+void *valloc(size_t size)
+{
+    return aligned_alloc((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page_size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return aligned_alloc(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    return musable_size(ptr);
+}
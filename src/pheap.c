@@ -0,0 +1,590 @@
+#include "../include/allocator.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Author: Mitchell Lord
+ *
+ * Persistent heaps: a heap kept in a file, so a restarted process maps the file and finds its
+ * data structures as it left them instead of rebuilding them.
+ *
+ * The file is mapped shared, and holds a header followed by blocks laid out like the blocks of
+ * the allocator: a 16-byte header with the previous block's size and the block's own size, with
+ * the free and last flags in the low bits. Free blocks are kept in bins of power-of-two size
+ * ranges, linked by offsets from the start of the file rather than pointers, so the heap works
+ * wherever the file is mapped. Programs should link their own structures with offsets too,
+ * see pheap_offset() and pheap_pointer(). The file is mapped at the address it had the last
+ * time when that range is free, so raw pointers usually survive as well, but nothing ensures it.
+ *
+ * The header holds a root offset, from which a program finds its structures after a restart,
+ * and a clean flag. The flag is cleared while the heap is open and set by pheap_close(). A heap
+ * opened after a crash is checked block by block: the sizes must chain up to the end of the file
+ * and the root must be an allocated block. The bins are then rebuilt from the blocks, since they
+ * may have been left half updated. Blocks are split and merged by a single store of a block's
+ * size, once everything it covers is in place, so the chain of sizes is whole after a crash at any
+ * point; a heap that fails the check anyway is not opened.
+ *
+ * The file has a fixed size, chosen when it is created. Growing it would mean mapping it again,
+ * which would move the objects of every thread that holds pointers into it.
+ *
+ * A persistent heap is thread-safe, with a single lock, and can be opened once at a time: pheap_open()
+ * holds an exclusive flock() on the file until pheap_close().
+ */
+
+#define PHEAP_MAGIC "MALPHEAP"
+#define PHEAP_VERSION 1
+
+// Alignment of every object, and of block sizes.
+#define PHEAP_ALIGNMENT 16
+
+// Bins of free blocks: bin i holds blocks of 2^i to 2^(i+1) - 1 bytes.
+#define PHEAP_BINS 64
+
+// Bytes in front of the first block, holding the header.
+#define PHEAP_HEADER_SIZE ((uint64_t)4096)
+
+// Flags in the low bits of PBlock.size, as in the allocator's blocks.
+#define PBLOCK_FREE ((uint64_t)1)
+#define PBLOCK_LAST ((uint64_t)2)
+#define PBLOCK_FLAGS ((uint64_t)(PHEAP_ALIGNMENT - 1))
+#define PBLOCK_SIZE(block) ((block)->size & ~PBLOCK_FLAGS)
+
+/*
+ * Start of the file.
+ *
+ * Fields:
+ *   magic   - PHEAP_MAGIC, without its terminating zero.
+ *   version - PHEAP_VERSION.
+ *   clean   - 1 if the heap was closed with pheap_close(), 0 while it is open.
+ *   size    - bytes of the file.
+ *   base    - address the file was last mapped at, asked for again when it is opened.
+ *   root    - offset of the root object, or 0 if none was set.
+ *   bins    - offset of the first free block of each bin, or 0 if the bin is empty.
+ */
+typedef struct PHeapHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t clean;
+    uint64_t size;
+    uint64_t base;
+    uint64_t root;
+    uint64_t bins[PHEAP_BINS];
+} PHeapHeader;
+
+_Static_assert(sizeof(PHeapHeader) <= PHEAP_HEADER_SIZE, "the header does not fit in front of the first block");
+
+/*
+ * Block of a persistent heap, in the file.
+ *
+ * Fields:
+ *   prev_size - usable size of the block before this one, or 0 for the first block.
+ *   size      - usable size of the block, with PBLOCK_FREE and PBLOCK_LAST in the low bits.
+ */
+typedef struct PBlock
+{
+    uint64_t prev_size;
+    uint64_t size;
+} PBlock;
+
+/*
+ * Links of a free block in its bin, as offsets, stored in its usable memory.
+ */
+typedef struct PFreeLinks
+{
+    uint64_t prev;
+    uint64_t next;
+} PFreeLinks;
+
+#define PBLOCK_MEMORY(block) ((char *)(block) + sizeof(PBlock))
+#define PBLOCK_LINKS(block) ((PFreeLinks *)PBLOCK_MEMORY(block))
+
+// Smallest usable size of a block, enough for its free links.
+#define PBLOCK_MIN_SIZE ((uint64_t)sizeof(PFreeLinks))
+
+/*
+ * Fields:
+ *   lock   - protects everything in the file.
+ *   header - start of the mapping of the file.
+ *   fd     - the open file.
+ *   status - PHEAP_CREATED, PHEAP_CLEAN or PHEAP_RECOVERED.
+ */
+struct PHeap
+{
+    pthread_mutex_t lock;
+    PHeapHeader *header;
+    int fd;
+    int status;
+};
+
+static int pheap_format(PHeapHeader *header, uint64_t size);
+static int pheap_check(PHeapHeader *header);
+static PBlock *pblock_at(PHeapHeader *header, uint64_t offset);
+static uint64_t pblock_offset(PHeapHeader *header, PBlock *block);
+static PBlock *pblock_next(PBlock *block);
+static PBlock *pblock_prev(PBlock *block);
+static unsigned int pbin_index(uint64_t size);
+static void pbin_insert(PHeapHeader *header, PBlock *block);
+static void pbin_remove(PHeapHeader *header, PBlock *block);
+
+/*
+ * Opens the persistent heap in the file at 'path'. A missing or empty file is created as a
+ * heap of 'size' bytes, rounded up to whole pages. An existing heap keeps its size, and 'size'
+ * is ignored. A heap that was not closed is checked first, see the top of this file.
+ *
+ * Returns the heap, or NULL with errno set if the file cannot be opened or mapped, is open
+ * already, in this process or another (EWOULDBLOCK), is not a persistent heap (EINVAL), or failed
+ * the check (EUCLEAN).
+ */
+PHeap *pheap_open(const char *path, size_t size)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    // Two mappings of the file would each keep their own bins, so the lock is taken before
+    // the file is even read.
+    struct stat st;
+    PHeapHeader saved;
+    int status = PHEAP_CLEAN;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0)
+    {
+        goto fail;
+    }
+    if (st.st_size == 0)
+    {
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        if (size < PHEAP_HEADER_SIZE + sizeof(PBlock) + PBLOCK_MIN_SIZE || size > SIZE_MAX - page_size)
+        {
+            errno = EINVAL;
+            goto fail;
+        }
+        size = (size + page_size - 1) & ~(page_size - 1);
+        if (ftruncate(fd, (off_t)size) != 0)
+        {
+            goto fail;
+        }
+        saved.base = 0;
+        status = PHEAP_CREATED;
+    }
+    else
+    {
+        if (pread(fd, &saved, sizeof(saved), 0) != (ssize_t)sizeof(saved) ||
+            memcmp(saved.magic, PHEAP_MAGIC, sizeof(saved.magic)) != 0 || saved.version != PHEAP_VERSION ||
+            saved.size != (uint64_t)st.st_size)
+        {
+            errno = EINVAL;
+            goto fail;
+        }
+        size = (size_t)saved.size;
+    }
+
+    // The old address is only a hint, so a range in use elsewhere is never replaced.
+    PHeapHeader *header = mmap((void *)(uintptr_t)saved.base, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED)
+    {
+        goto fail;
+    }
+
+    if (status == PHEAP_CREATED)
+    {
+        pheap_format(header, size);
+    }
+    else if (!header->clean)
+    {
+        if (!pheap_check(header))
+        {
+            munmap(header, size);
+            errno = EUCLEAN;
+            goto fail;
+        }
+        status = PHEAP_RECOVERED;
+    }
+
+    PHeap *heap = mallocate(sizeof(PHeap));
+    if (heap == NULL)
+    {
+        munmap(header, size);
+        errno = ENOMEM;
+        goto fail;
+    }
+    pthread_mutex_init(&heap->lock, NULL);
+    heap->header = header;
+    heap->fd = fd;
+    heap->status = status;
+
+    // Writes to a shared mapping survive a crash of the process, so from now on a heap that is not
+    // closed is checked by the next process to open it.
+    header->base = (uint64_t)(uintptr_t)header;
+    header->clean = 0;
+    return heap;
+
+fail:
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+    }
+    return NULL;
+}
+
+/*
+ * Writes every change of a persistent heap to its file, marks it clean and closes it.
+ * Does nothing if 'heap' is NULL.
+ *
+ * Returns 1 on success, or 0 if the data could not be written, in which case the heap
+ * is checked the next time it is opened.
+ */
+int pheap_close(PHeap *heap)
+{
+    if (heap == NULL)
+    {
+        return 1;
+    }
+
+    PHeapHeader *header = heap->header;
+    size_t size = (size_t)header->size;
+    int ok = msync(header, size, MS_SYNC) == 0;
+    if (ok)
+    {
+        // The data is on disk before the flag that vouches for it.
+        header->clean = 1;
+        ok = msync(header, PHEAP_HEADER_SIZE, MS_SYNC) == 0;
+    }
+    munmap(header, size);
+    close(heap->fd);
+    pthread_mutex_destroy(&heap->lock);
+    mfree(heap);
+    return ok;
+}
+
+/*
+ * Tells how a persistent heap was opened: PHEAP_CREATED for a new file, PHEAP_CLEAN for a heap
+ * closed with pheap_close(), or PHEAP_RECOVERED for one that passed the check after a crash.
+ */
+int pheap_status(PHeap *heap)
+{
+    return heap->status;
+}
+
+/*
+ * Allocates 'size' bytes from a persistent heap, aligned to PHEAP_ALIGNMENT.
+ * The smallest fitting block of the first bin that has one is taken, and split.
+ *
+ * Returns the memory, or NULL if the heap has no free block large enough.
+ */
+void *pheap_alloc(PHeap *heap, size_t size)
+{
+    if (size > heap->header->size)
+    {
+        return NULL;
+    }
+    uint64_t needed = size < PBLOCK_MIN_SIZE ? PBLOCK_MIN_SIZE : ((uint64_t)size + PHEAP_ALIGNMENT - 1) & ~PBLOCK_FLAGS;
+
+    pthread_mutex_lock(&heap->lock);
+    PHeapHeader *header = heap->header;
+    PBlock *found = NULL;
+    for (unsigned int bin = pbin_index(needed); bin < PHEAP_BINS && found == NULL; bin++)
+    {
+        for (PBlock *block = pblock_at(header, header->bins[bin]); block != NULL;
+             block = pblock_at(header, PBLOCK_LINKS(block)->next))
+        {
+            if (PBLOCK_SIZE(block) >= needed && (found == NULL || PBLOCK_SIZE(block) < PBLOCK_SIZE(found)))
+            {
+                found = block;
+            }
+        }
+    }
+    if (found == NULL)
+    {
+        pthread_mutex_unlock(&heap->lock);
+        return NULL;
+    }
+
+    pbin_remove(header, found);
+    uint64_t block_size = PBLOCK_SIZE(found);
+    if (block_size >= needed + sizeof(PBlock) + PBLOCK_MIN_SIZE)
+    {
+        // The rest is complete before the block shrinks, so a crash never leaves a gap.
+        PBlock *rest = (PBlock *)(PBLOCK_MEMORY(found) + needed);
+        rest->prev_size = needed;
+        rest->size = (block_size - needed - sizeof(PBlock)) | (found->size & PBLOCK_LAST) | PBLOCK_FREE;
+        PBlock *next = pblock_next(rest);
+        if (next != NULL)
+        {
+            next->prev_size = PBLOCK_SIZE(rest);
+        }
+        found->size = needed;
+        pbin_insert(header, rest);
+    }
+    else
+    {
+        found->size &= ~PBLOCK_FREE;
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return PBLOCK_MEMORY(found);
+}
+
+/*
+ * Frees memory allocated with pheap_alloc(), merging it with free neighbours.
+ * Does nothing if 'ptr' is NULL, lies outside the heap, or was already freed.
+ * Freeing the root object clears the root.
+ */
+void pheap_free(PHeap *heap, void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&heap->lock);
+    PHeapHeader *header = heap->header;
+    uint64_t offset = (uint64_t)((uintptr_t)ptr - (uintptr_t)header);
+    PBlock *block = (PBlock *)((char *)ptr - sizeof(PBlock));
+    if (offset < PHEAP_HEADER_SIZE + sizeof(PBlock) || offset >= header->size || offset % PHEAP_ALIGNMENT != 0 ||
+        (block->size & PBLOCK_FREE))
+    {
+        pthread_mutex_unlock(&heap->lock);
+        return;
+    }
+    if (header->root == pblock_offset(header, block) + sizeof(PBlock))
+    {
+        header->root = 0;
+    }
+
+    PBlock *next = pblock_next(block);
+    if (next != NULL && (next->size & PBLOCK_FREE))
+    {
+        pbin_remove(header, next);
+        uint64_t merged = PBLOCK_SIZE(block) + sizeof(PBlock) + PBLOCK_SIZE(next);
+        PBlock *after = pblock_next(next);
+        if (after != NULL)
+        {
+            after->prev_size = merged;
+        }
+        block->size = merged | (next->size & PBLOCK_LAST);
+    }
+
+    PBlock *prev = pblock_prev(block);
+    if (prev != NULL && (prev->size & PBLOCK_FREE))
+    {
+        pbin_remove(header, prev);
+        uint64_t merged = PBLOCK_SIZE(prev) + sizeof(PBlock) + PBLOCK_SIZE(block);
+        PBlock *after = pblock_next(block);
+        if (after != NULL)
+        {
+            after->prev_size = merged;
+        }
+        prev->size = merged | (block->size & PBLOCK_LAST) | PBLOCK_FREE;
+        block = prev;
+    }
+
+    block->size |= PBLOCK_FREE;
+    pbin_insert(header, block);
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/*
+ * Returns the root object of a persistent heap, or NULL if none was set.
+ */
+void *pheap_root(PHeap *heap)
+{
+    pthread_mutex_lock(&heap->lock);
+    void *root = pheap_pointer(heap, heap->header->root);
+    pthread_mutex_unlock(&heap->lock);
+    return root;
+}
+
+/*
+ * Makes 'ptr', memory from pheap_alloc() or NULL, the root object of a persistent heap:
+ * the object a restarted process finds its structures from.
+ */
+void pheap_set_root(PHeap *heap, void *ptr)
+{
+    pthread_mutex_lock(&heap->lock);
+    heap->header->root = pheap_offset(heap, ptr);
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/*
+ * Returns the offset of 'ptr' in a persistent heap, which stays valid across restarts,
+ * or 0 if 'ptr' is NULL.
+ */
+uint64_t pheap_offset(PHeap *heap, void *ptr)
+{
+    return ptr == NULL ? 0 : (uint64_t)((char *)ptr - (char *)heap->header);
+}
+
+/*
+ * Returns the memory at 'offset' in a persistent heap, or NULL if 'offset' is 0.
+ */
+void *pheap_pointer(PHeap *heap, uint64_t offset)
+{
+    return offset == 0 ? NULL : (char *)heap->header + offset;
+}
+
+/*
+ * Lays out a new heap of 'size' bytes: the header and a single free block.
+ */
+static int pheap_format(PHeapHeader *header, uint64_t size)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, PHEAP_MAGIC, sizeof(header->magic));
+    header->version = PHEAP_VERSION;
+    header->size = size;
+
+    PBlock *block = pblock_at(header, PHEAP_HEADER_SIZE);
+    block->prev_size = 0;
+    block->size = (size - PHEAP_HEADER_SIZE - sizeof(PBlock)) | PBLOCK_FREE | PBLOCK_LAST;
+    pbin_insert(header, block);
+    return 1;
+}
+
+/*
+ * Checks the blocks of a heap that was not closed, then rebuilds what a crash may have left half
+ * updated from their sizes: the previous sizes, the merging of free neighbours, and the bins.
+ * Nothing is written unless the check passes.
+ *
+ * Returns 1 if the heap is consistent, or 0 otherwise.
+ */
+static int pheap_check(PHeapHeader *header)
+{
+    int root_found = header->root == 0;
+    uint64_t offset = PHEAP_HEADER_SIZE;
+    for (;;)
+    {
+        if (offset > header->size - sizeof(PBlock) - PBLOCK_MIN_SIZE)
+        {
+            return 0;
+        }
+        PBlock *block = pblock_at(header, offset);
+        uint64_t size = PBLOCK_SIZE(block);
+        if (size < PBLOCK_MIN_SIZE || size > header->size - offset - sizeof(PBlock))
+        {
+            return 0;
+        }
+        root_found |= !(block->size & PBLOCK_FREE) && header->root == offset + sizeof(PBlock);
+
+        offset += sizeof(PBlock) + size;
+        if ((block->size & PBLOCK_LAST) != (offset == header->size ? PBLOCK_LAST : 0))
+        {
+            return 0;
+        }
+        if (block->size & PBLOCK_LAST)
+        {
+            break;
+        }
+    }
+    if (!root_found)
+    {
+        return 0;
+    }
+
+    memset(header->bins, 0, sizeof(header->bins));
+    uint64_t prev_size = 0;
+    PBlock *block = pblock_at(header, PHEAP_HEADER_SIZE);
+    while (block != NULL)
+    {
+        block->prev_size = prev_size;
+        PBlock *next = pblock_next(block);
+        if (block->size & PBLOCK_FREE)
+        {
+            while (next != NULL && (next->size & PBLOCK_FREE))
+            {
+                block->size = (PBLOCK_SIZE(block) + sizeof(PBlock) + PBLOCK_SIZE(next)) | PBLOCK_FREE |
+                              (next->size & PBLOCK_LAST);
+                next = pblock_next(block);
+            }
+            pbin_insert(header, block);
+        }
+        prev_size = PBLOCK_SIZE(block);
+        block = next;
+    }
+    return 1;
+}
+
+/*
+ * Returns the block at 'offset' of the file, or NULL if 'offset' is 0.
+ */
+static PBlock *pblock_at(PHeapHeader *header, uint64_t offset)
+{
+    return offset == 0 ? NULL : (PBlock *)((char *)header + offset);
+}
+
+/*
+ * Returns the offset of 'block' in the file.
+ */
+static uint64_t pblock_offset(PHeapHeader *header, PBlock *block)
+{
+    return (uint64_t)((char *)block - (char *)header);
+}
+
+/*
+ * Returns the block after 'block', or NULL if it is the last one.
+ */
+static PBlock *pblock_next(PBlock *block)
+{
+    return block->size & PBLOCK_LAST ? NULL : (PBlock *)(PBLOCK_MEMORY(block) + PBLOCK_SIZE(block));
+}
+
+/*
+ * Returns the block before 'block', or NULL if it is the first one.
+ */
+static PBlock *pblock_prev(PBlock *block)
+{
+    return block->prev_size == 0 ? NULL : (PBlock *)((char *)block - block->prev_size - sizeof(PBlock));
+}
+
+/*
+ * Returns the bin of free blocks of 'size' bytes: the index of its highest set bit.
+ */
+static unsigned int pbin_index(uint64_t size)
+{
+    return 63 - (unsigned int)__builtin_clzll(size);
+}
+
+/*
+ * Pushes a free block on the list of its bin.
+ */
+static void pbin_insert(PHeapHeader *header, PBlock *block)
+{
+    uint64_t *head = &header->bins[pbin_index(PBLOCK_SIZE(block))];
+    uint64_t offset = pblock_offset(header, block);
+    PFreeLinks *links = PBLOCK_LINKS(block);
+    links->prev = 0;
+    links->next = *head;
+    if (*head != 0)
+    {
+        PBLOCK_LINKS(pblock_at(header, *head))->prev = offset;
+    }
+    *head = offset;
+}
+
+/*
+ * Unlinks a free block from the list of its bin.
+ */
+static void pbin_remove(PHeapHeader *header, PBlock *block)
+{
+    PFreeLinks *links = PBLOCK_LINKS(block);
+    if (links->prev != 0)
+    {
+        PBLOCK_LINKS(pblock_at(header, links->prev))->next = links->next;
+    }
+    else
+    {
+        header->bins[pbin_index(PBLOCK_SIZE(block))] = links->next;
+    }
+    if (links->next != 0)
+    {
+        PBLOCK_LINKS(pblock_at(header, links->next))->prev = links->prev;
+    }
+}
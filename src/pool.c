@@ -0,0 +1,399 @@
+#include "../include/allocator.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Author: Mitchell Lord
+ *
+ * Pools: memory for many objects of one size, like connections or timers.
+ *
+ * A pool carves its objects out of slabs it takes from the allocator with mallocate(), so they
+ * are packed back to back with no per-object header, and objects allocated together lie on
+ * consecutive cache lines. A free object holds the link of the pool's free list in its first
+ * bytes, so mpool_alloc() and mpool_free() are a pop and a push, with no size class to look up.
+ *
+ * A pool is thread-safe, with a single lock. Pools used by many threads can enable per-thread
+ * magazines with mpool_enable_magazines(): small stacks of free objects that each thread
+ * allocates from and frees to without the lock, exchanged with the pool half a magazine at a time.
+ *
+ * Slabs are only given back to the allocator when the pool is destroyed.
+ */
+
+// Bytes of each slab, unless POOL_MIN_OBJECTS objects need more.
+#define POOL_SLAB_SIZE ((size_t)64 * 1024)
+
+// Objects each slab holds at least, so large objects do not take a slab each.
+#define POOL_MIN_OBJECTS 8
+
+// Alignment used when mpool_create() is given 0, the same as the allocator's.
+#define POOL_DEFAULT_ALIGNMENT 16
+
+// Largest magazine accepted by mpool_enable_magazines().
+#define POOL_MAX_MAGAZINE 4096
+
+/*
+ * Header at the start of each slab, followed by the objects.
+ *
+ * Fields:
+ *   next - next slab of the pool.
+ */
+typedef struct PoolSlab
+{
+    struct PoolSlab *next;
+} PoolSlab;
+
+/*
+ * A free object, linked in the pool's free list through its first bytes.
+ */
+typedef struct PoolObject
+{
+    struct PoolObject *next;
+} PoolObject;
+
+/*
+ * Free objects cached by one thread for one pool.
+ *
+ * Fields:
+ *   next    - next magazine of the same pool, protected by the pool's lock.
+ *   pool    - pool the objects belong to.
+ *   count   - number of objects in 'objects'.
+ *   objects - the objects, most recently freed last.
+ */
+typedef struct Magazine
+{
+    struct Magazine *next;
+    Pool *pool;
+    unsigned int count;
+    void *objects[];
+} Magazine;
+
+/*
+ * Fields:
+ *   lock      - protects everything below except 'capacity'.
+ *   obj_size  - bytes of each object, a multiple of 'align'.
+ *   align     - alignment of every object.
+ *   slab_size - bytes of each slab.
+ *   offset    - offset of the first object in a slab, past the header.
+ *   slabs     - every slab of the pool, newest first.
+ *   free      - free list of objects freed to the pool.
+ *   next      - next object never handed out in the newest slab.
+ *   end       - end of the newest slab.
+ *   capacity  - objects per magazine, or 0 while magazines are off.
+ *   key       - thread-specific key of each thread's magazine, valid once 'capacity' is set.
+ *   magazines - magazines of the threads using the pool.
+ */
+struct Pool
+{
+    pthread_mutex_t lock;
+    size_t obj_size;
+    size_t align;
+    size_t slab_size;
+    size_t offset;
+    PoolSlab *slabs;
+    PoolObject *free;
+    char *next;
+    char *end;
+    _Atomic(unsigned int) capacity;
+    pthread_key_t key;
+    Magazine *magazines;
+};
+
+static void *pool_take(Pool *pool);
+static void pool_put(Pool *pool, void *ptr);
+static Magazine *magazine_get(Pool *pool, unsigned int capacity);
+static void magazine_exit(void *arg);
+
+/*
+ * Creates an empty pool of objects of 'obj_size' bytes aligned to 'align', a power of two,
+ * or POOL_DEFAULT_ALIGNMENT bytes if 'align' is 0. Sizes are rounded up to a multiple of the
+ * alignment. No slab is taken before the first allocation.
+ *
+ * Returns the pool, or NULL if the alignment is invalid, the size too large,
+ * or the pool could not be allocated.
+ */
+Pool *mpool_create(size_t obj_size, size_t align)
+{
+    if (align == 0)
+    {
+        align = POOL_DEFAULT_ALIGNMENT;
+    }
+    if ((align & (align - 1)) != 0 || align > SIZE_MAX / 4)
+    {
+        return NULL;
+    }
+    // A free object must hold an aligned link.
+    if (align < sizeof(PoolObject))
+    {
+        align = sizeof(PoolObject);
+    }
+    if (obj_size < sizeof(PoolObject))
+    {
+        obj_size = sizeof(PoolObject);
+    }
+
+    size_t offset = (sizeof(PoolSlab) + align - 1) & ~(align - 1);
+    if (obj_size > (SIZE_MAX / 2 - offset) / POOL_MIN_OBJECTS)
+    {
+        return NULL;
+    }
+    obj_size = (obj_size + align - 1) & ~(align - 1);
+    size_t slab_size = offset + POOL_MIN_OBJECTS * obj_size;
+
+    Pool *pool = mallocate(sizeof(Pool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->obj_size = obj_size;
+    pool->align = align;
+    pool->slab_size = slab_size > POOL_SLAB_SIZE ? slab_size : POOL_SLAB_SIZE;
+    pool->offset = offset;
+    pool->slabs = NULL;
+    pool->free = NULL;
+    pool->next = NULL;
+    pool->end = NULL;
+    atomic_init(&pool->capacity, 0);
+    pool->magazines = NULL;
+    return pool;
+}
+
+/*
+ * Allocates an object from a pool. Its contents are undefined.
+ *
+ * Returns the object, or NULL if the pool needed a new slab and it could not be allocated.
+ */
+void *mpool_alloc(Pool *pool)
+{
+    unsigned int capacity = atomic_load_explicit(&pool->capacity, memory_order_acquire);
+    Magazine *magazine = capacity != 0 ? magazine_get(pool, capacity) : NULL;
+    if (magazine != NULL && magazine->count > 0)
+    {
+        return magazine->objects[--magazine->count];
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    void *ptr = pool_take(pool);
+    if (magazine != NULL && ptr != NULL)
+    {
+        // Refill half the magazine under the same lock, so the next allocations take none.
+        while (magazine->count < capacity / 2)
+        {
+            void *object = pool_take(pool);
+            if (object == NULL)
+            {
+                break;
+            }
+            magazine->objects[magazine->count++] = object;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ptr;
+}
+
+/*
+ * Frees an object allocated from 'pool'. Does nothing if 'ptr' is NULL.
+ * Any thread may free an object, not only the one that allocated it.
+ */
+void mpool_free(Pool *pool, void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    unsigned int capacity = atomic_load_explicit(&pool->capacity, memory_order_acquire);
+    Magazine *magazine = capacity != 0 ? magazine_get(pool, capacity) : NULL;
+    if (magazine != NULL && magazine->count < capacity)
+    {
+        magazine->objects[magazine->count++] = ptr;
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (magazine != NULL)
+    {
+        // Give back the older half of the full magazine and keep the recently freed objects,
+        // which are more likely to be in the cache.
+        unsigned int half = (capacity + 1) / 2;
+        for (unsigned int i = 0; i < half; i++)
+        {
+            pool_put(pool, magazine->objects[i]);
+        }
+        memmove(magazine->objects, magazine->objects + half, (magazine->count - half) * sizeof(void *));
+        magazine->count -= half;
+        magazine->objects[magazine->count++] = ptr;
+    }
+    else
+    {
+        pool_put(pool, ptr);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Gives every thread using 'pool' a magazine of 'capacity' objects from now on.
+ * Magazines cannot be turned off again, and their capacity is set once.
+ *
+ * Returns 1 on success, or 0 if 'capacity' is 0 or above POOL_MAX_MAGAZINE, magazines are
+ * already enabled with another capacity, or no thread-specific key is left.
+ */
+int mpool_enable_magazines(Pool *pool, unsigned int capacity)
+{
+    if (capacity == 0 || capacity > POOL_MAX_MAGAZINE)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    unsigned int current = atomic_load_explicit(&pool->capacity, memory_order_relaxed);
+    int ok = current == capacity;
+    if (current == 0)
+    {
+        ok = pthread_key_create(&pool->key, magazine_exit) == 0;
+        if (ok)
+        {
+            // The key is published with the capacity, so threads that see one see the other.
+            atomic_store_explicit(&pool->capacity, capacity, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ok;
+}
+
+/*
+ * Frees every object of a pool, its slabs and magazines, and the pool itself.
+ * No thread may use the pool anymore. Does nothing if 'pool' is NULL.
+ */
+void mpool_destroy(Pool *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+
+    // Deleting the key keeps threads that exit later from flushing their magazine into the pool.
+    if (atomic_load_explicit(&pool->capacity, memory_order_relaxed) != 0)
+    {
+        pthread_key_delete(pool->key);
+    }
+    Magazine *magazine = pool->magazines;
+    while (magazine != NULL)
+    {
+        Magazine *next = magazine->next;
+        mfree(magazine);
+        magazine = next;
+    }
+
+    PoolSlab *slab = pool->slabs;
+    while (slab != NULL)
+    {
+        PoolSlab *next = slab->next;
+        mfree(slab);
+        slab = next;
+    }
+    pthread_mutex_destroy(&pool->lock);
+    mfree(pool);
+}
+
+/*
+ * Takes an object from the free list, or else the next one of the newest slab,
+ * taking a new slab from the allocator when it is full. Called with the pool's lock held.
+ *
+ * Returns the object, or NULL if no slab could be allocated.
+ */
+static void *pool_take(Pool *pool)
+{
+    PoolObject *object = pool->free;
+    if (object != NULL)
+    {
+        pool->free = object->next;
+        return object;
+    }
+
+    if ((size_t)(pool->end - pool->next) < pool->obj_size)
+    {
+        PoolSlab *slab = pool->align > POOL_DEFAULT_ALIGNMENT ? maligned_alloc(pool->align, pool->slab_size)
+                                                              : mallocate(pool->slab_size);
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->next = (char *)slab + pool->offset;
+        pool->end = (char *)slab + pool->slab_size;
+    }
+
+    void *ptr = pool->next;
+    pool->next += pool->obj_size;
+    return ptr;
+}
+
+/*
+ * Pushes an object on the free list. Called with the pool's lock held.
+ */
+static void pool_put(Pool *pool, void *ptr)
+{
+    PoolObject *object = ptr;
+    object->next = pool->free;
+    pool->free = object;
+}
+
+/*
+ * Returns the calling thread's magazine for 'pool', creating it on first use,
+ * or NULL if it could not be allocated. The thread then uses the pool's lock directly.
+ */
+static Magazine *magazine_get(Pool *pool, unsigned int capacity)
+{
+    Magazine *magazine = pthread_getspecific(pool->key);
+    if (magazine != NULL)
+    {
+        return magazine;
+    }
+
+    magazine = mallocate(sizeof(Magazine) + capacity * sizeof(void *));
+    if (magazine == NULL)
+    {
+        return NULL;
+    }
+    magazine->pool = pool;
+    magazine->count = 0;
+    if (pthread_setspecific(pool->key, magazine) != 0)
+    {
+        mfree(magazine);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    magazine->next = pool->magazines;
+    pool->magazines = magazine;
+    pthread_mutex_unlock(&pool->lock);
+    return magazine;
+}
+
+/*
+ * Thread exit destructor: gives the objects of the thread's magazine back to its pool,
+ * and frees the magazine.
+ */
+static void magazine_exit(void *arg)
+{
+    Magazine *magazine = arg;
+    Pool *pool = magazine->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    for (unsigned int i = 0; i < magazine->count; i++)
+    {
+        pool_put(pool, magazine->objects[i]);
+    }
+    Magazine **link = &pool->magazines;
+    while (*link != magazine)
+    {
+        link = &(*link)->next;
+    }
+    *link = magazine->next;
+    pthread_mutex_unlock(&pool->lock);
+    mfree(magazine);
+}
@@ -0,0 +1,213 @@
+#include "../include/allocator.h"
+#include <stdint.h>
+
+/*
+ * Author: Mitchell Lord
+ *
+ * Regions: memory for objects that all die at the same time, like the temporaries of a request.
+ *
+ * A region bump-allocates from chunks it takes from the allocator with mallocate(), so an
+ * allocation is a pointer increment and there is no per-object header. Objects are never freed
+ * one by one. region_reset() frees all of them at once by rewinding to the first chunk, and keeps
+ * the chunks for the next round, so a region reused for every request stops calling the allocator.
+ *
+ * Requests larger than a quarter of the chunk size get a chunk of their own, which is given back
+ * on reset, so one big object does not leave a big chunk behind.
+ *
+ * A region is not thread-safe. Each thread should use its own, or lock around it.
+ */
+
+// Chunk size used when region_create() is given 0, below the default mmap threshold.
+#define REGION_DEFAULT_CHUNK ((size_t)64 * 1024)
+
+// Smallest chunk size accepted by region_create().
+#define REGION_MIN_CHUNK ((size_t)1024)
+
+// Alignment of every object, the same as the allocator's.
+#define REGION_ALIGNMENT 16
+
+/*
+ * Header of a chunk of a region, followed by its memory.
+ *
+ * Fields:
+ *   next - next chunk of the same list.
+ *   size - number of bytes of memory after the header.
+ */
+typedef struct __attribute__((aligned(REGION_ALIGNMENT))) RegionChunk
+{
+    struct RegionChunk *next;
+    size_t size;
+} RegionChunk;
+
+#define CHUNK_MEMORY(chunk) ((char *)(chunk) + sizeof(RegionChunk))
+
+/*
+ * Fields:
+ *   chunks     - chunks of chunk_size bytes, in the order they are used.
+ *   current    - chunk objects are bumped from, or NULL before the first allocation.
+ *   next       - first free byte of the current chunk.
+ *   end        - end of the current chunk.
+ *   oversized  - chunks holding a single large object, given back on reset.
+ *   chunk_size - number of bytes of memory in each chunk of 'chunks'.
+ */
+struct Region
+{
+    RegionChunk *chunks;
+    RegionChunk *current;
+    char *next;
+    char *end;
+    RegionChunk *oversized;
+    size_t chunk_size;
+};
+
+static void *region_refill(Region *region, size_t size);
+static void free_chunks(RegionChunk *chunk);
+
+/*
+ * Creates an empty region taking chunks of 'chunk_size' bytes from the allocator,
+ * or REGION_DEFAULT_CHUNK bytes if 'chunk_size' is 0. No chunk is taken before the first allocation.
+ *
+ * Returns the region, or NULL if it could not be allocated.
+ */
+Region *region_create(size_t chunk_size)
+{
+    if (chunk_size == 0)
+    {
+        chunk_size = REGION_DEFAULT_CHUNK;
+    }
+    if (chunk_size < REGION_MIN_CHUNK)
+    {
+        chunk_size = REGION_MIN_CHUNK;
+    }
+    if (chunk_size > SIZE_MAX / 2)
+    {
+        return NULL;
+    }
+
+    Region *region = mallocate(sizeof(Region));
+    if (region == NULL)
+    {
+        return NULL;
+    }
+    region->chunks = NULL;
+    region->current = NULL;
+    region->next = NULL;
+    region->end = NULL;
+    region->oversized = NULL;
+    region->chunk_size = (chunk_size + REGION_ALIGNMENT - 1) & ~(size_t)(REGION_ALIGNMENT - 1);
+    return region;
+}
+
+/*
+ * Allocates 'size' bytes from a region, aligned to REGION_ALIGNMENT.
+ * The memory stays valid until the region is reset or destroyed.
+ *
+ * Returns the memory, or NULL if a new chunk was needed and could not be allocated.
+ */
+void *region_alloc(Region *region, size_t size)
+{
+    if (size > SIZE_MAX / 2)
+    {
+        return NULL;
+    }
+    // Zero-byte requests still get a distinct pointer.
+    size = size == 0 ? REGION_ALIGNMENT : (size + REGION_ALIGNMENT - 1) & ~(size_t)(REGION_ALIGNMENT - 1);
+
+    if ((size_t)(region->end - region->next) >= size)
+    {
+        void *ptr = region->next;
+        region->next += size;
+        return ptr;
+    }
+    return region_refill(region, size);
+}
+
+/*
+ * Allocates 'size' bytes, an REGION_ALIGNMENT multiple, when the current chunk is too full.
+ * Large requests get their own chunk. Others move on to the next chunk, reusing one kept
+ * by an earlier reset if there is one, and taking a new one from the allocator otherwise.
+ */
+static void *region_refill(Region *region, size_t size)
+{
+    if (size > region->chunk_size / 4)
+    {
+        RegionChunk *chunk = mallocate(sizeof(RegionChunk) + size);
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+        chunk->size = size;
+        chunk->next = region->oversized;
+        region->oversized = chunk;
+        return CHUNK_MEMORY(chunk);
+    }
+
+    RegionChunk *chunk = region->current != NULL ? region->current->next : region->chunks;
+    if (chunk == NULL)
+    {
+        chunk = mallocate(sizeof(RegionChunk) + region->chunk_size);
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+        chunk->size = region->chunk_size;
+        chunk->next = NULL;
+        if (region->current != NULL)
+        {
+            region->current->next = chunk;
+        }
+        else
+        {
+            region->chunks = chunk;
+        }
+    }
+
+    region->current = chunk;
+    region->next = CHUNK_MEMORY(chunk) + size;
+    region->end = CHUNK_MEMORY(chunk) + chunk->size;
+    return CHUNK_MEMORY(chunk);
+}
+
+/*
+ * Frees every object of a region at once. Its chunks are kept for the objects allocated next,
+ * except those holding a single large object, which go back to the allocator.
+ */
+void region_reset(Region *region)
+{
+    free_chunks(region->oversized);
+    region->oversized = NULL;
+
+    region->current = region->chunks;
+    if (region->current != NULL)
+    {
+        region->next = CHUNK_MEMORY(region->current);
+        region->end = region->next + region->current->size;
+    }
+}
+
+/*
+ * Frees every object and chunk of a region, and the region itself. Does nothing if 'region' is NULL.
+ */
+void region_destroy(Region *region)
+{
+    if (region == NULL)
+    {
+        return;
+    }
+    free_chunks(region->oversized);
+    free_chunks(region->chunks);
+    mfree(region);
+}
+
+/*
+ * Gives a list of chunks back to the allocator.
+ */
+static void free_chunks(RegionChunk *chunk)
+{
+    while (chunk != NULL)
+    {
+        RegionChunk *next = chunk->next;
+        mfree(chunk);
+        chunk = next;
+    }
+}
@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "../include/allocator.h"
+
+static int row(const char *name, void *p, size_t alignment) {
+    int ok = p != NULL && (uintptr_t)p % alignment == 0;
+    printf("%-6s %p   alignment=%-7zu aligned=%s\n", name, p, alignment, ok ? "YES" : "NO");
+    return ok;
+}
+
+int main() {
+    printf("=== Aligned allocation demo ===\n");
+
+    void *line = maligned_alloc(64, 48);
+    void *page = maligned_alloc(4096, 1000);
+    void *ring = maligned_alloc(4096, 64 * 1024);
+    void *huge = maligned_alloc(2 * 1024 * 1024, 3 * 1024 * 1024);
+
+    int ok = row("line", line, 64) & row("page", page, 4096) &
+             row("ring", ring, 4096) & row("huge", huge, 2 * 1024 * 1024);
+    if (!ok) {
+        printf("Error: allocation not properly aligned.\n");
+        return 1;
+    }
+
+    memset(line, 0xAA, 48);
+    memset(page, 0xBB, 1000);
+    memset(ring, 0xCC, 64 * 1024);
+    memset(huge, 0xDD, 3 * 1024 * 1024);
+
+    // The memory skipped to reach each alignment is back in the heap as a free block.
+    printf("\nBlock list:\n");
+    print_blocks();
+
+    mfree(line); mfree(page); mfree(ring); mfree(huge);
+
+    printf("\nAfter freeing everything:\n");
+    print_blocks();
+    return 0;
+}
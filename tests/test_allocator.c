@@ -12,9 +12,9 @@
 
 int main() {
     // Allocate three blocks
-    void *a = mallocate(64);
-    void *b = mallocate(32);
-    void *c = mallocate(48);
+    void *a = mallocate(1024);
+    void *b = mallocate(640);
+    void *c = mallocate(768);
 
     printf("Initial allocations:\n");
     print_blocks();
@@ -27,9 +27,9 @@ int main() {
     }
 
     // Write into blocks
-    memset(a, 0xAA, 64);
-    memset(b, 0xBB, 32);
-    memset(c, 0xCC, 48);
+    memset(a, 0xAA, 1024);
+    memset(b, 0xBB, 640);
+    memset(c, 0xCC, 768);
 
     // Free the middle block (b) -> should be marked free
     mfree(b);
@@ -44,9 +44,9 @@ int main() {
     printf("\n");
 
     // Allocate a smaller block into the coalesced region
-    void *d = mallocate(16);
-    memset(d, 0xDD, 16);
-    printf("Allocate d = 16 bytes (should split free block):\n");
+    void *d = mallocate(544);
+    memset(d, 0xDD, 544);
+    printf("Allocate d = 544 bytes (should split free block):\n");
     print_blocks();
     printf("\n");
 
@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/allocator.h"
+
+#define COUNT 8
+#define SMALL_COUNT 100
+
+int main() {
+    printf("=== Batch allocation demo ===\n");
+
+    void *buffers[COUNT];
+    size_t got = mallocate_batch(1024, COUNT, buffers);
+    if (got != COUNT) {
+        printf("Error: only %zu of %d blocks were allocated.\n", got, COUNT);
+        return 1;
+    }
+    for (int i = 0; i < COUNT; i++) {
+        memset(buffers[i], 0xA0 + i, 1024);
+    }
+
+    printf("\nAfter allocating %d blocks of 1024 bytes in one batch (back to back):\n", COUNT);
+    print_blocks();
+
+    void *small[SMALL_COUNT];
+    got = mallocate_batch(64, SMALL_COUNT, small);
+    if (got != SMALL_COUNT) {
+        printf("Error: only %zu of %d objects were allocated.\n", got, SMALL_COUNT);
+        return 1;
+    }
+
+    printf("\nAfter allocating %d objects of 64 bytes in one batch:\n", SMALL_COUNT);
+    print_blocks();
+
+    mfree_batch(buffers, COUNT);
+    mfree_batch(small, SMALL_COUNT);
+    printf("\nAfter freeing both batches (should be one free block):\n");
+    print_blocks();
+
+    return 0;
+}
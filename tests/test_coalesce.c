@@ -5,13 +5,13 @@
 int main() {
     printf("=== Coalescing demo ===\n");
 
-    void *a = mallocate(32);
-    void *b = mallocate(32);
-    void *c = mallocate(32);
+    void *a = mallocate(1024);
+    void *b = mallocate(1024);
+    void *c = mallocate(1024);
 
-    memset(a, 0xA1, 32);
-    memset(b, 0xB2, 32);
-    memset(c, 0xC3, 32);
+    memset(a, 0xA1, 1024);
+    memset(b, 0xB2, 1024);
+    memset(c, 0xC3, 1024);
 
     printf("\nAfter allocating a,b,c:\n");
     print_blocks();
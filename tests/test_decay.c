@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../include/allocator.h"
+
+#define COUNT 256
+#define BLOCK_SIZE (64 * 1024)
+#define DECAY_MS 400
+
+// Resident memory of the process in bytes.
+static long resident(void) {
+    long pages = 0, rss = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file != NULL) {
+        if (fscanf(file, "%ld %ld", &pages, &rss) != 2) {
+            rss = 0;
+        }
+        fclose(file);
+    }
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+static void sleep_ms(long ms) {
+    struct timespec delay = {ms / 1000, (ms % 1000) * 1000000};
+    nanosleep(&delay, NULL);
+}
+
+int main() {
+    printf("=== Decay purging demo ===\n");
+
+    if (!mallocate_set_option(MALLOCATE_DECAY_TIME, DECAY_MS)) {
+        printf("Error: the decay time was rejected.\n");
+        return 1;
+    }
+
+    // Small allocated blocks between the large ones keep them from coalescing.
+    void *blocks[COUNT];
+    void *fences[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+        blocks[i] = mallocate(BLOCK_SIZE);
+        fences[i] = mallocate(1000);
+        memset(blocks[i], 0xAB, BLOCK_SIZE);
+    }
+    long before = resident();
+
+    for (int i = 0; i < COUNT; i++) {
+        mfree(blocks[i]);
+    }
+    long spike = (long)COUNT * BLOCK_SIZE;
+    long released = before - resident();
+    printf("\nFreed %ld KiB, released by mfree(): %ld KiB\n", spike / 1024, released / 1024);
+    if (released > spike / 10) {
+        printf("Error: mfree() released the memory itself.\n");
+        return 1;
+    }
+
+    // The purger releases the memory gradually over the decay time.
+    printf("\nReleased by the purger over time:\n");
+    for (int ms = 100; ms <= 2 * DECAY_MS; ms += 100) {
+        sleep_ms(100);
+        released = before - resident();
+        printf("  %4d ms: %6ld KiB\n", ms, released / 1024);
+    }
+    if (released < spike * 9 / 10) {
+        printf("Error: the freed memory was not released after twice the decay time.\n");
+        return 1;
+    }
+
+    // Released blocks are reused like any other.
+    for (int i = 0; i < COUNT; i++) {
+        blocks[i] = mallocate(BLOCK_SIZE);
+        memset(blocks[i], 0xCD, BLOCK_SIZE);
+    }
+    for (int i = 0; i < COUNT; i++) {
+        mfree(blocks[i]);
+        mfree(fences[i]);
+    }
+
+    mallocate_set_option(MALLOCATE_DECAY_TIME, 0);
+    printf("\nOK: the freed memory was released in the background.\n");
+    return 0;
+}
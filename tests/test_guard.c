@@ -0,0 +1,128 @@
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "../include/allocator.h"
+
+#define PAIRS 2000000
+
+static volatile char sink;
+
+static void overflow(void) {
+    char *buffer = mallocate(32);
+    buffer[32] = 'x';
+}
+
+// A program ignoring SIGSEGV still dies of the fault instead of running it again forever.
+static void ignored_overflow(void) {
+    signal(SIGSEGV, SIG_IGN);
+    overflow();
+}
+
+static void use_after_free(void) {
+    char *buffer = mallocate(100);
+    mfree(buffer);
+    sink = buffer[10];
+}
+
+static void double_free(void) {
+    char *buffer = mallocate(64);
+    mfree(buffer);
+    mfree(buffer);
+}
+
+// Runs 'bug' in a child guarding every allocation, and checks that it died of 'signo'
+// with a report containing 'expected'.
+static int caught(void (*bug)(void), int signo, const char *expected) {
+    int fds[2];
+    pipe(fds);
+    pid_t child = fork();
+    if (child == 0) {
+        dup2(fds[1], STDERR_FILENO);
+        mallocate_set_option(MALLOCATE_GUARD_INTERVAL, 1);
+        mfree(mallocate(16)); // only draws the distance to the first guarded allocation
+        bug();
+        _exit(0);
+    }
+    close(fds[1]);
+    char report[4096] = {0};
+    size_t length = 0;
+    ssize_t n;
+    while ((n = read(fds[0], report + length, sizeof(report) - 1 - length)) > 0) {
+        length += (size_t)n;
+    }
+    close(fds[0]);
+    int status;
+    waitpid(child, &status, 0);
+
+    char *newline = strchr(report, '\n');
+    if (newline != NULL) {
+        *newline = '\0';
+    }
+    printf("%s\n", report);
+    return WIFSIGNALED(status) && WTERMSIG(status) == signo && strstr(report, expected) != NULL;
+}
+
+static double pairs_ns(void) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < PAIRS; i++) {
+        void *ptr = mallocate(64);
+        *(volatile char *)ptr = 1;
+        mfree(ptr);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / PAIRS;
+}
+
+int main() {
+    printf("=== Guarded sampling demo ===\n");
+
+    if (!caught(overflow, SIGSEGV, "buffer overflow at") || !caught(use_after_free, SIGSEGV, "use after free") ||
+        !caught(double_free, SIGABRT, "double free") || !caught(ignored_overflow, SIGSEGV, "buffer overflow at")) {
+        printf("Error: a memory error was not caught.\n");
+        return 1;
+    }
+
+    // Guarded objects behave like any other, including when the pool runs out of slots.
+    mallocate_set_option(MALLOCATE_GUARD_INTERVAL, 1);
+    static void *live[600];
+    for (int i = 0; i < 600; i++) {
+        size_t size = 1 + (size_t)i * 13 % 5000;
+        live[i] = i % 3 == 0 ? mcalloc(1, size) : i % 3 == 1 ? maligned_alloc(64, size) : mallocate(size);
+        if (live[i] == NULL || musable_size(live[i]) < size || (i % 3 == 1 && (uintptr_t)live[i] % 64 != 0)) {
+            printf("Error: bad guarded allocation of %zu bytes.\n", size);
+            return 1;
+        }
+        for (size_t j = 0; i % 3 == 0 && j < size; j++) {
+            if (((char *)live[i])[j] != 0) {
+                printf("Error: guarded mcalloc() memory is not zeroed.\n");
+                return 1;
+            }
+        }
+        memset(live[i], i & 0xFF, size);
+    }
+    for (int i = 0; i < 600; i += 2) {
+        size_t size = 1 + (size_t)i * 13 % 5000;
+        live[i] = mrealloc(live[i], size + 100);
+        for (size_t j = 0; j < size; j++) {
+            if (((unsigned char *)live[i])[j] != (i & 0xFF)) {
+                printf("Error: mrealloc() of a guarded object lost its contents.\n");
+                return 1;
+            }
+        }
+    }
+    mfree_batch(live, 600);
+
+    // The cost of sampling, on a loop of small allocations.
+    mallocate_set_option(MALLOCATE_GUARD_INTERVAL, 0);
+    double off = pairs_ns();
+    mallocate_set_option(MALLOCATE_GUARD_INTERVAL, 1000);
+    double sampled = pairs_ns();
+    mallocate_set_option(MALLOCATE_GUARD_INTERVAL, 0);
+    printf("mallocate()/mfree() pair: %.1f ns unsampled, %.1f ns guarding 1 in 1000\n", off, sampled);
+    return 0;
+}
@@ -0,0 +1,171 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../include/allocator.h"
+
+#define OBJECTS 60000
+#define BUDGET_NS 1000000
+#define CHURN 200000
+
+static MHandle handles[OBJECTS];
+
+static size_t size_of(int i) {
+    return 32 + (size_t)i * 7919 % 1000;
+}
+
+// Fills an object with its number, so a move that loses or mixes bytes is seen.
+static void fill(int i) {
+    unsigned char *object = mhandle_pin(handles[i]);
+    memset(object, i & 0xFF, size_of(i));
+    memcpy(object, &i, sizeof(i));
+    mhandle_unpin(handles[i]);
+}
+
+static int intact(int i) {
+    unsigned char *object = mhandle_pin(handles[i]);
+    int ok = object != NULL && memcmp(object, &i, sizeof(i)) == 0;
+    for (size_t j = sizeof(i); ok && j < size_of(i); j++) {
+        ok = object[j] == (i & 0xFF);
+    }
+    mhandle_unpin(handles[i]);
+    return ok;
+}
+
+static size_t mapped(void) {
+    MallocateStats stats;
+    mallocate_stats(&stats);
+    return stats.mapped;
+}
+
+static double now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+static atomic_int churning;
+
+// Compacts in small steps while the main thread allocates, frees and reads objects.
+static void *compactor(void *arg) {
+    (void)arg;
+    while (churning) {
+        mhandle_compact(100000);
+    }
+    return NULL;
+}
+
+int main() {
+    printf("=== Handle compaction demo ===\n");
+
+    if (mhandle_alloc(SIZE_MAX) != 0 || mhandle_pin(0) != NULL || mhandle_compact(0) != 1) {
+        printf("Error: bad handling of invalid requests.\n");
+        return 1;
+    }
+    mhandle_free(0);
+
+    size_t baseline = mapped();
+    for (int i = 0; i < OBJECTS; i++) {
+        handles[i] = mhandle_alloc(size_of(i));
+        if (handles[i] == 0) {
+            printf("Error: handle allocation failed.\n");
+            return 1;
+        }
+        fill(i);
+    }
+    size_t peak = mapped() - baseline;
+
+    // Nine objects in ten die, the survivors scattered over every segment.
+    // A few stay pinned through the first compaction, holding back what follows them.
+    void *pinned[OBJECTS / 10000];
+    for (int i = 0; i < OBJECTS; i++) {
+        if (i % 10 != 0) {
+            MHandle dead = handles[i];
+            mhandle_free(dead);
+            if (mhandle_pin(dead) != NULL) {
+                printf("Error: a freed handle is still valid.\n");
+                return 1;
+            }
+            handles[i] = 0;
+        } else if (i % 10000 == 0) {
+            pinned[i / 10000] = mhandle_pin(handles[i]);
+        }
+    }
+
+    int calls = 0;
+    double longest = 0;
+    for (int done = 0; !done; calls++) {
+        double start = now_ms();
+        done = mhandle_compact(BUDGET_NS);
+        double elapsed = now_ms() - start;
+        longest = elapsed > longest ? elapsed : longest;
+    }
+    for (int i = 0; i < OBJECTS; i += 10000) {
+        if (mhandle_pin(handles[i]) != pinned[i / 10000]) {
+            printf("Error: a pinned object moved.\n");
+            return 1;
+        }
+        mhandle_unpin(handles[i]);
+        mhandle_unpin(handles[i]);
+    }
+    size_t held = mapped() - baseline;
+    int unpinned_calls = 0;
+    while (!mhandle_compact(BUDGET_NS)) {
+        unpinned_calls++;
+    }
+    size_t steady = mapped() - baseline;
+
+    for (int i = 0; i < OBJECTS; i += 10) {
+        if (!intact(i)) {
+            printf("Error: object %d changed when it moved.\n", i);
+            return 1;
+        }
+    }
+    printf("Peak %zu KiB, %zu KiB with %d objects pinned, %zu KiB once unpinned\n", peak / 1024, held / 1024,
+           OBJECTS / 10000, steady / 1024);
+    printf("%d compaction calls of at most %.2f ms for a budget of %.2f ms\n", calls + unpinned_calls + 1, longest,
+           BUDGET_NS / 1e6);
+    if (steady * 4 > peak || held < steady) {
+        printf("Error: compaction did not give memory back.\n");
+        return 1;
+    }
+    if (mhandle_compact(0) != 1) {
+        printf("Error: a compacted space was compacted again.\n");
+        return 1;
+    }
+
+    // Objects come and go while another thread compacts.
+    churning = 1;
+    pthread_t thread;
+    pthread_create(&thread, NULL, compactor, NULL);
+    unsigned int seed = 1;
+    for (int n = 0; n < CHURN; n++) {
+        seed = seed * 1103515245 + 12345;
+        int i = (int)(seed >> 8) % OBJECTS;
+        if (handles[i] != 0 && !intact(i)) {
+            printf("Error: object %d changed while compacting.\n", i);
+            return 1;
+        }
+        if (handles[i] != 0 && n % 2 == 0) {
+            mhandle_free(handles[i]);
+            handles[i] = 0;
+        } else if (handles[i] == 0) {
+            handles[i] = mhandle_alloc(size_of(i));
+            fill(i);
+        }
+    }
+    churning = 0;
+    pthread_join(thread, NULL);
+    for (int i = 0; i < OBJECTS; i++) {
+        if (handles[i] != 0 && !intact(i)) {
+            printf("Error: object %d changed while compacting.\n", i);
+            return 1;
+        }
+        mhandle_free(handles[i]);
+    }
+    mhandle_compact(0);
+    printf("After churn and freeing everything: %zu KiB\n", (mapped() - baseline) / 1024);
+    return 0;
+}
@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/allocator.h"
+
+#define COUNT 8
+#define BLOCK_SIZE (100 * 1024)
+
+int main() {
+    printf("=== Huge pages demo ===\n");
+
+    if (!mallocate_set_option(MALLOCATE_HUGE_PAGES, MALLOCATE_HUGE_TRANSPARENT)) {
+        printf("Error: huge pages could not be enabled.\n");
+        return 1;
+    }
+
+    // With huge pages the heap is made of 2 MiB chunks instead of sbrk() memory.
+    void *blocks[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+        blocks[i] = mallocate(BLOCK_SIZE);
+        memset(blocks[i], 0xAB, BLOCK_SIZE);
+    }
+
+    MallocateStats stats;
+    mallocate_stats(&stats);
+    printf("\nAfter allocating %d blocks of %d bytes:\n", COUNT, BLOCK_SIZE);
+    print_blocks();
+    printf("  huge chunks mapped: %zu bytes\n", stats.huge_mapped);
+    printf("  backed by huge pages: %s\n", stats.huge_backed > 0 ? "yes" : "no (depends on the kernel)");
+
+    // Freed memory is only released in whole huge pages, so the chunk keeps its huge page.
+    for (int i = 0; i < COUNT; i++) {
+        mfree(blocks[i]);
+    }
+    printf("\nAfter freeing every block:\n");
+    print_blocks();
+
+    return 0;
+}
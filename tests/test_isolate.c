@@ -0,0 +1,148 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/allocator.h"
+
+#define OBJECTS 800
+#define INCREMENTS 20000000L
+
+static volatile long *counters[2];
+
+static int compare(const void *a, const void *b) {
+    uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void *bump(void *arg) {
+    volatile long *counter = counters[(long)arg];
+    for (long i = 0; i < INCREMENTS; i++) {
+        (*counter)++;
+    }
+    return NULL;
+}
+
+// Times two threads incrementing their own counter, in ms.
+static double race(void) {
+    struct timespec start, end;
+    pthread_t threads[2];
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < 2; i++) {
+        pthread_create(&threads[i], NULL, bump, (void *)i);
+    }
+    for (int i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+int main() {
+    printf("=== Out-of-band metadata and cache line isolation demo ===\n");
+
+    // Slab headers live out of the pages, so 512-byte objects fill them: 8 per page, not 7.
+    static void *objects[OBJECTS];
+    static uintptr_t page_of[OBJECTS];
+    int page_start = 0;
+    for (int i = 0; i < OBJECTS; i++) {
+        objects[i] = mallocate(512);
+        page_of[i] = (uintptr_t)objects[i] / 4096;
+        page_start |= (uintptr_t)objects[i] % 4096 == 0;
+    }
+    qsort(page_of, OBJECTS, sizeof(page_of[0]), compare);
+    unsigned long pages = 1;
+    for (int i = 1; i < OBJECTS; i++) {
+        pages += page_of[i] != page_of[i - 1];
+    }
+    printf("%d objects of 512 bytes on %lu pages\n", OBJECTS, pages);
+    if (!page_start || pages > OBJECTS / 8 + 2) {
+        printf("Error: objects do not fill their slab pages.\n");
+        return 1;
+    }
+
+    // Freeing and reusing everything leaves the neighbours' bytes alone.
+    memset(objects[1], 0x5A, 512);
+    mfree(objects[0]);
+    mfree(objects[2]);
+    for (int i = 0; i < 512; i++) {
+        if (((unsigned char *)objects[1])[i] != 0x5A) {
+            printf("Error: freeing a neighbour changed an object.\n");
+            return 1;
+        }
+    }
+    for (int i = 3; i < OBJECTS; i++) {
+        mfree(objects[i]);
+    }
+    mfree(objects[1]);
+
+    // Aligned small requests come from slabs too, now that slots start at page boundaries.
+    void *aligned = maligned_alloc(256, 200);
+    if (aligned == NULL || (uintptr_t)aligned % 256 != 0 || musable_size(aligned) != 256) {
+        printf("Error: bad small aligned allocation.\n");
+        return 1;
+    }
+    mfree(aligned);
+
+    // Packed, two small counters share a cache line.
+    counters[0] = mallocate(sizeof(long));
+    counters[1] = mallocate(sizeof(long));
+    int shared = (uintptr_t)counters[0] / 64 == (uintptr_t)counters[1] / 64;
+    double packed_ms = race();
+    mfree((void *)counters[0]);
+    mfree((void *)counters[1]);
+
+    if (!mallocate_set_option(MALLOCATE_ISOLATE_LINES, 1) || mallocate_set_option(MALLOCATE_ISOLATE_LINES, 2)) {
+        printf("Error: bad MALLOCATE_ISOLATE_LINES handling.\n");
+        return 1;
+    }
+
+    // Isolated, every allocation starts a line and owns all the lines it touches.
+    size_t sizes[] = {1, 8, 24, 64, 65, 500, 513, 1000, 4000, 70000, 300000};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t lines = (sizes[i] + 63) / 64 * 64;
+        void *ptrs[3] = {mallocate(sizes[i]), mcalloc(1, sizes[i]), maligned_alloc(32, sizes[i])};
+        for (int j = 0; j < 3; j++) {
+            if (ptrs[j] == NULL || (uintptr_t)ptrs[j] % 64 != 0 || musable_size(ptrs[j]) < lines) {
+                printf("Error: allocation of %zu bytes is not isolated.\n", sizes[i]);
+                return 1;
+            }
+        }
+        void *grown = mrealloc(ptrs[0], sizes[i] * 3);
+        if (grown == NULL || (uintptr_t)grown % 64 != 0 || musable_size(grown) < (sizes[i] * 3 + 63) / 64 * 64) {
+            printf("Error: reallocation of %zu bytes is not isolated.\n", sizes[i]);
+            return 1;
+        }
+        mfree(grown);
+        mfree(ptrs[1]);
+        mfree(ptrs[2]);
+    }
+    void *batch[16];
+    if (mallocate_batch(40, 16, batch) != 16) {
+        printf("Error: batch allocation failed.\n");
+        return 1;
+    }
+    for (int i = 0; i < 16; i++) {
+        if ((uintptr_t)batch[i] % 64 != 0) {
+            printf("Error: batch allocation is not isolated.\n");
+            return 1;
+        }
+    }
+    mfree_batch(batch, 16);
+
+    counters[0] = mallocate(sizeof(long));
+    counters[1] = mallocate(sizeof(long));
+    if ((uintptr_t)counters[0] / 64 == (uintptr_t)counters[1] / 64) {
+        printf("Error: isolated counters share a cache line.\n");
+        return 1;
+    }
+    double isolated_ms = race();
+    mfree((void *)counters[0]);
+    mfree((void *)counters[1]);
+    mallocate_set_option(MALLOCATE_ISOLATE_LINES, 0);
+
+    printf("Two threads bumping their own counter: %.1f ms %s, %.1f ms isolated\n",
+           packed_ms, shared ? "sharing a line" : "packed", isolated_ms);
+    return 0;
+}
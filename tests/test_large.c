@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/allocator.h"
+
+int main() {
+    printf("=== Large allocation demo ===\n");
+
+    void *small = mallocate(64);
+    void *big = mallocate(1024 * 1024);
+    memset(small, 0xAA, 64);
+    memset(big, 0xBB, 1024 * 1024);
+
+    printf("\nAfter allocating small (64) and big (1 MiB):\n");
+    print_blocks();
+
+    mfree(big);
+    printf("\nAfter freeing big (its mapping should be gone):\n");
+    print_blocks();
+
+    // Lower the threshold so a 4 KiB request gets its own mapping too.
+    mallocate_set_option(MALLOCATE_MMAP_THRESHOLD, 4096);
+    void *page = mallocate(4096);
+    memset(page, 0xCC, 4096);
+
+    printf("\nAfter allocating page (4096) with a 4 KiB threshold:\n");
+    print_blocks();
+
+    mfree(page);
+    mfree(small);
+    return 0;
+}
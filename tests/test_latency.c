@@ -0,0 +1,120 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "../include/allocator.h"
+
+#define THREADS 4
+#define CALLS 50000
+#define PAIRS 2000000
+
+// Allocates and frees CALLS objects of mixed sizes, CALLS / 10 at a time.
+static void *work(void *arg) {
+    (void)arg;
+    void *live[CALLS / 10];
+    for (int round = 0; round < 10; round++) {
+        for (int i = 0; i < CALLS / 10; i++) {
+            size_t size = 16 + (size_t)(i * 7919 + round * 104729) % 20000;
+            live[i] = i % 5 == 0 ? mcalloc(1, size) : i % 5 == 1 ? maligned_alloc(64, size) : mallocate(size);
+        }
+        for (int i = 0; i < CALLS / 10; i++) {
+            mfree(live[i]);
+        }
+    }
+    return NULL;
+}
+
+static double pairs_ns(void) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < PAIRS; i++) {
+        void *ptr = mallocate(64);
+        *(volatile char *)ptr = 1;
+        mfree(ptr);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / PAIRS;
+}
+
+static void print_percentiles(const char *name, const MallocateLatency *latency) {
+    printf("%-6s %zu calls: p50 %llu ns, p99 %llu ns, p99.9 %llu ns, max %llu ns\n", name, latency->count,
+           (unsigned long long)mallocate_latency_percentile(latency, 0.5),
+           (unsigned long long)mallocate_latency_percentile(latency, 0.99),
+           (unsigned long long)mallocate_latency_percentile(latency, 0.999),
+           (unsigned long long)mallocate_latency_percentile(latency, 1.0));
+}
+
+int main() {
+    printf("=== Latency histogram demo ===\n");
+
+    // Buckets cover every latency once, each at most 1/8 as wide as its bound.
+    for (size_t i = 8; i < MALLOCATE_LATENCY_BUCKETS; i++) {
+        uint64_t low = mallocate_latency_bound(i), high = mallocate_latency_bound(i + 1);
+        if (low <= mallocate_latency_bound(i - 1) || (i + 1 < MALLOCATE_LATENCY_BUCKETS && (high - low) * 8 > low)) {
+            printf("Error: bad bucket bounds at bucket %zu.\n", i);
+            return 1;
+        }
+    }
+    if (mallocate_latency_bound(MALLOCATE_LATENCY_BUCKETS) != UINT64_MAX) {
+        printf("Error: bad bound past the last bucket.\n");
+        return 1;
+    }
+
+    MallocateLatency allocs, frees;
+    if (mallocate_set_option(MALLOCATE_LATENCY, 2) || mallocate_latency(2, &allocs)) {
+        printf("Error: bad MALLOCATE_LATENCY handling.\n");
+        return 1;
+    }
+    work(NULL);
+    mallocate_latency(MALLOCATE_LATENCY_ALLOC, &allocs);
+    if (allocs.count != 0 || mallocate_latency_percentile(&allocs, 0.99) != 0) {
+        printf("Error: calls were timed before MALLOCATE_LATENCY was set.\n");
+        return 1;
+    }
+
+    // Every call of every thread is counted, including those of threads that exited,
+    // and of threads that took over their histograms.
+    mallocate_set_option(MALLOCATE_LATENCY, 1);
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, work, NULL);
+    }
+    work(NULL);
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_create(&threads[0], NULL, work, NULL);
+    pthread_join(threads[0], NULL);
+
+    mallocate_latency(MALLOCATE_LATENCY_ALLOC, &allocs);
+    mallocate_latency(MALLOCATE_LATENCY_FREE, &frees);
+    size_t expected = (size_t)(THREADS + 2) * CALLS;
+    if (allocs.count != expected || frees.count != expected) {
+        printf("Error: %zu allocations and %zu frees timed, expected %zu.\n", allocs.count, frees.count, expected);
+        return 1;
+    }
+    print_percentiles("alloc", &allocs);
+    print_percentiles("free", &frees);
+    uint64_t previous = 0;
+    for (double fraction = 0.1; fraction <= 1.0; fraction += 0.1) {
+        uint64_t latency = mallocate_latency_percentile(&allocs, fraction);
+        if (latency < previous) {
+            printf("Error: percentiles are not increasing.\n");
+            return 1;
+        }
+        previous = latency;
+    }
+
+    // Counts only grow while the option is set.
+    double timed = pairs_ns();
+    mallocate_set_option(MALLOCATE_LATENCY, 0);
+    double untimed = pairs_ns();
+    MallocateLatency after;
+    mallocate_latency(MALLOCATE_LATENCY_ALLOC, &after);
+    if (after.count != expected + PAIRS) {
+        printf("Error: %zu allocations timed, expected %zu.\n", after.count, expected + PAIRS);
+        return 1;
+    }
+    printf("mallocate()/mfree() pair: %.1f ns untimed, %.1f ns timed\n", untimed, timed);
+    return 0;
+}
@@ -0,0 +1,94 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for sched_setaffinity()
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "../include/allocator.h"
+
+#define SMALL_SIZE 64
+#define MEDIUM_SIZE (16 * 1024)
+#define LARGE_SIZE (512 * 1024)
+
+// NUMA node of the CPU the calling thread runs on.
+static int current_node(void) {
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return -1;
+    }
+    return (int)node;
+}
+
+// Keeps the calling thread on its CPU, so its node cannot change after its arena is chosen.
+static void stay_on_cpu(void) {
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+}
+
+// NUMA node of the page holding 'ptr', which must have been touched.
+static int node_of(void *ptr) {
+    int node;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, ptr, MPOL_F_NODE | MPOL_F_ADDR) != 0) {
+        return -1;
+    }
+    return node;
+}
+
+static int check(const char *name, size_t size) {
+    char *ptr = mallocate(size);
+    if (ptr == NULL) {
+        printf("  Error: %s allocation failed.\n", name);
+        return 0;
+    }
+    memset(ptr, 0xAB, size);
+
+    int node = node_of(ptr);
+    int local = node == current_node();
+    printf("  %-6s %7zu bytes on node %d: %s\n", name, size, node, local ? "local" : "remote");
+    mfree(ptr);
+    return local;
+}
+
+static void *worker(void *arg) {
+    int *ok = arg;
+    stay_on_cpu();
+    printf("\nWorker thread on node %d:\n", current_node());
+    *ok = check("small", SMALL_SIZE) & check("medium", MEDIUM_SIZE) & check("large", LARGE_SIZE);
+    return NULL;
+}
+
+int main() {
+    printf("=== NUMA demo ===\n");
+
+    if (current_node() < 0 || node_of(&(int){0}) < 0) {
+        printf("NUMA information is not available, nothing to check.\n");
+        return 0;
+    }
+
+    stay_on_cpu();
+
+    // Every thread allocates from an arena of its own node, so memory is local to it.
+    printf("\nMain thread on node %d:\n", current_node());
+    int ok = check("small", SMALL_SIZE) & check("medium", MEDIUM_SIZE) & check("large", LARGE_SIZE);
+
+    int worker_ok = 0;
+    pthread_t thread;
+    pthread_create(&thread, NULL, worker, &worker_ok);
+    pthread_join(thread, NULL);
+
+    if (!ok || !worker_ok) {
+        printf("\nError: memory was placed on a remote node.\n");
+        return 1;
+    }
+    printf("\nAll memory is local to the thread that allocated it.\n");
+    return 0;
+}
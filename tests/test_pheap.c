@@ -0,0 +1,204 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../include/allocator.h"
+
+#define NODES 1000
+
+// A list kept in the heap file, linked by offsets so it survives a move of the mapping.
+typedef struct Node {
+    uint64_t next;
+    long value;
+    char name[40];
+} Node;
+
+typedef struct Root {
+    uint64_t head;
+    long count;
+} Root;
+
+// Sums the list, or returns -1 if a node does not hold what was stored in it.
+static long walk(PHeap *heap, long *count) {
+    Root *root = pheap_root(heap);
+    if (root == NULL) {
+        return -1;
+    }
+    long sum = 0;
+    *count = 0;
+    for (Node *node = pheap_pointer(heap, root->head); node != NULL; node = pheap_pointer(heap, node->next)) {
+        char name[40];
+        snprintf(name, sizeof(name), "node %ld", node->value);
+        if (strcmp(name, node->name) != 0) {
+            return -1;
+        }
+        sum += node->value;
+        (*count)++;
+    }
+    return *count == root->count ? sum : -1;
+}
+
+static Node *push(PHeap *heap, Root *root, long value) {
+    Node *node = pheap_alloc(heap, sizeof(Node));
+    if (node == NULL) {
+        return NULL;
+    }
+    node->value = value;
+    snprintf(node->name, sizeof(node->name), "node %ld", value);
+    node->next = root->head;
+    root->head = pheap_offset(heap, node);
+    root->count++;
+    return node;
+}
+
+// Frees every node with an odd value.
+static void drop_odd(PHeap *heap, Root *root) {
+    uint64_t *link = &root->head;
+    while (*link != 0) {
+        Node *node = pheap_pointer(heap, *link);
+        if (node->value % 2 != 0) {
+            *link = node->next;
+            pheap_free(heap, node);
+            root->count--;
+        } else {
+            link = &node->next;
+        }
+    }
+}
+
+int main() {
+    printf("=== Persistent heap demo ===\n");
+
+    char path[] = "/tmp/test_pheap_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("Error: no temporary file.\n");
+        return 1;
+    }
+    close(fd);
+
+    // First run: build the list in a new heap and close it.
+    PHeap *heap = pheap_open(path, 1 << 20);
+    if (heap == NULL || pheap_status(heap) != PHEAP_CREATED) {
+        printf("Error: the heap could not be created.\n");
+        return 1;
+    }
+    Root *root = pheap_alloc(heap, sizeof(Root));
+    root->head = 0;
+    root->count = 0;
+    pheap_set_root(heap, root);
+    long expected = 0;
+    for (long i = 0; i < NODES; i++) {
+        if (push(heap, root, i) == NULL) {
+            printf("Error: the heap ran out of memory.\n");
+            return 1;
+        }
+        expected += i;
+    }
+    if (!pheap_close(heap)) {
+        printf("Error: the heap could not be closed.\n");
+        return 1;
+    }
+
+    // Second run: the list is found intact, and freed nodes are reused.
+    heap = pheap_open(path, 0);
+    long count;
+    if (heap == NULL || pheap_status(heap) != PHEAP_CLEAN || walk(heap, &count) != expected) {
+        printf("Error: the list did not survive a clean restart.\n");
+        return 1;
+    }
+    printf("Reopened after a clean shutdown: %ld nodes, sum %ld\n", count, expected);
+    if (pheap_open(path, 0) != NULL || errno != EWOULDBLOCK) {
+        printf("Error: an open heap was opened a second time.\n");
+        return 1;
+    }
+    root = pheap_root(heap);
+    drop_odd(heap, root);
+    expected = 0;
+    for (long i = 0; i < NODES; i += 2) {
+        expected += i;
+    }
+    for (long i = NODES; i < 2 * NODES; i++) {
+        push(heap, root, i);
+        expected += i;
+    }
+    pheap_close(heap);
+
+    // Third run crashes: a child changes the list and exits without closing the heap.
+    pid_t child = fork();
+    if (child == 0) {
+        PHeap *crashed = pheap_open(path, 0);
+        Root *crashed_root = pheap_root(crashed);
+        drop_odd(crashed, crashed_root);
+        for (int i = 0; i < 100; i++) {
+            pheap_free(crashed, pheap_alloc(crashed, 1000));
+        }
+        _exit(0);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    for (long i = NODES + 1; i < 2 * NODES; i += 2) {
+        expected -= i;
+    }
+
+    heap = pheap_open(path, 0);
+    if (heap == NULL || pheap_status(heap) != PHEAP_RECOVERED || walk(heap, &count) != expected) {
+        printf("Error: the list did not survive a crash.\n");
+        return 1;
+    }
+    printf("Recovered after a crash: %ld nodes, sum %ld\n", count, expected);
+
+    // The rebuilt free lists hand out all the free memory again, in one block once the list is gone.
+    root = pheap_root(heap);
+    while (root->head != 0) {
+        Node *node = pheap_pointer(heap, root->head);
+        root->head = node->next;
+        pheap_free(heap, node);
+    }
+    pheap_free(heap, root);
+    void *all = pheap_alloc(heap, (1 << 20) - 8192);
+    if (all == NULL || pheap_root(heap) != NULL) {
+        printf("Error: free memory was lost in the recovery.\n");
+        return 1;
+    }
+    pheap_free(heap, all);
+
+    // Freeing it again, or freeing memory that is not an object of the heap, changes nothing.
+    pheap_free(heap, all);
+    pheap_free(heap, (char *)all + 8);
+    pheap_free(heap, &count);
+    void *again = pheap_alloc(heap, (1 << 20) - 8192);
+    if (again != all || pheap_alloc(heap, (1 << 20) - 8192) != NULL) {
+        printf("Error: a double or invalid free changed the heap.\n");
+        return 1;
+    }
+    pheap_free(heap, again);
+    root = pheap_alloc(heap, sizeof(Root));
+    pheap_set_root(heap, root);
+    pheap_close(heap);
+
+    // A heap whose blocks do not add up is not opened after a crash: clear the clean flag,
+    // which follows the magic and version, and break the size of the first block.
+    fd = open(path, O_RDWR);
+    uint32_t clean = 0;
+    uint64_t bad_size = 3;
+    if (pwrite(fd, &clean, sizeof(clean), 12) != sizeof(clean) ||
+        pwrite(fd, &bad_size, sizeof(bad_size), 4096 + 8) != sizeof(bad_size)) {
+        printf("Error: could not corrupt the file.\n");
+        return 1;
+    }
+    close(fd);
+    PHeap *corrupt = pheap_open(path, 0);
+    if (corrupt != NULL || errno != EUCLEAN) {
+        printf("Error: a corrupt heap was opened.\n");
+        return 1;
+    }
+    printf("Corrupt heap rejected: %s\n", strerror(EUCLEAN));
+
+    unlink(path);
+    return 0;
+}
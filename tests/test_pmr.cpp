@@ -0,0 +1,90 @@
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <vector>
+#include "../include/allocator.hpp"
+
+struct alignas(64) Line {
+    char bytes[64];
+};
+
+static size_t allocs() {
+    MallocateStats stats;
+    mallocate_stats(&stats);
+    size_t total = 0;
+    for (size_t count : stats.allocs) {
+        total += count;
+    }
+    return total;
+}
+
+int main() {
+    printf("=== C++ adapters demo ===\n");
+
+    // A pmr vector and map on the allocator's memory resource.
+    size_t before = allocs();
+    {
+        std::pmr::vector<int> numbers(mallocator::default_resource());
+        for (int i = 0; i < 1000; i++) {
+            numbers.push_back(i);
+        }
+        std::pmr::map<int, std::pmr::string> names(mallocator::default_resource());
+        for (int i = 0; i < 100; i++) {
+            names.emplace(i, std::pmr::string(40, 'x'));
+        }
+        printf("\npmr containers: %zu allocations from the allocator\n", allocs() - before);
+        if (allocs() - before < 100 || names.at(7).size() != 40) {
+            printf("Error: the pmr containers did not use the allocator.\n");
+            return 1;
+        }
+    }
+
+    // A std::map with the STL allocator, and over-aligned elements.
+    before = allocs();
+    {
+        std::map<int, int, std::less<int>, mallocator::allocator<std::pair<const int, int>>> nodes;
+        for (int i = 0; i < 100; i++) {
+            nodes[i] = i * i;
+        }
+        std::vector<Line, mallocator::allocator<Line>> lines(10);
+        printf("STL allocator:  %zu allocations, lines aligned to 64: %s\n", allocs() - before,
+               reinterpret_cast<std::uintptr_t>(lines.data()) % 64 == 0 ? "yes" : "no");
+        if (nodes.size() != 100 || reinterpret_cast<std::uintptr_t>(lines.data()) % 64 != 0) {
+            printf("Error: bad STL allocator allocation.\n");
+            return 1;
+        }
+    }
+
+    // A region resource: containers bump-allocate, and release() frees everything at once.
+    mallocator::region_resource region;
+    void *first = nullptr;
+    for (int request = 0; request < 3; request++) {
+        void *data;
+        {
+            std::pmr::vector<std::pmr::string> words(&region);
+            for (int i = 0; i < 200; i++) {
+                words.emplace_back(50, static_cast<char>('a' + request));
+            }
+            data = words.data();
+        }
+        void *line = region.allocate(sizeof(Line), alignof(Line));
+        if (reinterpret_cast<std::uintptr_t>(line) % 64 != 0) {
+            printf("Error: bad region resource alignment.\n");
+            return 1;
+        }
+        if (request == 0) {
+            first = data;
+        }
+        printf("Region request %d: words at %s memory\n", request, data == first ? "the same" : "new");
+        if (data != first) {
+            printf("Error: the region did not reuse its memory after release().\n");
+            return 1;
+        }
+        region.release();
+    }
+
+    printf("\nOK: the containers allocated through the adapters.\n");
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../include/allocator.h"
+
+#define OBJECTS 5000
+#define THREADS 4
+#define ROUNDS 20000
+
+typedef struct Timer {
+    long deadline;
+    void *callback;
+    int id;
+} Timer;
+
+static Pool *shared;
+static int failed = 0;
+
+// Keeps a few objects live at a time, each stamped with the thread's id while it is used.
+static void *churn(void *arg) {
+    long id = (long)arg;
+    Timer *live[16] = {0};
+    for (int i = 0; i < ROUNDS; i++) {
+        int slot = i % 16;
+        if (live[slot] != NULL) {
+            if (live[slot]->id != id || live[slot]->deadline != i - 16) {
+                failed = 1;
+            }
+            mpool_free(shared, live[slot]);
+        }
+        live[slot] = mpool_alloc(shared);
+        live[slot]->id = (int)id;
+        live[slot]->deadline = i;
+    }
+    for (int slot = 0; slot < 16; slot++) {
+        mpool_free(shared, live[slot]);
+    }
+    return NULL;
+}
+
+int main() {
+    printf("=== Object pool demo ===\n");
+
+    Pool *pool = mpool_create(sizeof(Timer), 0);
+    if (pool == NULL) {
+        printf("Error: the pool could not be created.\n");
+        return 1;
+    }
+
+    // Objects are packed back to back, with no header in between.
+    static Timer *timers[OBJECTS];
+    int packed = 0;
+    for (int i = 0; i < OBJECTS; i++) {
+        timers[i] = mpool_alloc(pool);
+        if (timers[i] == NULL || (uintptr_t)timers[i] % 16 != 0) {
+            printf("Error: bad pool allocation.\n");
+            return 1;
+        }
+        memset(timers[i], 0xEE, sizeof(Timer));
+        packed += i > 0 && (char *)timers[i] - (char *)timers[i - 1] == 32;
+    }
+    printf("\n%d objects of %zu bytes, %d right after the previous one\n", OBJECTS, sizeof(Timer), packed);
+    if (packed < OBJECTS * 9 / 10) {
+        printf("Error: the objects are not packed.\n");
+        return 1;
+    }
+
+    // Freed objects are reused, most recently freed first.
+    mpool_free(pool, timers[10]);
+    mpool_free(pool, timers[20]);
+    if (mpool_alloc(pool) != timers[20] || mpool_alloc(pool) != timers[10]) {
+        printf("Error: freed objects were not reused.\n");
+        return 1;
+    }
+    mpool_destroy(pool);
+
+    // Over-aligned objects.
+    Pool *lines = mpool_create(100, 64);
+    for (int i = 0; i < 100; i++) {
+        void *line = mpool_alloc(lines);
+        if ((uintptr_t)line % 64 != 0) {
+            printf("Error: an object is not aligned to 64 bytes.\n");
+            return 1;
+        }
+    }
+    mpool_destroy(lines);
+    if (mpool_create(32, 48) != NULL) {
+        printf("Error: an alignment that is not a power of two was accepted.\n");
+        return 1;
+    }
+
+    // A pool shared by several threads, each with its own magazine.
+    shared = mpool_create(sizeof(Timer), 0);
+    if (!mpool_enable_magazines(shared, 32) || mpool_enable_magazines(shared, 64)) {
+        printf("Error: bad magazine setup.\n");
+        return 1;
+    }
+    pthread_t threads[THREADS];
+    for (long t = 0; t < THREADS; t++) {
+        pthread_create(&threads[t], NULL, churn, (void *)t);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    printf("%d threads x %d allocations with magazines: %s\n", THREADS, ROUNDS, failed ? "corrupted" : "ok");
+    mpool_destroy(shared);
+    if (failed) {
+        printf("Error: an object was handed out twice.\n");
+        return 1;
+    }
+
+    printf("\nOK: pools pack, reuse and share their objects.\n");
+    return 0;
+}
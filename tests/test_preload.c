@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include "../include/allocator.h"
+
+int main() {
+    printf("=== malloc() replacement demo ===\n");
+
+    char *text = malloc(1000);
+    if (text == NULL) {
+        printf("Error: malloc() failed.\n");
+        return 1;
+    }
+    strcpy(text, "allocated with malloc()");
+
+    int *zeros = calloc(256, sizeof(int));
+    for (int i = 0; i < 256; i++) {
+        if (zeros[i] != 0) {
+            printf("Error: calloc() memory is not zeroed.\n");
+            return 1;
+        }
+    }
+
+    text = realloc(text, 4000);
+    if (strcmp(text, "allocated with malloc()") != 0) {
+        printf("Error: realloc() lost the contents.\n");
+        return 1;
+    }
+
+    void *aligned = NULL;
+    if (posix_memalign(&aligned, 4096, 100) != 0 || ((size_t)aligned & 4095) != 0) {
+        printf("Error: posix_memalign() did not return page aligned memory.\n");
+        return 1;
+    }
+
+    // memalign() rounds an alignment that is not a power of two up, like glibc.
+    void *rounded = memalign(48, 100);
+    if (rounded == NULL || ((size_t)rounded & 63) != 0) {
+        printf("Error: memalign() did not round its alignment up.\n");
+        return 1;
+    }
+    free(rounded);
+
+    printf("\nThe standard functions are served by the allocator:\n");
+    print_blocks();
+
+    printf("\nmalloc_usable_size(text) = %zu\n", malloc_usable_size(text));
+
+    free(text);
+    free(zeros);
+    free(aligned);
+    printf("\nAfter freeing everything:\n");
+    print_blocks();
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../include/allocator.h"
+
+#define INTERVAL (64 * 1024)
+#define KEPT 200
+#define KEPT_SIZE 10240
+
+static void *kept[KEPT];
+
+// Objects freed right away: about 150 are sampled, and none should stay in the profile.
+static void __attribute__((noinline)) churn(void) {
+    for (int i = 0; i < 10000; i++) {
+        char *ptr = mallocate(1000);
+        ptr[0] = 1;
+        mfree(ptr);
+    }
+}
+
+// Objects kept alive: about 30 are sampled, and they are all that is in use.
+static void __attribute__((noinline)) keep(void) {
+    for (int i = 0; i < KEPT; i++) {
+        kept[i] = mallocate(KEPT_SIZE);
+        memset(kept[i], 1, KEPT_SIZE);
+    }
+}
+
+int main() {
+    printf("=== Heap profile demo ===\n");
+
+    if (!mallocate_set_option(MALLOCATE_PROFILE_INTERVAL, INTERVAL)) {
+        printf("Error: the profile interval was rejected.\n");
+        return 1;
+    }
+    churn();
+    keep();
+
+    // Sampled objects come from their own mapping, which must still be zeroed for mcalloc().
+    for (int i = 0; i < 1000; i++) {
+        unsigned char *ptr = mcalloc(10, 100);
+        for (int j = 0; j < 1000; j++) {
+            if (ptr[j] != 0) {
+                printf("Error: mcalloc() returned memory that is not zeroed.\n");
+                return 1;
+            }
+        }
+        memset(ptr, 0xFF, 1000);
+        mfree(ptr);
+    }
+
+    char path[] = "/tmp/mallocate-profile-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("Error: no temporary file.\n");
+        return 1;
+    }
+    close(fd);
+    if (!mallocate_profile_dump(path)) {
+        printf("Error: the profile could not be written.\n");
+        return 1;
+    }
+
+    FILE *file = fopen(path, "r");
+    size_t inuse = 0, inuse_bytes = 0, allocs = 0, alloc_bytes = 0, interval = 0;
+    if (file == NULL || fscanf(file, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                               &inuse, &inuse_bytes, &allocs, &alloc_bytes, &interval) != 5) {
+        printf("Error: the profile has no valid header.\n");
+        return 1;
+    }
+    char line[4096];
+    int stacks = 0, libraries = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strcmp(line, "MAPPED_LIBRARIES:\n") == 0) {
+            libraries = 1;
+        } else if (!libraries && strstr(line, "] @ 0x") != NULL) {
+            stacks++;
+        }
+    }
+    fclose(file);
+    unlink(path);
+
+    printf("\nInterval: %zu bytes\n", interval);
+    printf("Sampled:  %zu objects, %zu bytes, at %d stacks\n", allocs, alloc_bytes, stacks);
+    printf("In use:   %zu objects, %zu bytes\n", inuse, inuse_bytes);
+
+    if (interval != INTERVAL || inuse == 0 || inuse_bytes != inuse * KEPT_SIZE || allocs <= inuse ||
+        stacks < 2 || !libraries) {
+        printf("Error: the profile does not match the allocations made.\n");
+        return 1;
+    }
+
+    for (int i = 0; i < KEPT; i++) {
+        mfree(kept[i]);
+    }
+    mallocate_set_option(MALLOCATE_PROFILE_INTERVAL, 0);
+    printf("\nOK: only the objects kept alive are in use in the profile.\n");
+    return 0;
+}
@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/allocator.h"
+
+int main() {
+    printf("=== Reallocation demo ===\n");
+
+    void *a = mallocate(1024);
+    void *b = mallocate(1024);
+    void *c = mallocate(1024);
+    memset(a, 0xAA, 1024);
+    memset(b, 0xBB, 1024);
+
+    mfree(c);
+    printf("\nAfter allocating a, b, c (1024 each) and freeing c:\n");
+    print_blocks();
+
+    // b grows into the free block that follows it.
+    void *grown = mrealloc(b, 4096);
+    printf("\nAfter growing b to 4096 (should stay at the same address: %s):\n",
+           grown == b ? "yes" : "no");
+    print_blocks();
+
+    // a shrinks in place, and the rest becomes a free block.
+    void *shrunk = mrealloc(a, 544);
+    printf("\nAfter shrinking a to 544 (should stay at the same address: %s):\n",
+           shrunk == a ? "yes" : "no");
+    print_blocks();
+
+    unsigned char *bytes = grown;
+    for (int i = 0; i < 1024; i++) {
+        if (bytes[i] != 0xBB) {
+            printf("Error: contents of b were not kept.\n");
+            return 1;
+        }
+    }
+
+    // A block with its own mapping is resized with mremap().
+    void *big = mallocate(1024 * 1024);
+    memset(big, 0xCC, 1024 * 1024);
+    big = mrealloc(big, 4 * 1024 * 1024);
+    printf("\nAfter growing big from 1 MiB to 4 MiB:\n");
+    print_blocks();
+
+    mfree(big);
+    mfree(grown);
+    mfree(shrunk);
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/allocator.h"
+
+#define REQUESTS 3
+#define OBJECTS 500
+#define OBJECT_SIZE 100
+
+static void print_stats(void) {
+    MallocateStats stats;
+    mallocate_stats(&stats);
+    printf("  allocated=%zu, block allocs=%zu, block frees=%zu\n", stats.allocated,
+           stats.allocs[MALLOCATE_CLASS_BLOCK], stats.frees[MALLOCATE_CLASS_BLOCK]);
+}
+
+int main() {
+    printf("=== Region demo ===\n");
+
+    Region *region = region_create(0);
+    if (region == NULL) {
+        printf("Error: the region could not be created.\n");
+        return 1;
+    }
+
+    // Each request allocates its temporaries from the region and resets it at the end.
+    // The chunks stay with the region, so later requests take nothing from the allocator.
+    char *first = NULL;
+    for (int request = 0; request < REQUESTS; request++) {
+        char *objects[OBJECTS];
+        for (int i = 0; i < OBJECTS; i++) {
+            objects[i] = region_alloc(region, OBJECT_SIZE);
+            if (objects[i] == NULL || !is_aligned(objects[i])) {
+                printf("Error: bad region allocation.\n");
+                return 1;
+            }
+            memset(objects[i], request, OBJECT_SIZE);
+        }
+        if (objects[1] - objects[0] != 112) {
+            printf("Error: objects are not bump-allocated.\n");
+            return 1;
+        }
+
+        // A large object gets its own chunk, given back on reset.
+        char *big = region_alloc(region, 64 * 1024);
+        memset(big, request, 64 * 1024);
+
+        printf("\nRequest %d, before reset:\n", request);
+        print_stats();
+        if (request == 0) {
+            first = objects[0];
+        } else if (objects[0] != first) {
+            printf("Error: chunks were not reused after a reset.\n");
+            return 1;
+        }
+        region_reset(region);
+    }
+
+    printf("\nAfter the last reset:\n");
+    print_stats();
+
+    region_destroy(region);
+    printf("\nAfter destroying the region:\n");
+    print_stats();
+
+    return 0;
+}
@@ -0,0 +1,64 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../include/allocator.h"
+
+#define BLOCK_BYTES 1000
+#define OBJECT_BYTES 48
+
+static void *block, *object, *batched;
+
+// Frees both objects twice and 'batched' once from the second arena.
+static void *free_twice(void *arg) {
+    (void)arg;
+    mfree(block);
+    mfree(block);
+    mfree(object);
+    mfree(object);
+    mfree(batched);
+    return NULL;
+}
+
+// Checks that the arena hands out an object of 'size' bytes freed twice only once.
+static int handed_out_once(void *freed, size_t size) {
+    void *a = mallocate(size);
+    void *b = mallocate(size);
+    printf("%zu-byte object at %p freed twice, then handed out at %p and %p\n", size, freed, a, b);
+    int ok = a != b;
+    mfree(a);
+    mfree(b);
+    return ok;
+}
+
+int main() {
+    printf("=== Remote free demo ===\n");
+
+    // Threads take arenas in turn, so the second thread frees into the first thread's arena.
+    setenv("MALLOCATE_ARENAS", "2", 1);
+    block = mallocate(BLOCK_BYTES);
+    object = mallocate(OBJECT_BYTES);
+    batched = mallocate(BLOCK_BYTES);
+    pthread_t thread;
+    pthread_create(&thread, NULL, free_twice, NULL);
+    pthread_join(thread, NULL);
+
+    // The block is still waiting on the remote free stack, so freeing it again is ignored.
+    void *again = batched;
+    mfree_batch(&again, 1);
+
+    // With the thread cache empty, the next small allocation refills it and drains the remote free stacks.
+    mflush_cache();
+    if (!handed_out_once(block, BLOCK_BYTES)) {
+        printf("Error: a block freed twice from another arena was handed out twice.\n");
+        return 1;
+    }
+    if (!handed_out_once(batched, BLOCK_BYTES)) {
+        printf("Error: a block freed from another arena and then in a batch was handed out twice.\n");
+        return 1;
+    }
+    if (!handed_out_once(object, OBJECT_BYTES)) {
+        printf("Error: a small object freed twice from another arena was handed out twice.\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../include/allocator.h"
+
+#define COUNT 300
+
+int main() {
+    printf("=== Slab demo ===\n");
+
+    void *objects[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+        objects[i] = mallocate(32);
+        memset(objects[i], 0xAA, 32);
+    }
+    void *other = mallocate(100);
+    memset(other, 0xBB, 100);
+
+    printf("\nAfter allocating %d objects of 32 bytes and one of 100:\n", COUNT);
+    print_blocks();
+
+    // Objects are kept in the thread cache until flushed back to their slabs.
+    for (int i = 0; i < COUNT; i++) {
+        mfree(objects[i]);
+    }
+    mflush_cache();
+    printf("\nAfter freeing the 32-byte objects (only one of their slabs should remain):\n");
+    print_blocks();
+
+    // Freeing the same object twice must not hand it out twice, in the cache or after it left it.
+    void *x = mallocate(32);
+    mfree(x);
+    mfree(x);
+    mflush_cache();
+    mfree(x);
+    void *y = mallocate(32);
+    void *z = mallocate(32);
+    if (y == z) {
+        printf("Error: double free handed out the same object twice.\n");
+        return 1;
+    }
+
+    // 85 objects of 48 bytes fill a page, so the 16 bytes after them are not a slot.
+    void *w = mallocate(48);
+    char *tail = (char *)((uintptr_t)w & ~(uintptr_t)4095) + 85 * 48;
+    mfree(tail);
+    void *v = mallocate(48);
+    if (musable_size(tail) != 0 || v == tail) {
+        printf("Error: the slack at the end of a slab was taken for an object.\n");
+        return 1;
+    }
+
+    mfree(v);
+    mfree(w);
+    mfree(y);
+    mfree(z);
+    mfree(other);
+    return 0;
+}
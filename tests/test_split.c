@@ -5,20 +5,20 @@
 int main() {
     printf("=== Splitting demo ===\n");
 
-    void *big = mallocate(128);
-    memset(big, 0xAA, 128);
+    void *big = mallocate(4096);
+    memset(big, 0xAA, 4096);
 
-    printf("\nAfter allocating big (128):\n");
+    printf("\nAfter allocating big (4096):\n");
     print_blocks();
 
     mfree(big);
     printf("\nAfter freeing big (should be one large free block):\n");
     print_blocks();
 
-    void *small = mallocate(16);
-    memset(small, 0xBB, 16);
+    void *small = mallocate(1024);
+    memset(small, 0xBB, 1024);
 
-    printf("\nAfter allocating small (16) into free block (should split):\n");
+    printf("\nAfter allocating small (1024) into free block (should split):\n");
     print_blocks();
 
     mfree(small);
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "../include/allocator.h"
+
+#define COUNT 64
+
+static void print_stats(void) {
+    MallocateStats stats;
+    mallocate_stats(&stats);
+
+    printf("  allocated=%zu, free=%zu, fragmentation=%.2f\n", stats.allocated, stats.free, stats.fragmentation);
+    printf("  sbrk calls=%zu, mmap calls=%zu\n", stats.sbrk_calls, stats.mmap_calls);
+    for (int i = 0; i < MALLOCATE_NUM_CLASSES; i++) {
+        if (stats.allocs[i] == 0) {
+            continue;
+        }
+        if (i == MALLOCATE_CLASS_BLOCK) {
+            printf("  blocks: allocs=%zu, frees=%zu\n", stats.allocs[i], stats.frees[i]);
+        } else if (i == MALLOCATE_CLASS_MAPPED) {
+            printf("  mapped blocks: allocs=%zu, frees=%zu\n", stats.allocs[i], stats.frees[i]);
+        } else {
+            printf("  %d-byte objects: allocs=%zu, frees=%zu\n", (i + 1) * 16, stats.allocs[i], stats.frees[i]);
+        }
+    }
+}
+
+int main() {
+    printf("=== Statistics demo ===\n");
+
+    void *small[COUNT];
+    void *blocks[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+        small[i] = mallocate(48);
+        blocks[i] = mallocate(1000);
+    }
+    void *large = mallocate(1024 * 1024);
+
+    printf("\nAfter allocating %d small objects, %d blocks and one large block:\n", COUNT, COUNT);
+    print_stats();
+
+    // Free every other block, leaving holes that cannot be coalesced.
+    for (int i = 0; i < COUNT; i += 2) {
+        mfree(blocks[i]);
+    }
+    printf("\nAfter freeing every other block (fragmented):\n");
+    print_stats();
+
+    for (int i = 0; i < COUNT; i++) {
+        mfree(small[i]);
+        if (i % 2 == 1) {
+            mfree(blocks[i]);
+        }
+    }
+    mfree(large);
+    printf("\nAfter freeing everything:\n");
+    print_stats();
+
+    // A grow in place that fails, because something else moved the break past the block's free
+    // neighbour, moves the block and counts only the bytes it held.
+    MallocateStats before, stats;
+    mallocate_stats(&before);
+    void *keep = mallocate(1000);
+    void *grown = mallocate(2000);
+    sbrk(4096);
+    grown = mrealloc(grown, 200000);
+    mfree(grown);
+    void *live = mallocate(50000);
+    mallocate_stats(&stats);
+    printf("\nAfter a failed grow in place, with %d bytes allocated:\n", 1000 + 50000);
+    print_stats();
+    size_t added = stats.allocated - before.allocated;
+    if (added < 1000 + 50000 || added > 1000 + 50000 + 4096) {
+        printf("Error: allocated bytes drifted after a failed grow in place.\n");
+        return 1;
+    }
+    mfree(live);
+    mfree(keep);
+
+    return 0;
+}
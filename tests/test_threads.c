@@ -0,0 +1,136 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/allocator.h"
+
+#define THREADS 4
+#define ROUNDS 200000
+#define SLOTS 256
+#define EXCHANGE 64
+
+typedef struct Object {
+    unsigned char *ptr;
+    size_t size;
+    unsigned char tag;
+} Object;
+
+// Objects handed from one thread to another, which checks and frees them.
+static Object exchange[EXCHANGE];
+static int exchange_count = 0;
+static pthread_mutex_t exchange_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int corrupted = 0;
+
+static unsigned int next_random(unsigned int *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+// Mostly small objects, some blocks, and now and then one with its own mapping.
+static size_t random_size(unsigned int *seed) {
+    unsigned int kind = next_random(seed) % 100;
+    if (kind < 70) {
+        return 1 + next_random(seed) % 512;
+    }
+    if (kind < 99) {
+        return 513 + next_random(seed) % 8000;
+    }
+    return 128 * 1024 + next_random(seed) % 65536;
+}
+
+// Frees an object after checking that nothing else wrote to it.
+static void check_and_free(Object *object) {
+    for (size_t i = 0; i < object->size; i++) {
+        if (object->ptr[i] != object->tag) {
+            corrupted = 1;
+            break;
+        }
+    }
+    mfree(object->ptr);
+    object->ptr = NULL;
+}
+
+static void *churn(void *arg) {
+    unsigned int seed = (unsigned int)(uintptr_t)arg * 7919 + 1;
+    Object slots[SLOTS] = {{0}};
+    for (int round = 0; round < ROUNDS; round++) {
+        Object *slot = &slots[next_random(&seed) % SLOTS];
+        if (slot->ptr != NULL) {
+            unsigned int action = next_random(&seed) % 4;
+            if (action == 0) {
+                // Hand it to whichever thread takes from the exchange next.
+                pthread_mutex_lock(&exchange_lock);
+                if (exchange_count < EXCHANGE) {
+                    exchange[exchange_count++] = *slot;
+                    slot->ptr = NULL;
+                }
+                pthread_mutex_unlock(&exchange_lock);
+            }
+            if (slot->ptr != NULL) {
+                check_and_free(slot);
+            }
+            continue;
+        }
+
+        // Take an object of another thread now and then, otherwise allocate a new one.
+        if (next_random(&seed) % 4 == 0) {
+            Object taken = {0};
+            pthread_mutex_lock(&exchange_lock);
+            if (exchange_count > 0) {
+                taken = exchange[--exchange_count];
+            }
+            pthread_mutex_unlock(&exchange_lock);
+            if (taken.ptr != NULL) {
+                check_and_free(&taken);
+                continue;
+            }
+        }
+        slot->size = random_size(&seed);
+        slot->tag = (unsigned char)next_random(&seed);
+        slot->ptr = mallocate(slot->size);
+        if (slot->ptr == NULL) {
+            corrupted = 1;
+            break;
+        }
+        memset(slot->ptr, slot->tag, slot->size);
+    }
+
+    for (int i = 0; i < SLOTS; i++) {
+        if (slots[i].ptr != NULL) {
+            check_and_free(&slots[i]);
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    printf("=== Multithreaded churn demo ===\n");
+
+    // More arenas than CPUs would give, so threads share none and free into each other's.
+    setenv("MALLOCATE_ARENAS", "4", 1);
+    pthread_t threads[THREADS];
+    for (long i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, churn, (void *)i);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < exchange_count; i++) {
+        check_and_free(&exchange[i]);
+    }
+    mflush_cache();
+
+    MallocateStats stats;
+    mallocate_stats(&stats);
+    printf("%d threads ran %d rounds each, %zu bytes left allocated\n", THREADS, ROUNDS, stats.allocated);
+    if (corrupted) {
+        printf("Error: an object was overwritten while in use, or could not be allocated.\n");
+        return 1;
+    }
+    if (stats.allocated != 0 || !check_blocks()) {
+        printf("Error: the arenas are inconsistent after the threads exited.\n");
+        return 1;
+    }
+    return 0;
+}
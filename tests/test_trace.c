@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../include/allocator.h"
+
+#define COUNT 100
+
+static const char *op_names[] = {"", "alloc", "calloc", "aligned", "realloc", "free"};
+
+int main() {
+    printf("=== Trace demo ===\n");
+
+    char path[] = "/tmp/mallocate-trace-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("Error: no temporary file.\n");
+        return 1;
+    }
+    close(fd);
+
+    if (!mallocate_trace_start(path)) {
+        printf("Error: the trace could not be started.\n");
+        return 1;
+    }
+    if (mallocate_trace_start(path)) {
+        printf("Error: a second trace was started.\n");
+        return 1;
+    }
+
+    // Every call below is recorded with its size and the pointer it returned or freed.
+    void *blocks[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+        blocks[i] = mallocate(16 + i * 8);
+    }
+    void *zeroed = mcalloc(10, 100);
+    void *aligned = maligned_alloc(256, 1000);
+    blocks[0] = mrealloc(blocks[0], 5000);
+    for (int i = 0; i < COUNT; i++) {
+        mfree(blocks[i]);
+    }
+    mfree(zeroed);
+    mfree(aligned);
+    mallocate_trace_stop();
+
+    // Read the trace back.
+    FILE *file = fopen(path, "rb");
+    MallocateTraceHeader header;
+    if (file == NULL || fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, MALLOCATE_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        printf("Error: the trace has no valid header.\n");
+        return 1;
+    }
+
+    size_t counts[6] = {0};
+    MallocateTraceRecord record;
+    MallocateTraceRecord first_realloc = {0};
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.op >= 1 && record.op <= 5) {
+            counts[record.op]++;
+        }
+        if (record.op == MALLOCATE_TRACE_REALLOC && first_realloc.op == 0) {
+            first_realloc = record;
+        }
+    }
+    fclose(file);
+    unlink(path);
+
+    printf("\nRecords per operation:\n");
+    for (int op = 1; op <= 5; op++) {
+        printf("  %-8s %zu\n", op_names[op], counts[op]);
+    }
+    printf("\nThe realloc: %llu bytes, moved: %s\n", (unsigned long long)first_realloc.size,
+           first_realloc.ptr != first_realloc.arg ? "yes" : "no");
+
+    if (counts[MALLOCATE_TRACE_ALLOC] != COUNT || counts[MALLOCATE_TRACE_CALLOC] != 1 ||
+        counts[MALLOCATE_TRACE_ALIGNED] != 1 || counts[MALLOCATE_TRACE_REALLOC] != 1 ||
+        counts[MALLOCATE_TRACE_FREE] != COUNT + 2) {
+        printf("Error: the trace does not match the calls made.\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include <stdint.h>
+#include <stdio.h>
+#include "../include/allocator.h"
+
+#define HOLES 300
+#define PROBES 2000
+#define SEPARATOR 528
+
+static void *holes[HOLES], *separators[HOLES];
+static size_t sizes[HOLES];
+static int is_free[HOLES];
+static unsigned int seed = 12345;
+
+static unsigned int next_random(void) {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+// Allocates free blocks off the top of the heap until only a small one is left, so the free
+// holes made below are the only blocks in the tree.
+static int plug_top(void **plugs) {
+    int count = 0;
+    MallocateStats stats;
+    mallocate_stats(&stats);
+    while (stats.free > 512 && count < 64) {
+        plugs[count++] = mallocate(stats.free > 65536 ? 65536 : stats.free);
+        mallocate_stats(&stats);
+    }
+    return count;
+}
+
+// The hole best fit must take for 'size' bytes: the smallest that fits, the lowest of equals.
+static int best_fit(size_t size) {
+    int best = -1;
+    for (int i = 0; i < HOLES; i++) {
+        if (is_free[i] && sizes[i] >= size &&
+            (best < 0 || sizes[i] < sizes[best] ||
+             (sizes[i] == sizes[best] && (uintptr_t)holes[i] < (uintptr_t)holes[best]))) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+int main() {
+    printf("=== Free block tree demo ===\n");
+
+    // Holes of 48 sizes, so most sizes appear several times, each between two separators.
+    for (int i = 0; i < HOLES; i++) {
+        holes[i] = mallocate(528 + 16 * (next_random() % 48));
+        sizes[i] = musable_size(holes[i]);
+        separators[i] = mallocate(SEPARATOR);
+    }
+    void *plugs[64];
+    int plug_count = plug_top(plugs);
+
+    // Free the holes in random order.
+    int order[HOLES];
+    for (int i = 0; i < HOLES; i++) {
+        order[i] = i;
+    }
+    for (int i = HOLES - 1; i > 0; i--) {
+        int j = (int)(next_random() % (unsigned int)(i + 1));
+        int swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    for (int i = 0; i < HOLES; i++) {
+        mfree(holes[order[i]]);
+        is_free[order[i]] = 1;
+        if (i % 16 == 0 && !check_blocks()) {
+            printf("Error: inconsistent after freeing %d holes.\n", i + 1);
+            return 1;
+        }
+    }
+    printf("%d holes freed between separators\n", HOLES);
+
+    // Every request lands in the best fitting hole, which splits, then coalesces again when freed.
+    int hits = 0;
+    for (int i = 0; i < PROBES; i++) {
+        size_t size = 513 + next_random() % 800;
+        int best = best_fit((size + 15) & ~(size_t)15);
+        void *ptr = mallocate(size);
+        if (best >= 0 && ptr != holes[best]) {
+            printf("Error: %zu bytes went to %p, not to the %zu-byte hole at %p.\n", size, ptr, sizes[best],
+                   holes[best]);
+            return 1;
+        }
+        hits += best >= 0;
+
+        // Keep some holes taken for a while, so the tree changes shape.
+        if (best >= 0 && next_random() % 4 == 0) {
+            is_free[best] = 0;
+        } else {
+            mfree(ptr);
+        }
+        if (i % 64 == 0 && !check_blocks()) {
+            printf("Error: inconsistent after %d requests.\n", i + 1);
+            return 1;
+        }
+    }
+    printf("%d of %d requests served best fit from a hole\n", hits, PROBES);
+
+    // Taking out the separators merges everything back into a few large free blocks.
+    for (int i = 0; i < HOLES; i++) {
+        mfree(separators[order[i]]);
+        if (!is_free[order[i]]) {
+            mfree(holes[order[i]]);
+        }
+        if (i % 16 == 0 && !check_blocks()) {
+            printf("Error: inconsistent after coalescing %d separators.\n", i + 1);
+            return 1;
+        }
+    }
+    for (int i = 0; i < plug_count; i++) {
+        mfree(plugs[i]);
+    }
+    if (!check_blocks()) {
+        printf("Error: inconsistent after freeing everything.\n");
+        return 1;
+    }
+    printf("Tree consistent after freeing everything\n");
+    return 0;
+}
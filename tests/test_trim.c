@@ -0,0 +1,79 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "../include/allocator.h"
+
+#define BLOCKS 8000
+#define BLOCK_BYTES 1000
+#define LARGE_BYTES 100000
+
+static void *blocks[BLOCKS];
+
+// Returns 1 if the page holding 'ptr' is in memory.
+static int resident(void *ptr) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    unsigned char in_core = 0;
+    mincore((void *)((uintptr_t)ptr & ~(uintptr_t)(page_size - 1)), (size_t)page_size, &in_core);
+    return in_core & 1;
+}
+
+int main() {
+    // The C library would allocate the stdout buffer with its own malloc(), which moves the break
+    // past the heap and keeps it from being trimmed.
+    static char output[BUFSIZ];
+    setvbuf(stdout, output, _IOLBF, sizeof(output));
+    printf("=== Heap growth and trimming demo ===\n");
+
+    // About 8 MiB in small steps: the heap grows in doubling steps, not once per 64 KiB.
+    MallocateStats before, grown, trimmed;
+    mallocate_stats(&before);
+    for (int i = 0; i < BLOCKS; i++) {
+        blocks[i] = mallocate(BLOCK_BYTES);
+        memset(blocks[i], 0x5A, BLOCK_BYTES);
+    }
+    mallocate_stats(&grown);
+    size_t sbrk_calls = grown.sbrk_calls - before.sbrk_calls;
+    printf("%d blocks of %d bytes: %zu bytes mapped with %zu sbrk() calls\n", BLOCKS, BLOCK_BYTES,
+           grown.mapped - before.mapped, sbrk_calls);
+    if (sbrk_calls == 0 || sbrk_calls > 16) {
+        printf("Error: the heap did not grow in doubling steps.\n");
+        return 1;
+    }
+
+    // Freeing a block that leaves a large free block inside the heap gives its pages back,
+    // but keeps them mapped.
+    void *large[4];
+    for (int i = 0; i < 4; i++) {
+        large[i] = mallocate(LARGE_BYTES);
+        memset(large[i], 0x5A, LARGE_BYTES);
+    }
+    void *after = mallocate(BLOCK_BYTES);
+    MallocateStats unpurged, purged;
+    mallocate_stats(&unpurged);
+    for (int i = 0; i < 3; i++) {
+        mfree(large[i]);
+    }
+    mallocate_stats(&purged);
+    void *middle = (char *)large[2] + LARGE_BYTES / 2;
+    printf("Middle of the last of 3 freed %d-byte blocks resident: %s\n", LARGE_BYTES, resident(middle) ? "yes" : "no");
+    if (resident(middle) || purged.mapped != unpurged.mapped) {
+        printf("Error: the pages of a large interior free block were not released.\n");
+        return 1;
+    }
+    mfree(large[3]);
+    mfree(after);
+
+    // Freeing the top of the heap moves the break back down.
+    for (int i = BLOCKS - 1; i >= 0; i--) {
+        mfree(blocks[i]);
+    }
+    mallocate_stats(&trimmed);
+    printf("After freeing everything: %zu bytes mapped, %zu at the peak\n", trimmed.mapped, grown.mapped);
+    if (trimmed.mapped > before.mapped + 1024 * 1024) {
+        printf("Error: the heap was not trimmed.\n");
+        return 1;
+    }
+    return 0;
+}